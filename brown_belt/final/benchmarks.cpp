@@ -0,0 +1,713 @@
+#include "benchmarks.h"
+#include "city_generator.h"
+#include "guider.h"
+#include "input_parsing.h"
+#include "json.h"
+#include "lru_cache.h"
+#include "metrics.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+	using Clock = chrono::steady_clock;
+
+	double MillisecondsSince(Clock::time_point start) {
+		return chrono::duration<double, milli>(Clock::now() - start).count();
+	}
+
+	const vector<pair<string, RouterType>> ROUTERS = {
+		{ "floyd_warshall", RouterType::FLOYD_WARSHALL },
+		{ "dijkstra", RouterType::DIJKSTRA },
+		{ "a_star", RouterType::A_STAR },
+		{ "contraction_hierarchy", RouterType::CONTRACTION_HIERARCHY },
+	};
+
+	// Floyd-Warshall is cubic, bigger cities would take hours
+	const size_t FLOYD_WARSHALL_MAX_STOPS = 300;
+
+	void BenchmarkRouter(const string& title, const Json::Document& doc, const string& router_name, RouterType router) {
+		vector<Query> queries = ReadQueries(doc);
+		TransportGuider guider;
+		vector<RouteQuery*> routes;
+		for (auto& query : queries) {
+			if (auto* settings = get_if<SettingsQuery>(&query)) {
+				settings->router = router;
+			}
+			if (auto* route = get_if<RouteQuery>(&query)) {
+				routes.push_back(route);
+			}
+			else {
+				guider.ProcessQuery(query);
+			}
+		}
+
+		const auto build_start = Clock::now();
+		guider.BuildRoutes();
+		const double build_ms = MillisecondsSince(build_start);
+
+		const auto query_start = Clock::now();
+		size_t found = 0;
+		for (RouteQuery* route : routes) {
+			found += guider.ProcessGetRouteInfoQuery(*route).found;
+		}
+		const double query_ms = MillisecondsSince(query_start);
+
+		// the same queries again come from the route cache
+		const auto repeat_start = Clock::now();
+		for (RouteQuery* route : routes) {
+			guider.ProcessGetRouteInfoQuery(*route);
+		}
+		const double repeat_ms = MillisecondsSince(repeat_start);
+		const CacheStats cache = guider.RouteCacheStats();
+
+		const double per_query = routes.empty() ? 0.0 : 1000.0 / routes.size();
+		cout << setw(24) << left << title << setw(24) << router_name << right
+			<< setw(12) << fixed << setprecision(1) << build_ms << " ms"
+			<< setw(12) << setprecision(2) << query_ms * per_query << " us/query"
+			<< setw(8) << found << "/" << routes.size() << " found"
+			<< setw(10) << repeat_ms * per_query << " us/query repeated"
+			<< setw(8) << cache.hits << " hits " << cache.misses << " misses "
+			<< cache.bytes / 1024 << " KB cached" << endl;
+	}
+
+	// Full-width router against float weights and 32-bit ids: database size and query latency
+	void BenchmarkCompactRouter(const string& title, const Json::Document& doc, const string& router_name, RouterType router) {
+		for (const bool compact : { false, true }) {
+			vector<Query> queries = ReadQueries(doc);
+			TransportGuider guider;
+			vector<RouteQuery*> routes;
+			for (auto& query : queries) {
+				if (auto* settings = get_if<SettingsQuery>(&query)) {
+					settings->router = router;
+					settings->compact_router = compact;
+				}
+				if (auto* route = get_if<RouteQuery>(&query)) {
+					routes.push_back(route);
+				}
+				else {
+					guider.ProcessQuery(query);
+				}
+			}
+			guider.Finalize();
+			guider.BuildRoutes();
+			ostringstream base;
+			guider.Serialize(base);
+
+			const auto start = Clock::now();
+			for (RouteQuery* route : routes) {
+				guider.ProcessGetRouteInfoQuery(*route);
+			}
+			const double ms = MillisecondsSince(start);
+			cout << setw(24) << left << title << setw(24) << router_name << setw(8) << (compact ? "float" : "double") << right
+				<< setw(12) << base.str().size() / 1024 << " KB base"
+				<< setw(12) << fixed << setprecision(2) << (routes.empty() ? 0.0 : ms * 1000 / routes.size()) << " us/query" << endl;
+		}
+	}
+
+	void BenchmarkRouters(const string& title, const Json::Document& doc, size_t stop_count) {
+		for (const auto& [name, router] : ROUTERS) {
+			if (router == RouterType::FLOYD_WARSHALL && stop_count > FLOYD_WARSHALL_MAX_STOPS) {
+				cout << setw(24) << left << title << setw(24) << name << "skipped: too many stops" << endl;
+				continue;
+			}
+			BenchmarkRouter(title, doc, name, router);
+		}
+	}
+
+	void BenchmarkAlternativeRoutes(const string& title, const Json::Document& doc, size_t count) {
+		vector<Query> queries = ReadQueries(doc);
+		TransportGuider guider;
+		vector<RoutesQuery> alternatives;
+		for (auto& query : queries) {
+			if (auto* settings = get_if<SettingsQuery>(&query)) {
+				settings->router = RouterType::CONTRACTION_HIERARCHY;
+			}
+			if (const auto* route = get_if<RouteQuery>(&query)) {
+				alternatives.emplace_back(route->from, route->to, count, route->req_id);
+			}
+			else {
+				guider.ProcessQuery(query);
+			}
+		}
+		guider.BuildRoutes();
+
+		const auto start = Clock::now();
+		size_t found = 0;
+		for (RoutesQuery& query : alternatives) {
+			found += guider.ProcessGetRoutesInfoQuery(query).routes.size();
+		}
+		const double ms = MillisecondsSince(start);
+		cout << setw(24) << left << title << right << setw(4) << count << " routes"
+			<< setw(12) << fixed << setprecision(2) << (alternatives.empty() ? 0.0 : ms * 1000 / alternatives.size()) << " us/query"
+			<< setw(10) << found << " routes found for " << alternatives.size() << " queries" << endl;
+	}
+
+	// A side x side matrix of stops against the same cells queried as single routes
+	void BenchmarkMatrix(const string& title, const Json::Document& doc, const string& router_name, RouterType router, size_t side) {
+		vector<Query> queries = ReadQueries(doc);
+		TransportGuider guider;
+		vector<string> stops;
+		for (auto& query : queries) {
+			if (auto* settings = get_if<SettingsQuery>(&query)) {
+				settings->router = router;
+			}
+			if (const auto* stop = get_if<StopQuery>(&query); stop && stops.size() < side) {
+				stops.push_back(stop->stop_name);
+			}
+			if (!holds_alternative<RouteQuery>(query)) {
+				guider.ProcessQuery(query);
+			}
+		}
+		guider.BuildRoutes();
+
+		MatrixQuery matrix(stops, stops, 0);
+		const auto matrix_start = Clock::now();
+		const GetMatrixInfo info = guider.ProcessGetMatrixInfoQuery(matrix);
+		const double matrix_ms = MillisecondsSince(matrix_start);
+
+		// a cell from every row and column is enough to estimate the per-pair path
+		const auto pairs_start = Clock::now();
+		for (size_t i = 0; i < stops.size(); ++i) {
+			RouteQuery route(stops[i], stops[(i + stops.size() / 2) % stops.size()], 0);
+			guider.ProcessGetRouteInfoQuery(route);
+		}
+		const double pairs_ms = MillisecondsSince(pairs_start);
+
+		const double matrix_us = matrix_ms * 1000 / info.times.size(), pair_us = pairs_ms * 1000 / stops.size();
+		cout << setw(24) << left << title << setw(24) << router_name << right
+			<< setw(6) << side << "x" << side
+			<< setw(12) << fixed << setprecision(1) << matrix_ms << " ms"
+			<< setw(12) << setprecision(3) << matrix_us << " us/cell"
+			<< setw(12) << pair_us << " us/cell by routes"
+			<< setw(10) << setprecision(1) << pair_us / matrix_us << "x" << endl;
+	}
+
+	void BenchmarkParallelQueries(const Json::Document& doc) {
+		cout << "Stat queries with contraction hierarchy: wall time by thread count" << endl;
+		const size_t max_threads = max(1u, thread::hardware_concurrency());
+		double single_thread_ms = 0;
+		for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+			vector<Query> queries = ReadQueries(doc);
+			for (auto& query : queries) {
+				if (auto* settings = get_if<SettingsQuery>(&query)) {
+					settings->router = RouterType::CONTRACTION_HIERARCHY;
+				}
+			}
+			TransportGuider guider;
+			ostringstream output;
+			const auto start = Clock::now();
+			guider.ProcessQueriesParallel(move(queries), thread_count, output);
+			const double ms = MillisecondsSince(start);
+			if (thread_count == 1) single_thread_ms = ms;
+			cout << setw(8) << thread_count << " threads" << setw(12) << fixed << setprecision(1) << ms << " ms"
+				<< setw(10) << setprecision(2) << single_thread_ms / ms << "x" << endl;
+		}
+	}
+
+	// Threads looking up skewed keys, a few of them hot, in one cache
+	template <typename Cache>
+	double CacheContentionMs(Cache& cache, size_t thread_count, size_t lookups, size_t key_count) {
+		const auto start = Clock::now();
+		vector<thread> threads;
+		for (size_t t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&cache, t, lookups, key_count] {
+				mt19937 gen(static_cast<unsigned>(t));
+				for (size_t i = 0; i < lookups; ++i) {
+					const int key = static_cast<int>((gen() % key_count) * (gen() % key_count) / key_count);
+					if (!cache.Get(key)) {
+						cache.Put(key, to_string(key));
+					}
+				}
+			});
+		}
+		for (thread& t : threads) {
+			t.join();
+		}
+		return MillisecondsSince(start);
+	}
+
+	void BenchmarkCacheContention() {
+		cout << "Route cache under contention: one lock against shards" << endl;
+		const size_t lookups = 1000000, key_count = 4096;
+		auto sizer = [](const string& value) { return value.size(); };
+		const size_t max_threads = max(1u, thread::hardware_concurrency());
+		for (size_t thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+			LruCache<int, string> single(1 << 20, sizer);
+			ShardedLruCache<int, string> sharded(1 << 20, sizer);
+			const double single_ms = CacheContentionMs(single, thread_count, lookups / thread_count, key_count);
+			const double sharded_ms = CacheContentionMs(sharded, thread_count, lookups / thread_count, key_count);
+			cout << setw(8) << thread_count << " threads" << setw(12) << fixed << setprecision(1) << single_ms << " ms single"
+				<< setw(12) << sharded_ms << " ms sharded" << setw(10) << setprecision(2) << single_ms / sharded_ms << "x" << endl;
+		}
+	}
+
+	void BenchmarkMetricsOverhead(const Json::Document& doc) {
+		cout << "Stat queries with contraction hierarchy: metrics disabled and enabled" << endl;
+		for (const bool enabled : { false, true }) {
+			vector<Query> queries = ReadQueries(doc);
+			for (auto& query : queries) {
+				if (auto* settings = get_if<SettingsQuery>(&query)) {
+					settings->router = RouterType::CONTRACTION_HIERARCHY;
+				}
+			}
+			TransportGuider guider;
+			ostringstream output;
+			Metrics::Instance().Reset();
+			Metrics::Enable(enabled);
+			const auto start = Clock::now();
+			guider.ProcessQueries(move(queries), output);
+			const double ms = MillisecondsSince(start);
+			Metrics::Enable(false);
+			const LatencyHistogram& routes = Metrics::Instance().Histogram(Phase::ROUTE_QUERY);
+			cout << setw(10) << (enabled ? "enabled" : "disabled") << setw(12) << fixed << setprecision(1) << ms << " ms";
+			if (enabled) {
+				cout << setw(10) << routes.Count() << " routes, p50 " << routes.Percentile(0.5) << " ns, p99 "
+					<< routes.Percentile(0.99) << " ns, max " << routes.Max() << " ns";
+			}
+			cout << endl;
+		}
+		Metrics::Instance().Reset();
+	}
+
+	// Repeats parsing for at least this long to get a stable figure
+	const double PARSE_BENCHMARK_MS = 300;
+
+	template <typename Parse>
+	double ParseThroughput(const string& text, Parse parse) {
+		size_t runs = 0;
+		const auto start = Clock::now();
+		do {
+			parse(text);
+			++runs;
+		} while (MillisecondsSince(start) < PARSE_BENCHMARK_MS);
+		return text.size() * runs / (MillisecondsSince(start) * 1000);
+	}
+
+	void BenchmarkParser(const string& title, const string& text) {
+		const double stream_mbps = ParseThroughput(text, [](const string& text) {
+			istringstream input(text);
+			return Json::LoadStream(input);
+		});
+		const double buffered_mbps = ParseThroughput(text, [](const string& text) {
+			return Json::Load(string_view(text));
+		});
+		const double tree_queries_mbps = ParseThroughput(text, [](const string& text) {
+			return ReadQueries(Json::Load(string_view(text)));
+		});
+		const double event_queries_mbps = ParseThroughput(text, [](const string& text) {
+			return ReadQueries(string_view(text));
+		});
+		cout << setw(24) << left << title << right << setw(10) << text.size() / 1024 << " KB"
+			<< setw(10) << fixed << setprecision(1) << stream_mbps << " MB/s stream"
+			<< setw(10) << buffered_mbps << " MB/s buffered"
+			<< setw(10) << tree_queries_mbps << " MB/s queries from tree"
+			<< setw(10) << event_queries_mbps << " MB/s queries from events" << endl;
+	}
+
+	// Counts the allocations passed on to the resource it wraps
+	class CountingResource : public pmr::memory_resource {
+	public:
+		explicit CountingResource(pmr::memory_resource* upstream) : upstream_(upstream) {}
+
+		size_t Allocations() const {
+			return allocations_;
+		}
+
+	private:
+		void* do_allocate(size_t bytes, size_t alignment) override {
+			++allocations_;
+			return upstream_->allocate(bytes, alignment);
+		}
+		void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+			upstream_->deallocate(p, bytes, alignment);
+		}
+		bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+			return this == &other;
+		}
+
+		pmr::memory_resource* upstream_;
+		size_t allocations_ = 0;
+	};
+
+	void BenchmarkAllocation(const string& title, const string& text) {
+		const size_t runs = 5;
+		cout << setw(24) << left << title << right;
+		for (const auto& [name, allocation] : { pair{ "heap", Json::Allocation::HEAP }, pair{ "arena", Json::Allocation::ARENA } }) {
+			CountingResource counter(pmr::new_delete_resource());
+			pmr::memory_resource* const previous = pmr::set_default_resource(&counter);
+			double load_ms = 0, destroy_ms = 0;
+			for (size_t run = 0; run < runs; ++run) {
+				const auto load_start = Clock::now();
+				auto doc = make_unique<Json::Document>(Json::Load(string_view(text), allocation));
+				load_ms += MillisecondsSince(load_start);
+				const auto destroy_start = Clock::now();
+				doc.reset();
+				destroy_ms += MillisecondsSince(destroy_start);
+			}
+			pmr::set_default_resource(previous);
+			cout << setw(8) << name << fixed << setprecision(1)
+				<< setw(9) << load_ms / runs << " ms load"
+				<< setw(9) << destroy_ms / runs << " ms destroy"
+				<< setw(10) << counter.Allocations() / runs << " allocations";
+		}
+		cout << endl;
+	}
+
+	void BenchmarkGeoLengths(size_t point_count, size_t segment_count) {
+		mt19937 generator(0);
+		uniform_real_distribution<double> latitude(55.5, 56.0), longitude(37.3, 37.9);
+		vector<Coordinates> coords(point_count);
+		for (Coordinates& point : coords) {
+			point = { latitude(generator), longitude(generator) };
+		}
+		uniform_int_distribution<size_t> point_id(0, point_count - 1);
+		vector<size_t> route(segment_count + 1);
+		for (size_t& id : route) {
+			id = point_id(generator);
+		}
+
+		vector<double> scalar(segment_count);
+		const auto scalar_start = Clock::now();
+		for (size_t i = 0; i < segment_count; ++i) {
+			scalar[i] = Length(coords[route[i]], coords[route[i + 1]]);
+		}
+		const double scalar_ms = MillisecondsSince(scalar_start);
+
+		const auto points_start = Clock::now();
+		const GeoPoints points(coords);
+		const double points_ms = MillisecondsSince(points_start);
+		vector<double> batched;
+		const auto batched_start = Clock::now();
+		points.SegmentLengths(route, batched);
+		const double batched_ms = MillisecondsSince(batched_start);
+
+		double max_error = 0;
+		for (size_t i = 0; i < segment_count; ++i) {
+			max_error = max(max_error, abs(scalar[i] - batched[i]));
+		}
+		cout << setw(10) << segment_count << " segments" << fixed << setprecision(2)
+			<< setw(10) << scalar_ms * 1e6 / segment_count << " ns scalar"
+			<< setw(10) << batched_ms * 1e6 / segment_count << " ns batched"
+			<< setw(10) << scalar_ms / batched_ms << "x"
+			<< setw(10) << points_ms << " ms to prepare " << point_count << " points"
+			<< setw(12) << scientific << max_error << " m max difference" << defaultfloat << endl;
+	}
+
+	// Index against a scan over all the points, microseconds per query
+	void BenchmarkGeoIndex(size_t point_count, size_t query_count) {
+		mt19937 generator(0);
+		uniform_real_distribution<double> latitude(55.5, 56.0), longitude(37.3, 37.9);
+		vector<Coordinates> coords(point_count), queries(query_count);
+		for (Coordinates& point : coords) {
+			point = { latitude(generator), longitude(generator) };
+		}
+		for (Coordinates& point : queries) {
+			point = { latitude(generator), longitude(generator) };
+		}
+
+		const auto build_start = Clock::now();
+		const GeoIndex index(coords);
+		const double build_ms = MillisecondsSince(build_start);
+
+		const size_t count = 10;
+		const double radius = 500;
+		size_t found = 0;
+		const auto nearest_start = Clock::now();
+		for (const Coordinates& point : queries) {
+			index.Nearest(point, count);
+		}
+		const double nearest_us = MillisecondsSince(nearest_start) * 1000 / query_count;
+		const auto radius_start = Clock::now();
+		for (const Coordinates& point : queries) {
+			found += index.WithinRadius(point, radius).size();
+		}
+		const double radius_us = MillisecondsSince(radius_start) * 1000 / query_count;
+
+		const auto scan_start = Clock::now();
+		vector<double> lengths(point_count);
+		for (const Coordinates& point : queries) {
+			for (size_t id = 0; id < point_count; ++id) {
+				lengths[id] = Length(point, coords[id]);
+			}
+			nth_element(lengths.begin(), lengths.begin() + count, lengths.end());
+		}
+		const double scan_us = MillisecondsSince(scan_start) * 1000 / query_count;
+
+		cout << setw(8) << point_count << " points" << fixed << setprecision(2)
+			<< setw(10) << build_ms << " ms build"
+			<< setw(10) << nearest_us << " us nearest " << count
+			<< setw(10) << radius_us << " us within " << static_cast<int>(radius) << " m"
+			<< setw(12) << scan_us << " us scan for nearest " << count << defaultfloat
+			<< setw(10) << found / query_count << " within on average" << endl;
+	}
+
+	string ToText(const Json::Document& doc) {
+		ostringstream output;
+		Json::UploadDocument(doc, output);
+		return output.str();
+	}
+
+	size_t CountStops(const Json::Document& doc) {
+		size_t count = 0;
+		for (const auto& request : doc.GetRoot().AsMap().at("base_requests").AsArray()) {
+			count += request.AsMap().at("type").AsString() == "Stop";
+		}
+		return count;
+	}
+
+	// High-water mark of the resident memory of the process
+	size_t PeakRssKilobytes() {
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+		return counters.PeakWorkingSetSize / 1024;
+#elif defined(__APPLE__)
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss / 1024; // bytes there
+#else
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+#endif
+	}
+
+	double PhaseMilliseconds(Phase phase) {
+		return Metrics::Instance().Histogram(phase).Total() / 1e6;
+	}
+
+	double PercentileMicroseconds(Phase phase, double quantile) {
+		return Metrics::Instance().Histogram(phase).Percentile(quantile) / 1e3;
+	}
+
+	vector<string> SplitList(const string& list) {
+		vector<string> items;
+		istringstream input(list);
+		for (string item; getline(input, item, ',');) {
+			items.push_back(item);
+		}
+		return items;
+	}
+}
+
+void RunCityBenchmark(const vector<string>& args) {
+	if (args.empty()) {
+		throw invalid_argument("bench_city needs an input file");
+	}
+	ifstream input(args[0], ios::binary);
+	if (!input) {
+		throw runtime_error("Can't open " + args[0]);
+	}
+	const string text{ istreambuf_iterator<char>(input), istreambuf_iterator<char>() };
+	const string router_name = args.size() > 1 ? args[1] : "default";
+
+	Metrics::Instance().Reset();
+	Metrics::Enable();
+	const auto start = Clock::now();
+	vector<Query> queries = ReadQueries(string_view(text));
+	size_t stop_count = 0;
+	for (auto& query : queries) {
+		if (auto* settings = get_if<SettingsQuery>(&query); settings && args.size() > 1) {
+			settings->router = ParseRouterType(router_name);
+		}
+		stop_count += holds_alternative<StopQuery>(query);
+	}
+	TransportGuider guider;
+	ostringstream output;
+	guider.ProcessQueries(move(queries), output);
+	const double wall_ms = MillisecondsSince(start);
+	Metrics::Enable(false);
+	const size_t peak_rss_kb = PeakRssKilobytes();
+
+	cout << setw(28) << left << args[0] << setw(24) << router_name << right << setw(8) << stop_count << " stops"
+		<< fixed << setprecision(1)
+		<< setw(10) << PhaseMilliseconds(Phase::PARSE) << " ms parse"
+		<< setw(10) << PhaseMilliseconds(Phase::BASE_APPLY) + PhaseMilliseconds(Phase::FINALIZE) << " ms base"
+		<< setw(10) << PhaseMilliseconds(Phase::GRAPH_BUILD) << " ms graph"
+		<< setw(10) << PhaseMilliseconds(Phase::ROUTER_PREPROCESSING) << " ms router"
+		<< setw(10) << PercentileMicroseconds(Phase::ROUTE_QUERY, 0.5) << "/" << PercentileMicroseconds(Phase::ROUTE_QUERY, 0.99)
+		<< " us route p50/p99"
+		<< setw(8) << PercentileMicroseconds(Phase::STOP_QUERY, 0.5) << " us stop"
+		<< setw(8) << PercentileMicroseconds(Phase::BUS_QUERY, 0.5) << " us bus"
+		<< setw(10) << peak_rss_kb / 1024.0 << " MB peak RSS" << endl;
+
+	if (args.size() > 2) {
+		ofstream report(args[2]);
+		Json::UploadDocument(Json::Document(Json::Node(map<string, Json::Node>{
+			{ "input", Json::Node(args[0]) },
+			{ "router", Json::Node(router_name) },
+			{ "stops", Json::Node(static_cast<double>(stop_count)) },
+			{ "input_bytes", Json::Node(static_cast<double>(text.size())) },
+			{ "wall_ms", Json::Node(wall_ms) },
+			{ "peak_rss_kb", Json::Node(static_cast<double>(peak_rss_kb)) },
+			{ "metrics", Metrics::Instance().ToJson() },
+		})), report);
+	}
+	Metrics::Instance().Reset();
+}
+
+void RunBenchmarkSuite(const string& program, const vector<string>& args) {
+	vector<size_t> scales = { 1000, 10000, 100000 };
+	vector<string> routers;
+	for (const auto& [name, router] : ROUTERS) {
+		routers.push_back(name);
+	}
+	string city_args;
+	vector<string> city_params;
+	for (const string& arg : args) {
+		if (arg.rfind("scales=", 0) == 0) {
+			scales.clear();
+			for (const string& scale : SplitList(arg.substr(7))) {
+				scales.push_back(stoul(scale));
+			}
+		}
+		else if (arg.rfind("routers=", 0) == 0) {
+			routers = SplitList(arg.substr(8));
+		}
+		else {
+			city_params.push_back(arg);
+			city_args += " " + arg;
+		}
+	}
+	ParseCityParams(city_params); // fails here rather than in every child
+
+	cout << "City suite: every router over synthetic cities, one process per run" << endl;
+	for (const size_t scale : scales) {
+		const string path = "bench_city_" + to_string(scale) + ".json";
+		const string generate = "\"" + program + "\" generate stop_count=" + to_string(scale)
+			+ " bus_count=" + to_string(max<size_t>(1, scale / 10))
+			+ " stop_requests=1000 bus_requests=1000 route_requests=1000" + city_args + " > " + path;
+		if (system(generate.c_str()) != 0) {
+			cerr << "Can't generate " << path << endl;
+			continue;
+		}
+		for (const string& router : routers) {
+			if (ParseRouterType(router) == RouterType::FLOYD_WARSHALL && scale > FLOYD_WARSHALL_MAX_STOPS) {
+				continue;
+			}
+			cout.flush();
+			if (system(("\"" + program + "\" bench_city " + path + " " + router).c_str()) != 0) {
+				cerr << "bench_city failed on " << path << " with " << router << endl;
+			}
+		}
+		remove(path.c_str());
+	}
+}
+
+void RunBenchmarks(const vector<string>& args) {
+	vector<pair<string, string>> inputs;
+	for (const string& path : args) {
+		ifstream input(path);
+		if (!input) {
+			cerr << "Can't open " << path << endl;
+			continue;
+		}
+		inputs.push_back({ path, ToText(Json::Load(input)) });
+	}
+	CityParams big_city;
+	big_city.stop_count = 20000;
+	big_city.bus_count = 2000;
+	big_city.route_requests = 20000;
+	inputs.push_back({ "synthetic 20000 stops", ToText(GenerateCity(big_city)) });
+
+	cout << "JSON parsing: stream parser against buffered one" << endl;
+	for (const auto& [title, text] : inputs) {
+		BenchmarkParser(title, text);
+	}
+
+	cout << "JSON documents: node allocation on the heap against an arena" << endl;
+	for (const auto& [title, text] : inputs) {
+		BenchmarkAllocation(title, text);
+	}
+	inputs.pop_back();
+
+	cout << "Great-circle lengths: scalar Length against batched GeoPoints" << endl;
+	BenchmarkGeoLengths(20000, 1000000);
+
+	cout << "Nearby stops: k-d tree against a scan over all stops" << endl;
+	for (size_t point_count : { 1000, 10000, 100000 }) {
+		BenchmarkGeoIndex(point_count, 2000);
+	}
+
+	cout << "Routers: preprocessing time and average route query latency" << endl;
+	for (const auto& [path, text] : inputs) {
+		const Json::Document doc = Json::Load(string_view(text));
+		BenchmarkRouters(path, doc, CountStops(doc));
+	}
+	for (size_t stop_count : { 250, 2000, 10000 }) {
+		CityParams params;
+		params.stop_count = stop_count;
+		params.bus_count = stop_count / 10;
+		params.stops_per_bus = 20;
+		params.route_requests = 2000;
+		BenchmarkRouters("synthetic " + to_string(stop_count) + " stops", GenerateCity(params), stop_count);
+	}
+
+	cout << "Compact routers: float weights and 32-bit ids" << endl;
+	for (size_t stop_count : { 250, 10000 }) {
+		CityParams params;
+		params.stop_count = stop_count;
+		params.bus_count = stop_count / 10;
+		params.stops_per_bus = 20;
+		params.route_requests = 2000;
+		const Json::Document doc = GenerateCity(params);
+		for (const auto& [name, router] : ROUTERS) {
+			if (router != RouterType::FLOYD_WARSHALL || stop_count <= FLOYD_WARSHALL_MAX_STOPS) {
+				BenchmarkCompactRouter("synthetic " + to_string(stop_count) + " stops", doc, name, router);
+			}
+		}
+	}
+
+	cout << "Alternative routes with contraction hierarchy spurs" << endl;
+	for (size_t stop_count : { 2000, 10000 }) {
+		CityParams params;
+		params.stop_count = stop_count;
+		params.bus_count = stop_count / 10;
+		params.stops_per_bus = 20;
+		params.route_requests = 500;
+		const Json::Document doc = GenerateCity(params);
+		for (size_t count : { 1, 3, 5 }) {
+			BenchmarkAlternativeRoutes("synthetic " + to_string(stop_count) + " stops", doc, count);
+		}
+	}
+
+	cout << "Travel-time matrices against single route queries" << endl;
+	for (size_t stop_count : { 2000, 10000 }) {
+		CityParams params;
+		params.stop_count = stop_count;
+		params.bus_count = stop_count / 10;
+		params.stops_per_bus = 20;
+		params.route_requests = 0;
+		const Json::Document doc = GenerateCity(params);
+		for (const auto& [name, router] : ROUTERS) {
+			if (router != RouterType::FLOYD_WARSHALL) {
+				BenchmarkMatrix("synthetic " + to_string(stop_count) + " stops", doc, name, router, 500);
+			}
+		}
+	}
+
+	CityParams params;
+	params.stop_count = 10000;
+	params.bus_count = 1000;
+	params.route_requests = 100000;
+	const Json::Document doc = GenerateCity(params);
+	BenchmarkParallelQueries(doc);
+	BenchmarkCacheContention();
+	BenchmarkMetricsOverhead(doc);
+}
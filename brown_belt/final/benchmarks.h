@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <vector>
+using namespace std;
+
+// Runs with "bench [input.json ...]": every given input and a few synthetic cities.
+void RunBenchmarks(const vector<string>& args);
+
+// Runs with "bench_city <input.json> [router] [report.json]": parse, base, graph and
+// router build, stat query latencies and peak RSS of one run of the whole pipeline.
+// The report gets them with all the phase metrics as JSON.
+void RunCityBenchmark(const vector<string>& args);
+
+// Runs with "bench_suite [scales=1000,10000,100000] [routers=name,...] [field=value ...]":
+// generates a city of every scale with the remaining city parameters and runs
+// bench_city on it for every router, each in a process of its own for a fair peak RSS.
+void RunBenchmarkSuite(const string& program, const vector<string>& args);
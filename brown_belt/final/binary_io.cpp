@@ -0,0 +1,72 @@
+#include "binary_io.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// An empty file has nothing to map, its data stays empty
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) {
+	file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size)) {
+		if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+		throw std::runtime_error("Can't open " + path);
+	}
+	size_ = static_cast<std::size_t>(size.QuadPart);
+	if (size_ == 0) return;
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_) {
+		data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+	}
+	if (!data_) {
+		if (mapping_) CloseHandle(mapping_);
+		CloseHandle(file_);
+		throw std::runtime_error("Can't map " + path);
+	}
+}
+
+MappedFile::~MappedFile() {
+	if (data_) {
+		UnmapViewOfFile(data_);
+		CloseHandle(mapping_);
+	}
+	CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		if (fd >= 0) close(fd);
+		throw std::runtime_error("Can't open " + path);
+	}
+	size_ = static_cast<std::size_t>(info.st_size);
+	if (size_ > 0) {
+		void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Can't map " + path);
+		}
+		data_ = static_cast<const char*>(data);
+	}
+	// the mapping keeps the file, the descriptor is no longer needed
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data_) {
+		munmap(const_cast<char*>(data_), size_);
+	}
+}
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Flat binary layout: values are written as they lie in memory, vectors and
+// strings as a uint64 size followed by their elements. Arrays are contiguous
+// and position independent, so a file can be read in one go or mapped.
+
+class BinaryFormatError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+class BinaryWriter {
+public:
+	explicit BinaryWriter(std::ostream& out) : out_(out) {}
+
+	template <typename T>
+	void Write(const T& value) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		out_.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	template <typename T>
+	void WriteVector(const std::vector<T>& values) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		Write<std::uint64_t>(values.size());
+		out_.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	void WriteString(std::string_view value) {
+		Write<std::uint64_t>(value.size());
+		out_.write(value.data(), value.size());
+	}
+
+private:
+	std::ostream& out_;
+};
+
+class BinaryReader {
+public:
+	explicit BinaryReader(std::string_view data) : data_(data) {}
+
+	template <typename T>
+	T Read() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		T value;
+		std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+		return value;
+	}
+
+	template <typename T>
+	std::vector<T> ReadVector() {
+		static_assert(std::is_trivially_copyable_v<T>);
+		const std::size_t size = Read<std::uint64_t>();
+		if (size > data_.size() / sizeof(T)) throw BinaryFormatError("Truncated binary data");
+		std::vector<T> values(size);
+		std::memcpy(values.data(), Take(size * sizeof(T)).data(), size * sizeof(T));
+		return values;
+	}
+
+	std::string_view ReadString() {
+		return Take(Read<std::uint64_t>());
+	}
+
+	bool AtEnd() const {
+		return data_.empty();
+	}
+
+private:
+	std::string_view Take(std::size_t size) {
+		if (size > data_.size()) throw BinaryFormatError("Truncated binary data");
+		const std::string_view result = data_.substr(0, size);
+		data_.remove_prefix(size);
+		return result;
+	}
+
+	std::string_view data_;
+};
+
+// A whole file mapped read-only into memory for as long as the object lives
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::string_view Data() const {
+		return { data_, size_ };
+	}
+
+private:
+	const char* data_ = nullptr;
+	std::size_t size_ = 0;
+#ifdef _WIN32
+	void* file_ = nullptr;
+	void* mapping_ = nullptr;
+#endif
+};
@@ -0,0 +1,500 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Contraction Hierarchies: vertices are contracted one by one in the order of
+  // their importance, shortcuts keep the distances between the remaining ones.
+  // A query is a bidirectional Dijkstra that only goes up the hierarchy.
+  template <typename Weight, typename Index = size_t>
+  class ContractionHierarchyRouter : public RouterBase<Weight, Index> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight, Index>;
+
+  public:
+    using Route = typename RouterBase<Weight, Index>::Route;
+
+    explicit ContractionHierarchyRouter(const Graph& graph);
+    explicit ContractionHierarchyRouter(BinaryReader& input);
+
+    std::optional<Route> FindRoute(VertexId from, VertexId to) const override;
+    void Serialize(BinaryWriter& output) const override;
+    // Bucket many-to-many: an upward search from every target leaves its weight
+    // in buckets of the vertices it settles, an upward search from every source
+    // combines its weights with the buckets it meets
+    std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                   const std::vector<VertexId>& targets) const override;
+
+    size_t GetShortcutCount() const;
+
+  private:
+    using ArcId = Index;
+    static constexpr ArcId NO_ARC = std::numeric_limits<ArcId>::max();
+    static constexpr Index NO_EDGE = std::numeric_limits<Index>::max();
+
+    // An original edge (edge set, children unset) or a shortcut of two arcs.
+    struct Arc {
+      Index from;
+      Index to;
+      Weight weight;
+      Index edge = NO_EDGE;
+      ArcId first = NO_ARC;
+      ArcId second = NO_ARC;
+
+      bool IsShortcut() const {
+        return edge == NO_EDGE;
+      }
+    };
+
+    struct QueueItem {
+      Weight weight;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return weight > other.weight;
+      }
+    };
+    using Queue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+
+    // Dijkstra state with lazy reset between runs.
+    struct SearchState {
+      std::vector<Weight> weights;
+      std::vector<ArcId> prev_arcs;
+      std::vector<uint32_t> stamps;
+      uint32_t current_stamp = 0;
+
+      explicit SearchState(size_t vertex_count);
+      void Reset();
+      bool Reached(VertexId vertex) const;
+      void Reach(VertexId vertex, Weight weight, ArcId prev_arc);
+    };
+
+    struct QueryState {
+      SearchState forward;
+      SearchState backward;
+
+      explicit QueryState(size_t vertex_count) : forward(vertex_count), backward(vertex_count) {}
+    };
+
+    struct Contraction {
+      std::vector<Arc> shortcuts;
+      size_t removed_arcs = 0;
+    };
+
+    // Preprocessing
+    void AddArc(Arc arc);
+    void RemoveVertexArcs(VertexId vertex);
+    Contraction Contract(VertexId vertex);
+    int Priority(VertexId vertex, const Contraction& contraction) const;
+    void FindWitnesses(VertexId source, VertexId avoided, Weight limit);
+
+    // Query
+    void Settle(SearchState& state, Queue& queue, const CompactGraph<Weight, Index>& arcs) const;
+    void Unpack(ArcId arc_id, std::vector<EdgeId>& edges) const;
+    // All vertices an upward search settles, with their weights
+    void SearchUp(SearchState& state, VertexId from, const CompactGraph<Weight, Index>& arcs,
+                  std::vector<std::pair<VertexId, Weight>>& settled) const;
+
+    static constexpr size_t WITNESS_SETTLE_LIMIT = 200;
+
+    std::vector<Arc> arcs_;
+    std::vector<std::vector<ArcId>> out_arcs_;
+    std::vector<std::vector<ArcId>> in_arcs_;
+    std::vector<size_t> rank_;
+    std::vector<size_t> contracted_neighbours_;
+    SearchState witness_state_;
+
+    // Arcs leading up the hierarchy: from a vertex for the forward search,
+    // and reversed ones into a vertex for the backward search. Their edge ids are arc ids.
+    std::optional<CompactGraph<Weight, Index>> up_arcs_;
+    std::optional<CompactGraph<Weight, Index>> down_arcs_;
+    SearchStatePool<QueryState> query_states_;
+  };
+
+
+  template <typename Weight, typename Index>
+  ContractionHierarchyRouter<Weight, Index>::SearchState::SearchState(size_t vertex_count)
+      : weights(vertex_count), prev_arcs(vertex_count), stamps(vertex_count, 0)
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::SearchState::Reset() {
+    if (++current_stamp == 0) {
+      std::fill(std::begin(stamps), std::end(stamps), 0);
+      current_stamp = 1;
+    }
+  }
+
+  template <typename Weight, typename Index>
+  bool ContractionHierarchyRouter<Weight, Index>::SearchState::Reached(VertexId vertex) const {
+    return stamps[vertex] == current_stamp;
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::SearchState::Reach(VertexId vertex, Weight weight, ArcId prev_arc) {
+    stamps[vertex] = current_stamp;
+    weights[vertex] = weight;
+    prev_arcs[vertex] = prev_arc;
+  }
+
+  template <typename Weight, typename Index>
+  ContractionHierarchyRouter<Weight, Index>::ContractionHierarchyRouter(const Graph& graph)
+      : out_arcs_(graph.GetVertexCount()),
+        in_arcs_(graph.GetVertexCount()),
+        rank_(graph.GetVertexCount()),
+        contracted_neighbours_(graph.GetVertexCount(), 0),
+        witness_state_(graph.GetVertexCount()),
+        query_states_(graph.GetVertexCount())
+  {
+    const size_t vertex_count = graph.GetVertexCount();
+    arcs_.reserve(graph.GetEdgeCount());
+    for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+      const auto& edge = graph.GetEdge(edge_id);
+      assert(edge.weight >= 0);
+      if (edge.from != edge.to) {
+        AddArc({edge.from, edge.to, edge.weight, static_cast<Index>(edge_id)});
+      }
+    }
+
+    // Lazy updates: a vertex is contracted only if its refreshed priority
+    // is still not worse than the best one in the queue.
+    using PriorityItem = std::pair<int, VertexId>;
+    std::priority_queue<PriorityItem, std::vector<PriorityItem>, std::greater<PriorityItem>> queue;
+    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+      queue.push({Priority(vertex, Contract(vertex)), vertex});
+    }
+    size_t next_rank = 0;
+    while (!queue.empty()) {
+      const VertexId vertex = queue.top().second;
+      queue.pop();
+      Contraction contraction = Contract(vertex);
+      const int priority = Priority(vertex, contraction);
+      if (!queue.empty() && priority > queue.top().first) {
+        queue.push({priority, vertex});
+        continue;
+      }
+
+      for (Arc& shortcut : contraction.shortcuts) {
+        AddArc(std::move(shortcut));
+      }
+      rank_[vertex] = next_rank++;
+      RemoveVertexArcs(vertex);
+    }
+
+    std::vector<Edge<Weight, Index>> up_edges, down_edges;
+    std::vector<Index> up_ids, down_ids;
+    for (ArcId arc_id = 0; arc_id < arcs_.size(); ++arc_id) {
+      const Arc& arc = arcs_[arc_id];
+      if (rank_[arc.from] < rank_[arc.to]) {
+        up_edges.push_back({arc.from, arc.to, arc.weight});
+        up_ids.push_back(arc_id);
+      } else {
+        down_edges.push_back({arc.to, arc.from, arc.weight});
+        down_ids.push_back(arc_id);
+      }
+    }
+    up_arcs_.emplace(vertex_count, up_edges, up_ids);
+    down_arcs_.emplace(vertex_count, down_edges, down_ids);
+    out_arcs_ = {};
+    in_arcs_ = {};
+  }
+
+  // Only what queries need: arcs for unpacking and the two search graphs
+  template <typename Weight, typename Index>
+  ContractionHierarchyRouter<Weight, Index>::ContractionHierarchyRouter(BinaryReader& input)
+      : arcs_(input.ReadVector<Arc>()),
+        witness_state_(0),
+        up_arcs_(CompactGraph<Weight, Index>(input)),
+        down_arcs_(CompactGraph<Weight, Index>(input)),
+        query_states_(up_arcs_->GetVertexCount())
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::Serialize(BinaryWriter& output) const {
+    output.WriteVector(arcs_);
+    up_arcs_->Serialize(output);
+    down_arcs_->Serialize(output);
+  }
+
+  template <typename Weight, typename Index>
+  size_t ContractionHierarchyRouter<Weight, Index>::GetShortcutCount() const {
+    return std::count_if(std::begin(arcs_), std::end(arcs_), [](const Arc& arc) {
+      return arc.IsShortcut();
+    });
+  }
+
+  // Parallel arcs are never useful, only the lightest one is kept.
+  // Arcs of contracted vertices are never changed, so shortcuts may refer to them.
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::AddArc(Arc arc) {
+    for (const ArcId id : out_arcs_[arc.from]) {
+      if (arcs_[id].to == arc.to) {
+        if (arc.weight < arcs_[id].weight) {
+          arcs_[id] = std::move(arc);
+        }
+        return;
+      }
+    }
+    const ArcId id = arcs_.size();
+    out_arcs_[arc.from].push_back(id);
+    in_arcs_[arc.to].push_back(id);
+    arcs_.push_back(std::move(arc));
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::RemoveVertexArcs(VertexId vertex) {
+    const auto remove_arc = [](std::vector<ArcId>& arcs, ArcId arc_id) {
+      arcs.erase(std::find(std::begin(arcs), std::end(arcs), arc_id));
+    };
+    for (const ArcId arc_id : out_arcs_[vertex]) {
+      const VertexId neighbour = arcs_[arc_id].to;
+      remove_arc(in_arcs_[neighbour], arc_id);
+      ++contracted_neighbours_[neighbour];
+    }
+    for (const ArcId arc_id : in_arcs_[vertex]) {
+      const VertexId neighbour = arcs_[arc_id].from;
+      remove_arc(out_arcs_[neighbour], arc_id);
+      ++contracted_neighbours_[neighbour];
+    }
+  }
+
+  // Bounded Dijkstra that avoids the contracted vertex. Its weights are upper
+  // bounds of the distances, so a reached vertex always has a real witness path.
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::FindWitnesses(VertexId source, VertexId avoided, Weight limit) {
+    witness_state_.Reset();
+    Queue queue;
+    witness_state_.Reach(source, 0, NO_ARC);
+    queue.push({0, source});
+    size_t settled = 0;
+    while (!queue.empty() && settled < WITNESS_SETTLE_LIMIT) {
+      const auto [weight, vertex] = queue.top();
+      queue.pop();
+      if (weight > witness_state_.weights[vertex]) {
+        continue;
+      }
+      if (weight > limit) {
+        break;
+      }
+      ++settled;
+      for (const ArcId arc_id : out_arcs_[vertex]) {
+        const Arc& arc = arcs_[arc_id];
+        if (arc.to == avoided) {
+          continue;
+        }
+        const Weight candidate_weight = weight + arc.weight;
+        if (!witness_state_.Reached(arc.to) || candidate_weight < witness_state_.weights[arc.to]) {
+          witness_state_.Reach(arc.to, candidate_weight, arc_id);
+          queue.push({candidate_weight, arc.to});
+        }
+      }
+    }
+  }
+
+  template <typename Weight, typename Index>
+  typename ContractionHierarchyRouter<Weight, Index>::Contraction ContractionHierarchyRouter<Weight, Index>::Contract(VertexId vertex) {
+    Contraction result;
+    for (const ArcId in_id : in_arcs_[vertex]) {
+      const VertexId source = arcs_[in_id].from;
+      Weight max_out_weight = 0;
+      for (const ArcId out_id : out_arcs_[vertex]) {
+        max_out_weight = std::max(max_out_weight, arcs_[out_id].weight);
+      }
+      FindWitnesses(source, vertex, arcs_[in_id].weight + max_out_weight);
+      for (const ArcId out_id : out_arcs_[vertex]) {
+        const VertexId target = arcs_[out_id].to;
+        if (target == source) {
+          continue;
+        }
+        const Weight weight = arcs_[in_id].weight + arcs_[out_id].weight;
+        if (!witness_state_.Reached(target) || witness_state_.weights[target] > weight) {
+          result.shortcuts.push_back({static_cast<Index>(source), static_cast<Index>(target), weight, NO_EDGE, in_id, out_id});
+        }
+      }
+    }
+    result.removed_arcs = in_arcs_[vertex].size() + out_arcs_[vertex].size();
+    return result;
+  }
+
+  template <typename Weight, typename Index>
+  int ContractionHierarchyRouter<Weight, Index>::Priority(VertexId vertex, const Contraction& contraction) const {
+    const int edge_difference = static_cast<int>(contraction.shortcuts.size()) - static_cast<int>(contraction.removed_arcs);
+    return edge_difference + static_cast<int>(contracted_neighbours_[vertex]);
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::Settle(SearchState& state, Queue& queue, const CompactGraph<Weight, Index>& arcs) const {
+    const auto [weight, vertex] = queue.top();
+    queue.pop();
+    if (weight > state.weights[vertex]) {
+      return;
+    }
+    for (size_t arc = arcs.EdgesBegin(vertex); arc < arcs.EdgesEnd(vertex); ++arc) {
+      const VertexId next = arcs.GetTarget(arc);
+      const Weight candidate_weight = weight + arcs.GetWeight(arc);
+      if (!state.Reached(next) || candidate_weight < state.weights[next]) {
+        state.Reach(next, candidate_weight, arcs.GetEdgeId(arc));
+        queue.push({candidate_weight, next});
+      }
+    }
+  }
+
+  template <typename Weight, typename Index>
+  std::optional<typename ContractionHierarchyRouter<Weight, Index>::Route>
+  ContractionHierarchyRouter<Weight, Index>::FindRoute(VertexId from, VertexId to) const {
+    const auto query_state = query_states_.Acquire();
+    SearchState& forward_state = query_state->forward;
+    SearchState& backward_state = query_state->backward;
+    forward_state.Reset();
+    backward_state.Reset();
+    Queue forward_queue, backward_queue;
+    forward_state.Reach(from, 0, NO_ARC);
+    forward_queue.push({0, from});
+    backward_state.Reach(to, 0, NO_ARC);
+    backward_queue.push({0, to});
+
+    std::optional<Weight> best;
+    VertexId meeting = from;
+    const auto update_best = [&](VertexId vertex) {
+      if (forward_state.Reached(vertex) && backward_state.Reached(vertex)) {
+        const Weight weight = forward_state.weights[vertex] + backward_state.weights[vertex];
+        if (!best || weight < *best) {
+          best = weight;
+          meeting = vertex;
+        }
+      }
+    };
+
+    bool forward_turn = true;
+    while (true) {
+      const bool forward_done = forward_queue.empty() || (best && forward_queue.top().weight >= *best);
+      const bool backward_done = backward_queue.empty() || (best && backward_queue.top().weight >= *best);
+      if (forward_done && backward_done) {
+        break;
+      }
+      if ((forward_turn && !forward_done) || backward_done) {
+        const VertexId vertex = forward_queue.top().vertex;
+        Settle(forward_state, forward_queue, *up_arcs_);
+        update_best(vertex);
+      } else {
+        const VertexId vertex = backward_queue.top().vertex;
+        Settle(backward_state, backward_queue, *down_arcs_);
+        update_best(vertex);
+      }
+      forward_turn = !forward_turn;
+    }
+
+    if (!best) {
+      return std::nullopt;
+    }
+    std::vector<ArcId> path;
+    for (ArcId arc_id = forward_state.prev_arcs[meeting]; arc_id != NO_ARC;
+         arc_id = forward_state.prev_arcs[arcs_[arc_id].from]) {
+      path.push_back(arc_id);
+    }
+    std::reverse(std::begin(path), std::end(path));
+    for (ArcId arc_id = backward_state.prev_arcs[meeting]; arc_id != NO_ARC;
+         arc_id = backward_state.prev_arcs[arcs_[arc_id].to]) {
+      path.push_back(arc_id);
+    }
+
+    std::vector<EdgeId> edges;
+    for (const ArcId arc_id : path) {
+      Unpack(arc_id, edges);
+    }
+    return Route{*best, std::move(edges)};
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::Unpack(ArcId arc_id, std::vector<EdgeId>& edges) const {
+    std::vector<ArcId> stack = {arc_id};
+    while (!stack.empty()) {
+      const Arc& arc = arcs_[stack.back()];
+      stack.pop_back();
+      if (!arc.IsShortcut()) {
+        edges.push_back(arc.edge);
+      } else {
+        stack.push_back(arc.second);
+        stack.push_back(arc.first);
+      }
+    }
+  }
+
+  template <typename Weight, typename Index>
+  void ContractionHierarchyRouter<Weight, Index>::SearchUp(SearchState& state, VertexId from, const CompactGraph<Weight, Index>& arcs,
+                                                           std::vector<std::pair<VertexId, Weight>>& settled) const {
+    settled.clear();
+    state.Reset();
+    Queue queue;
+    state.Reach(from, 0, NO_ARC);
+    queue.push({0, from});
+    while (!queue.empty()) {
+      const auto [weight, vertex] = queue.top();
+      if (weight <= state.weights[vertex]) {
+        settled.push_back({vertex, weight});
+      }
+      Settle(state, queue, arcs);
+    }
+  }
+
+  template <typename Weight, typename Index>
+  std::vector<std::optional<Weight>> ContractionHierarchyRouter<Weight, Index>::FindWeights(const std::vector<VertexId>& sources,
+                                                                                            const std::vector<VertexId>& targets) const {
+    struct BucketEntry {
+      VertexId vertex;
+      size_t target_idx;
+      Weight weight;
+    };
+    const auto query_state = query_states_.Acquire();
+    std::vector<std::pair<VertexId, Weight>> settled;
+
+    std::vector<BucketEntry> buckets;
+    for (size_t target_idx = 0; target_idx < targets.size(); ++target_idx) {
+      SearchUp(query_state->backward, targets[target_idx], *down_arcs_, settled);
+      for (const auto& [vertex, weight] : settled) {
+        buckets.push_back({vertex, target_idx, weight});
+      }
+    }
+    std::sort(std::begin(buckets), std::end(buckets), [](const BucketEntry& lhs, const BucketEntry& rhs) {
+      return lhs.vertex < rhs.vertex;
+    });
+    const auto bucket_of = [&buckets](VertexId vertex) {
+      return std::equal_range(std::begin(buckets), std::end(buckets), BucketEntry{vertex, 0, 0},
+                              [](const BucketEntry& lhs, const BucketEntry& rhs) {
+                                return lhs.vertex < rhs.vertex;
+                              });
+    };
+
+    std::vector<std::optional<Weight>> weights(sources.size() * targets.size());
+    for (size_t source_idx = 0; source_idx < sources.size(); ++source_idx) {
+      std::optional<Weight>* row = weights.data() + source_idx * targets.size();
+      SearchUp(query_state->forward, sources[source_idx], *up_arcs_, settled);
+      for (const auto& [vertex, weight] : settled) {
+        const auto [begin, end] = bucket_of(vertex);
+        for (auto entry = begin; entry != end; ++entry) {
+          std::optional<Weight>& cell = row[entry->target_idx];
+          if (!cell || weight + entry->weight < *cell) {
+            cell = weight + entry->weight;
+          }
+        }
+      }
+    }
+    return weights;
+  }
+
+}
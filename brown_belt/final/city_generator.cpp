@@ -0,0 +1,183 @@
+#include "city_generator.h"
+#include "guider.h"
+#include <cmath>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+	using Json::Node;
+
+	const double START_LATITUDE = 55.5;
+	const double START_LONGITUDE = 37.3;
+	const double LATITUDE_STEP = 0.005;
+	const double LONGITUDE_STEP = 0.008;
+
+	string StopName(size_t id) {
+		return "Stop " + to_string(id);
+	}
+
+	string BusName(size_t id) {
+		return "Bus " + to_string(id);
+	}
+
+	vector<size_t> RandomWalk(size_t side, size_t stop_count, size_t length, mt19937& gen) {
+		uniform_int_distribution<size_t> start(0, stop_count - 1);
+		uniform_int_distribution<int> direction(0, 3);
+		vector<size_t> stops = { start(gen) };
+		while (stops.size() < length) {
+			const size_t current = stops.back();
+			const size_t row = current / side, col = current % side;
+			size_t next = current;
+			switch (direction(gen)) {
+			case 0: if (row > 0) next = current - side; break;
+			case 1: if (col > 0) next = current - 1; break;
+			case 2: if (current + side < stop_count) next = current + side; break;
+			case 3: if (col + 1 < side && current + 1 < stop_count) next = current + 1; break;
+			}
+			if (next != current) stops.push_back(next);
+		}
+		return stops;
+	}
+
+	void SetRoadDistance(vector<map<string, Node>>& road_distances, const vector<Coordinates>& coords,
+		size_t from, size_t to, double stretch) {
+		road_distances[from][StopName(to)] = Node(max(1.0, round(Length(coords[from], coords[to]) * stretch)));
+	}
+}
+
+CityParams ParseCityParams(const vector<string>& args) {
+	CityParams params;
+	for (const string& arg : args) {
+		const size_t eq = arg.find('=');
+		if (eq == string::npos) {
+			throw invalid_argument("Expected field=value, got " + arg);
+		}
+		const string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+		if (key == "stop_count") params.stop_count = stoul(value);
+		else if (key == "bus_count") params.bus_count = stoul(value);
+		else if (key == "stops_per_bus") params.stops_per_bus = stoul(value);
+		else if (key == "stops_per_bus_spread") params.stops_per_bus_spread = stoul(value);
+		else if (key == "roundtrip_ratio") params.roundtrip_ratio = stod(value);
+		else if (key == "distance_density") params.distance_density = stod(value);
+		else if (key == "stop_requests") params.stop_requests = stoul(value);
+		else if (key == "bus_requests") params.bus_requests = stoul(value);
+		else if (key == "route_requests") params.route_requests = stoul(value);
+		else if (key == "seed") params.seed = stoul(value);
+		else if (key == "router") params.router = value;
+		else throw invalid_argument("Unknown city parameter " + key);
+	}
+	return params;
+}
+
+Json::Document GenerateCity(const CityParams& params) {
+	mt19937 gen(params.seed);
+	const size_t side = static_cast<size_t>(ceil(sqrt(static_cast<double>(params.stop_count))));
+
+	vector<Coordinates> coords(params.stop_count);
+	for (size_t id = 0; id < params.stop_count; ++id) {
+		coords[id] = { START_LATITUDE + (id / side) * LATITUDE_STEP, START_LONGITUDE + (id % side) * LONGITUDE_STEP };
+	}
+
+	vector<Node> base_requests;
+	vector<map<string, Node>> road_distances(params.stop_count);
+	vector<size_t> served_stops;
+	uniform_real_distribution<double> stretch(1.05, 1.4);
+	bernoulli_distribution roundtrip(params.roundtrip_ratio);
+	const size_t min_length = max<size_t>(2, params.stops_per_bus - min(params.stops_per_bus, params.stops_per_bus_spread));
+	uniform_int_distribution<size_t> route_length(min_length, max(min_length, params.stops_per_bus + params.stops_per_bus_spread));
+	for (size_t bus = 0; bus < params.bus_count; ++bus) {
+		const bool is_roundtrip = roundtrip(gen);
+		// no extra draws without a spread, so older cities stay the same
+		const size_t length = params.stops_per_bus_spread ? route_length(gen) : params.stops_per_bus;
+		vector<size_t> stops = RandomWalk(side, params.stop_count, length, gen);
+		if (is_roundtrip) stops.push_back(stops.front());
+
+		vector<Node> stop_names;
+		for (size_t i = 0; i < stops.size(); ++i) {
+			stop_names.push_back(Node(StopName(stops[i])));
+			served_stops.push_back(stops[i]);
+			if (i > 0) {
+				SetRoadDistance(road_distances, coords, stops[i - 1], stops[i], stretch(gen));
+			}
+		}
+		base_requests.push_back(Node(map<string, Node>{
+			{ "type", Node(string("Bus")) },
+			{ "name", Node(BusName(bus)) },
+			{ "stops", Node(move(stop_names)) },
+			{ "is_roundtrip", Node(is_roundtrip) }
+		}));
+	}
+	// extra distances never replace the ones buses have got
+	if (params.distance_density > 0) {
+		bernoulli_distribution dense(params.distance_density);
+		for (size_t id = 0; id < params.stop_count; ++id) {
+			for (const size_t neighbour : { id + 1, id + side }) {
+				if (neighbour < params.stop_count && (neighbour == id + side || neighbour % side != 0) && dense(gen)) {
+					for (const auto& [from, to] : { pair(id, neighbour), pair(neighbour, id) }) {
+						if (!road_distances[from].count(StopName(to))) {
+							SetRoadDistance(road_distances, coords, from, to, stretch(gen));
+						}
+					}
+				}
+			}
+		}
+	}
+	for (size_t id = 0; id < params.stop_count; ++id) {
+		base_requests.push_back(Node(map<string, Node>{
+			{ "type", Node(string("Stop")) },
+			{ "name", Node(StopName(id)) },
+			{ "latitude", Node(coords[id].latitude) },
+			{ "longitude", Node(coords[id].longitude) },
+			{ "road_distances", Node(move(road_distances[id])) }
+		}));
+	}
+
+	vector<Node> stat_requests;
+	if (!served_stops.empty()) {
+		uniform_int_distribution<size_t> stop(0, served_stops.size() - 1);
+		for (size_t id = 0; id < params.route_requests; ++id) {
+			stat_requests.push_back(Node(map<string, Node>{
+				{ "type", Node(string("Route")) },
+				{ "from", Node(StopName(served_stops[stop(gen)])) },
+				{ "to", Node(StopName(served_stops[stop(gen)])) },
+				{ "id", Node(static_cast<double>(id)) }
+			}));
+		}
+	}
+	if (params.stop_count > 0) {
+		uniform_int_distribution<size_t> stop(0, params.stop_count - 1);
+		for (size_t i = 0; i < params.stop_requests; ++i) {
+			stat_requests.push_back(Node(map<string, Node>{
+				{ "type", Node(string("Stop")) },
+				{ "name", Node(StopName(stop(gen))) },
+				{ "id", Node(static_cast<double>(stat_requests.size())) }
+			}));
+		}
+	}
+	if (params.bus_count > 0) {
+		uniform_int_distribution<size_t> bus(0, params.bus_count - 1);
+		for (size_t i = 0; i < params.bus_requests; ++i) {
+			stat_requests.push_back(Node(map<string, Node>{
+				{ "type", Node(string("Bus")) },
+				{ "name", Node(BusName(bus(gen))) },
+				{ "id", Node(static_cast<double>(stat_requests.size())) }
+			}));
+		}
+	}
+
+	map<string, Node> routing_settings = {
+		{ "bus_wait_time", Node(6.0) },
+		{ "bus_velocity", Node(40.0) }
+	};
+	if (!params.router.empty()) {
+		routing_settings["router"] = Node(params.router);
+	}
+
+	return Json::Document(Node(map<string, Node>{
+		{ "routing_settings", Node(move(routing_settings)) },
+		{ "base_requests", Node(move(base_requests)) },
+		{ "stat_requests", Node(move(stat_requests)) }
+	}));
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "json.h"
+#include <string>
+#include <vector>
+using namespace std;
+
+// Synthetic city: stops on a grid, buses are random walks between neighbouring
+// stops, road distances are the geographic ones stretched by a random factor.
+struct CityParams {
+	size_t stop_count = 1000;
+	size_t bus_count = 100;
+	size_t stops_per_bus = 20;
+	size_t stops_per_bus_spread = 0; // route lengths are uniform in stops_per_bus +- spread
+	double roundtrip_ratio = 0.5;
+	// share of neighbouring stops with road distances both ways even if no bus needs them
+	double distance_density = 0.0;
+	size_t stop_requests = 0;
+	size_t bus_requests = 0;
+	size_t route_requests = 1000;
+	unsigned seed = 0;
+	string router; // the default one if empty
+};
+
+// Reads "field=value" arguments named as the fields above, throws invalid_argument on others
+CityParams ParseCityParams(const vector<string>& args);
+
+// base_requests and stat_requests in the schema of the input files, Route requests
+// go first, then Stop and Bus ones
+Json::Document GenerateCity(const CityParams& params);
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Per-query Dijkstra on a binary heap over a CompactGraph copy of the graph:
+  // O(V + E) construction and memory.
+  // With a heuristic it becomes A*; the heuristic must never overestimate
+  // the remaining weight to the target, otherwise routes may be suboptimal.
+  // Edges added later are searched in a small overlay graph until it grows to
+  // a quarter of the main one and both are merged. The heuristic knows nothing
+  // about new vertices, so A* has to be rebuilt instead.
+  template <typename Weight, typename Index = size_t>
+  class DijkstraRouter : public RouterBase<Weight, Index> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight, Index>;
+
+  public:
+    using Route = typename RouterBase<Weight, Index>::Route;
+    using Heuristic = std::function<Weight(VertexId vertex, VertexId target)>;
+
+    explicit DijkstraRouter(const Graph& graph, Heuristic heuristic = nullptr);
+    explicit DijkstraRouter(BinaryReader& input, Heuristic heuristic = nullptr);
+
+    std::optional<Route> FindRoute(VertexId from, VertexId to) const override;
+    void Serialize(BinaryWriter& output) const override;
+    bool AddEdges(const Graph& graph, EdgeId first_new_edge) override;
+    // One search per source, without the heuristic, until all targets are settled
+    std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                   const std::vector<VertexId>& targets) const override;
+
+  private:
+    struct QueueItem {
+      Weight priority;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return priority > other.priority;
+      }
+    };
+    using Queue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+
+    static constexpr Index NO_EDGE = std::numeric_limits<Index>::max();
+
+    // Search state is reused between queries: a vertex is reached in the current
+    // search only if its stamp is equal to current_stamp, so nothing is cleared.
+    // Previous edges are indices in graph_ and overlay_.
+    struct SearchState {
+      std::vector<Weight> weights;
+      std::vector<Index> prev_edges;
+      std::vector<uint32_t> stamps;
+      uint32_t current_stamp = 0;
+
+      explicit SearchState(size_t vertex_count);
+      void Reset();
+      bool Reached(VertexId vertex) const;
+      void Reach(VertexId vertex, Weight weight, Index prev_edge);
+    };
+
+    Weight Estimate(VertexId vertex, VertexId target) const;
+    // Reaches the neighbours of a settled vertex, estimating the rest to target if it is given
+    void Relax(SearchState& state, Queue& queue, VertexId vertex, std::optional<VertexId> target) const;
+    // Edge indices of the overlay follow the ones of graph_
+    VertexId GetSource(size_t edge) const;
+    EdgeId GetEdgeId(size_t edge) const;
+    CompactGraph<Weight, Index> Merged() const;
+
+    CompactGraph<Weight, Index> graph_;
+    CompactGraph<Weight, Index> overlay_;
+    std::vector<Edge<Weight, Index>> overlay_edges_;
+    std::vector<Index> overlay_edge_ids_;
+    Heuristic heuristic_;
+    SearchStatePool<SearchState> states_;
+  };
+
+
+  template <typename Weight, typename Index>
+  DijkstraRouter<Weight, Index>::DijkstraRouter(const Graph& graph, Heuristic heuristic)
+      : graph_(graph),
+        overlay_(graph.GetVertexCount(), {}, {}),
+        heuristic_(std::move(heuristic)),
+        states_(graph.GetVertexCount())
+  {
+  }
+
+  template <typename Weight, typename Index>
+  DijkstraRouter<Weight, Index>::DijkstraRouter(BinaryReader& input, Heuristic heuristic)
+      : graph_(input),
+        overlay_(graph_.GetVertexCount(), {}, {}),
+        heuristic_(std::move(heuristic)),
+        states_(graph_.GetVertexCount())
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void DijkstraRouter<Weight, Index>::Serialize(BinaryWriter& output) const {
+    if (overlay_edges_.empty()) {
+      graph_.Serialize(output);
+    }
+    else {
+      Merged().Serialize(output);
+    }
+  }
+
+  template <typename Weight, typename Index>
+  bool DijkstraRouter<Weight, Index>::AddEdges(const Graph& graph, EdgeId first_new_edge) {
+    if (heuristic_) {
+      return false;
+    }
+    for (EdgeId edge_id = first_new_edge; edge_id < graph.GetEdgeCount(); ++edge_id) {
+      overlay_edges_.push_back(graph.GetEdge(edge_id));
+      overlay_edge_ids_.push_back(edge_id);
+    }
+    if (overlay_edges_.size() * 4 > graph_.GetEdgeCount()) {
+      graph_ = CompactGraph<Weight, Index>(graph);
+      overlay_edges_.clear();
+      overlay_edge_ids_.clear();
+    }
+    overlay_ = CompactGraph<Weight, Index>(graph.GetVertexCount(), overlay_edges_, overlay_edge_ids_);
+    states_.Resize(graph.GetVertexCount());
+    return true;
+  }
+
+  template <typename Weight, typename Index>
+  CompactGraph<Weight, Index> DijkstraRouter<Weight, Index>::Merged() const {
+    std::vector<Edge<Weight, Index>> edges;
+    std::vector<Index> ids;
+    for (size_t edge = 0; edge < graph_.GetEdgeCount(); ++edge) {
+      edges.push_back({static_cast<Index>(graph_.GetSource(edge)), static_cast<Index>(graph_.GetTarget(edge)), graph_.GetWeight(edge)});
+      ids.push_back(graph_.GetEdgeId(edge));
+    }
+    edges.insert(std::end(edges), std::begin(overlay_edges_), std::end(overlay_edges_));
+    ids.insert(std::end(ids), std::begin(overlay_edge_ids_), std::end(overlay_edge_ids_));
+    return CompactGraph<Weight, Index>(overlay_.GetVertexCount(), edges, ids);
+  }
+
+  template <typename Weight, typename Index>
+  VertexId DijkstraRouter<Weight, Index>::GetSource(size_t edge) const {
+    return edge < graph_.GetEdgeCount() ? graph_.GetSource(edge) : overlay_.GetSource(edge - graph_.GetEdgeCount());
+  }
+
+  template <typename Weight, typename Index>
+  EdgeId DijkstraRouter<Weight, Index>::GetEdgeId(size_t edge) const {
+    return edge < graph_.GetEdgeCount() ? graph_.GetEdgeId(edge) : overlay_.GetEdgeId(edge - graph_.GetEdgeCount());
+  }
+
+  template <typename Weight, typename Index>
+  DijkstraRouter<Weight, Index>::SearchState::SearchState(size_t vertex_count)
+      : weights(vertex_count), prev_edges(vertex_count), stamps(vertex_count, 0)
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void DijkstraRouter<Weight, Index>::SearchState::Reset() {
+    if (++current_stamp == 0) {
+      std::fill(std::begin(stamps), std::end(stamps), 0);
+      current_stamp = 1;
+    }
+  }
+
+  template <typename Weight, typename Index>
+  bool DijkstraRouter<Weight, Index>::SearchState::Reached(VertexId vertex) const {
+    return stamps[vertex] == current_stamp;
+  }
+
+  template <typename Weight, typename Index>
+  void DijkstraRouter<Weight, Index>::SearchState::Reach(VertexId vertex, Weight weight, Index prev_edge) {
+    stamps[vertex] = current_stamp;
+    weights[vertex] = weight;
+    prev_edges[vertex] = prev_edge;
+  }
+
+  template <typename Weight, typename Index>
+  Weight DijkstraRouter<Weight, Index>::Estimate(VertexId vertex, VertexId target) const {
+    return heuristic_ ? heuristic_(vertex, target) : Weight{};
+  }
+
+  template <typename Weight, typename Index>
+  void DijkstraRouter<Weight, Index>::Relax(SearchState& state, Queue& queue, VertexId vertex, std::optional<VertexId> target) const {
+    const Weight weight = state.weights[vertex];
+    auto relax = [&](const CompactGraph<Weight, Index>& graph, size_t first_edge) {
+      if (vertex >= graph.GetVertexCount()) {
+        return;
+      }
+      for (size_t edge = graph.EdgesBegin(vertex); edge < graph.EdgesEnd(vertex); ++edge) {
+        const VertexId next = graph.GetTarget(edge);
+        assert(graph.GetWeight(edge) >= 0);
+        const Weight candidate_weight = weight + graph.GetWeight(edge);
+        if (!state.Reached(next) || candidate_weight < state.weights[next]) {
+          state.Reach(next, candidate_weight, first_edge + edge);
+          queue.push({candidate_weight + (target ? Estimate(next, *target) : Weight{}), next});
+        }
+      }
+    };
+    relax(graph_, 0);
+    relax(overlay_, graph_.GetEdgeCount());
+  }
+
+  template <typename Weight, typename Index>
+  std::vector<std::optional<Weight>> DijkstraRouter<Weight, Index>::FindWeights(const std::vector<VertexId>& sources,
+                                                                                const std::vector<VertexId>& targets) const {
+    std::vector<VertexId> sorted_targets = targets;
+    std::sort(std::begin(sorted_targets), std::end(sorted_targets));
+    sorted_targets.erase(std::unique(std::begin(sorted_targets), std::end(sorted_targets)), std::end(sorted_targets));
+
+    std::vector<std::optional<Weight>> weights;
+    weights.reserve(sources.size() * targets.size());
+    const auto state = states_.Acquire();
+    for (const VertexId from : sources) {
+      state->Reset();
+      Queue queue;
+      state->Reach(from, 0, NO_EDGE);
+      queue.push({0, from});
+      size_t unsettled_targets = sorted_targets.size();
+      while (!queue.empty() && unsettled_targets > 0) {
+        const auto [weight, vertex] = queue.top();
+        queue.pop();
+        if (weight > state->weights[vertex]) {
+          continue;  // outdated queue item
+        }
+        if (std::binary_search(std::begin(sorted_targets), std::end(sorted_targets), vertex)) {
+          --unsettled_targets;
+        }
+        Relax(*state, queue, vertex, std::nullopt);
+      }
+      for (const VertexId to : targets) {
+        weights.push_back(state->Reached(to) ? std::optional<Weight>(state->weights[to]) : std::nullopt);
+      }
+    }
+    return weights;
+  }
+
+  template <typename Weight, typename Index>
+  std::optional<typename DijkstraRouter<Weight, Index>::Route> DijkstraRouter<Weight, Index>::FindRoute(VertexId from, VertexId to) const {
+    const auto state = states_.Acquire();
+    state->Reset();
+
+    Queue queue;
+    state->Reach(from, 0, NO_EDGE);
+    queue.push({Estimate(from, to), from});
+
+    while (!queue.empty()) {
+      const auto [priority, vertex] = queue.top();
+      queue.pop();
+      if (vertex == to) {
+        break;
+      }
+      const Weight weight = state->weights[vertex];
+      if (priority > weight + Estimate(vertex, to)) {
+        continue;  // outdated queue item
+      }
+      Relax(*state, queue, vertex, to);
+    }
+
+    if (!state->Reached(to)) {
+      return std::nullopt;
+    }
+    std::vector<EdgeId> edges;
+    for (Index edge = state->prev_edges[to]; edge != NO_EDGE; edge = state->prev_edges[GetSource(edge)]) {
+      edges.push_back(GetEdgeId(edge));
+    }
+    std::reverse(std::begin(edges), std::end(edges));
+
+    return Route{state->weights[to], std::move(edges)};
+  }
+
+}
@@ -1,15 +1,74 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <thread>
 #include <vector>
 #include "unit_tests.h"
 #include "input_parsing.h"
 #include "guider.h"
+#include "benchmarks.h"
+#include "city_generator.h"
+#include "metrics.h"
 
 using namespace std;
 
-int main() {
+namespace {
+	// TRANSPORT_METRICS=<file> collects phase metrics and writes them there as JSON at exit, "-" is stderr
+	void SetUpMetrics() {
+		static string path;
+		const char* value = getenv("TRANSPORT_METRICS");
+		if (!value) return;
+		path = value;
+		Metrics::Instance().Reset(); // constructed before the handler is registered, so it outlives it
+		Metrics::Enable();
+		atexit([] {
+			if (path == "-") {
+				Metrics::Instance().Dump(cerr);
+			}
+			else {
+				ofstream output(path);
+				Metrics::Instance().Dump(output);
+			}
+		});
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1 && string(argv[1]) == "bench") {
+		RunBenchmarks({ argv + 2, argv + argc });
+		return 0;
+	}
+	if (argc > 1 && string(argv[1]) == "bench_city") {
+		RunCityBenchmark({ argv + 2, argv + argc });
+		return 0;
+	}
+	if (argc > 1 && string(argv[1]) == "bench_suite") {
+		RunBenchmarkSuite(argv[0], { argv + 2, argv + argc });
+		return 0;
+	}
+	// "generate [field=value ...]" writes a synthetic city as an input file, see CityParams
+	if (argc > 1 && string(argv[1]) == "generate") {
+		Json::UploadDocument(GenerateCity(ParseCityParams({ argv + 2, argv + argc })), cout);
+		return 0;
+	}
 	TestAll();
-	vector<QueryPtr> queries = ReadQueries();
+	SetUpMetrics();
+	vector<Query> queries = ReadQueries();
 	TransportGuider guider;
-	guider.ProcessQueries(move(queries));
+	if (argc > 1 && string(argv[1]) == "make_base") {
+		guider.MakeBase(move(queries));
+	}
+	else if (argc > 1 && string(argv[1]) == "process_requests") {
+		guider.ProcessRequests(move(queries));
+	}
+	else if (argc > 1 && string(argv[1]) == "parallel") {
+		const size_t thread_count = argc > 2 ? stoul(argv[2]) : max(1u, thread::hardware_concurrency());
+		guider.ProcessQueriesParallel(move(queries), thread_count);
+	}
+	else {
+		guider.ProcessQueries(move(queries));
+	}
 	return 0;
 }
\ No newline at end of file
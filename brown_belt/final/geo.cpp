@@ -0,0 +1,197 @@
+#include "geo.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	const double EARTH_RADIUS = 6371000;
+	const double PI = 3.1415926535;
+
+	// asin of a half chord keeps its precision for close points, unlike acos of a cosine
+	double ChordToLength(double chord) {
+		return 2 * EARTH_RADIUS * asin(min(1.0, chord / 2));
+	}
+
+	double LengthToChord(double length) {
+		return 2 * sin(min(length / EARTH_RADIUS, PI) / 2);
+	}
+}
+
+GeoPoints::GeoPoints(const vector<Coordinates>& coords) {
+	sin_lat_.reserve(coords.size());
+	cos_lat_.reserve(coords.size());
+	lon_.reserve(coords.size());
+	for (const Coordinates& point : coords) {
+		Add(point);
+	}
+}
+
+void GeoPoints::Add(const Coordinates& coords) {
+	const double lat = coords.LatRad();
+	sin_lat_.push_back(sin(lat));
+	cos_lat_.push_back(cos(lat));
+	lon_.push_back(coords.LongRad());
+}
+
+size_t GeoPoints::Size() const {
+	return lon_.size();
+}
+
+double GeoPoints::Length(size_t from, size_t to) const {
+	// rounding may push the cosine of a zero angle above 1, acos of that is NaN
+	return EARTH_RADIUS * acos(min(1.0,
+		sin_lat_[from] * sin_lat_[to] + cos_lat_[from] * cos_lat_[to] * cos(lon_[from] - lon_[to])
+	));
+}
+
+void GeoPoints::SegmentLengths(const vector<size_t>& route, vector<double>& lengths) const {
+	const size_t count = route.size() < 2 ? 0 : route.size() - 1;
+	lengths.resize(count);
+	double* const out = lengths.data();
+	for (size_t i = 0; i < count; ++i) {
+		const size_t from = route[i], to = route[i + 1];
+		out[i] = sin_lat_[from] * sin_lat_[to] + cos_lat_[from] * cos_lat_[to] * cos(lon_[from] - lon_[to]);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		out[i] = EARTH_RADIUS * acos(min(1.0, out[i]));
+	}
+}
+
+double GeoPoints::RouteLength(const vector<size_t>& route) const {
+	vector<double> lengths;
+	SegmentLengths(route, lengths);
+	double length = 0;
+	for (double segment : lengths) {
+		length += segment;
+	}
+	return length;
+}
+
+
+/* GEO_INDEX---GEO_INDEX---GEO_INDEX---GEO_INDEX---GEO_INDEX---GEO_INDEX---GEO_INDEX */
+
+
+GeoIndex::GeoIndex(const vector<Coordinates>& coords) {
+	entries_.reserve(coords.size());
+	for (size_t id = 0; id < coords.size(); ++id) {
+		entries_.push_back({ ToPoint(coords[id]), static_cast<uint32_t>(id), 0 });
+	}
+	Build(0, entries_.size());
+}
+
+size_t GeoIndex::Size() const {
+	return entries_.size();
+}
+
+vector<GeoIndex::Neighbour> GeoIndex::Nearest(const Coordinates& coords, size_t count) const {
+	if (count == 0) {
+		return {};
+	}
+	vector<Candidate> heap;
+	heap.reserve(min(count, entries_.size()));
+	SearchNearest(ToPoint(coords), count, 0, entries_.size(), heap);
+	sort_heap(heap.begin(), heap.end());
+	return ToNeighbours(heap);
+}
+
+vector<GeoIndex::Neighbour> GeoIndex::WithinRadius(const Coordinates& coords, double radius) const {
+	if (radius < 0) {
+		return {};
+	}
+	const double chord = LengthToChord(radius);
+	vector<Candidate> found;
+	SearchRadius(ToPoint(coords), chord * chord, 0, entries_.size(), found);
+	sort(found.begin(), found.end());
+	return ToNeighbours(found);
+}
+
+GeoIndex::Point GeoIndex::ToPoint(const Coordinates& coords) {
+	const double lat = coords.LatRad(), lon = coords.LongRad();
+	return { cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat) };
+}
+
+double GeoIndex::SquaredChord(const Point& lhs, const Point& rhs) {
+	const double dx = lhs[0] - rhs[0], dy = lhs[1] - rhs[1], dz = lhs[2] - rhs[2];
+	return dx * dx + dy * dy + dz * dz;
+}
+
+vector<GeoIndex::Neighbour> GeoIndex::ToNeighbours(const vector<Candidate>& candidates) {
+	vector<Neighbour> neighbours;
+	neighbours.reserve(candidates.size());
+	for (const auto& [squared_chord, id] : candidates) {
+		neighbours.push_back({ id, ChordToLength(sqrt(squared_chord)) });
+	}
+	return neighbours;
+}
+
+void GeoIndex::Build(size_t begin, size_t end) {
+	if (end - begin < 2) {
+		return;
+	}
+	Point low = entries_[begin].point, high = low;
+	for (size_t i = begin + 1; i < end; ++i) {
+		for (size_t axis = 0; axis < 3; ++axis) {
+			low[axis] = min(low[axis], entries_[i].point[axis]);
+			high[axis] = max(high[axis], entries_[i].point[axis]);
+		}
+	}
+	uint8_t axis = 0;
+	for (uint8_t other = 1; other < 3; ++other) {
+		if (high[other] - low[other] > high[axis] - low[axis]) axis = other;
+	}
+	const size_t middle = begin + (end - begin) / 2;
+	nth_element(entries_.begin() + begin, entries_.begin() + middle, entries_.begin() + end,
+		[axis](const Entry& lhs, const Entry& rhs) { return lhs.point[axis] < rhs.point[axis]; });
+	entries_[middle].axis = axis;
+	Build(begin, middle);
+	Build(middle + 1, end);
+}
+
+// heap is a max-heap of the count nearest candidates found so far
+void GeoIndex::SearchNearest(const Point& point, size_t count, size_t begin, size_t end, vector<Candidate>& heap) const {
+	if (begin == end) {
+		return;
+	}
+	const size_t middle = begin + (end - begin) / 2;
+	const Entry& entry = entries_[middle];
+	const Candidate candidate = { SquaredChord(point, entry.point), entry.id };
+	if (heap.size() < count) {
+		heap.push_back(candidate);
+		push_heap(heap.begin(), heap.end());
+	}
+	else if (candidate < heap.front()) {
+		pop_heap(heap.begin(), heap.end());
+		heap.back() = candidate;
+		push_heap(heap.begin(), heap.end());
+	}
+	if (end - begin == 1) {
+		return;
+	}
+	// the half the point is in goes first, the other one only if it may be as near
+	const double offset = point[entry.axis] - entry.point[entry.axis];
+	const bool before = offset < 0;
+	SearchNearest(point, count, before ? begin : middle + 1, before ? middle : end, heap);
+	if (heap.size() < count || offset * offset <= heap.front().first) {
+		SearchNearest(point, count, before ? middle + 1 : begin, before ? end : middle, heap);
+	}
+}
+
+void GeoIndex::SearchRadius(const Point& point, double squared_chord, size_t begin, size_t end, vector<Candidate>& found) const {
+	if (begin == end) {
+		return;
+	}
+	const size_t middle = begin + (end - begin) / 2;
+	const Entry& entry = entries_[middle];
+	if (const double distance = SquaredChord(point, entry.point); distance <= squared_chord) {
+		found.push_back({ distance, entry.id });
+	}
+	if (end - begin == 1) {
+		return;
+	}
+	const double offset = point[entry.axis] - entry.point[entry.axis];
+	if (offset <= 0 || offset * offset <= squared_chord) {
+		SearchRadius(point, squared_chord, begin, middle, found);
+	}
+	if (offset >= 0 || offset * offset <= squared_chord) {
+		SearchRadius(point, squared_chord, middle + 1, end, found);
+	}
+}
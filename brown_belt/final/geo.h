@@ -0,0 +1,74 @@
+#pragma once
+#include "input_parsing.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+// Coordinates as a structure of arrays with the trigonometry of the latitudes
+// done once per point. Lengths are the same great-circle lengths as ::Length
+// gives, up to rounding.
+class GeoPoints {
+public:
+	GeoPoints() = default;
+	explicit GeoPoints(const vector<Coordinates>& coords);
+
+	void Add(const Coordinates& coords);
+	size_t Size() const;
+
+	double Length(size_t from, size_t to) const;
+	// lengths[i] is the length from route[i] to route[i + 1]. Written as two
+	// flat loops over the segments, so the compiler may vectorize cos and acos.
+	void SegmentLengths(const vector<size_t>& route, vector<double>& lengths) const;
+	double RouteLength(const vector<size_t>& route) const;
+
+private:
+	vector<double> sin_lat_;
+	vector<double> cos_lat_;
+	vector<double> lon_;
+};
+
+// Points on the unit sphere in a k-d tree. The chord between two points grows
+// with their great-circle length, so points nearest by chord are nearest on
+// the globe, and no longitude wraps around. The tree is implicit: the middle
+// entry of a range splits it along the widest side of the range, the halves
+// before and after it are its subtrees. Holds up to 2^32 points.
+class GeoIndex {
+public:
+	struct Neighbour {
+		size_t id; // index of the point in the indexed coordinates
+		double length; // great-circle, meters
+	};
+
+	GeoIndex() = default;
+	explicit GeoIndex(const vector<Coordinates>& coords);
+
+	size_t Size() const;
+
+	// Up to count points nearest to the given one, nearest first; of equally
+	// far points the one with the lower id comes first
+	vector<Neighbour> Nearest(const Coordinates& coords, size_t count) const;
+	// Points no farther than radius meters, in the same order
+	vector<Neighbour> WithinRadius(const Coordinates& coords, double radius) const;
+
+private:
+	using Point = array<double, 3>;
+	// squared chord and id of a found point
+	using Candidate = pair<double, uint32_t>;
+
+	struct Entry {
+		Point point;
+		uint32_t id;
+		uint8_t axis; // of the split, unset in leaves
+	};
+
+	static Point ToPoint(const Coordinates& coords);
+	static double SquaredChord(const Point& lhs, const Point& rhs);
+	static vector<Neighbour> ToNeighbours(const vector<Candidate>& candidates);
+
+	void Build(size_t begin, size_t end);
+	void SearchNearest(const Point& point, size_t count, size_t begin, size_t end, vector<Candidate>& heap) const;
+	void SearchRadius(const Point& point, double squared_chord, size_t begin, size_t end, vector<Candidate>& found) const;
+
+	vector<Entry> entries_;
+};
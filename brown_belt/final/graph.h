@@ -1,7 +1,11 @@
 #pragma once
 
+#include "binary_io.h"
+
+#include <algorithm>
 #include <cstdlib>
 #include <deque>
+#include <iterator>
 #include <vector>
 
 template <typename It>
@@ -20,67 +24,208 @@ private:
 
 namespace Graph {
 
+  // Ids in interfaces. Graphs and routers store them as their Index type:
+  // uint32_t halves adjacency and router tables while ids fit in it.
   using VertexId = size_t;
   using EdgeId = size_t;
 
-  template <typename Weight>
+  template <typename Weight, typename Index = size_t>
   struct Edge {
-    VertexId from;
-    VertexId to;
+    Index from;
+    Index to;
     Weight weight;
   };
 
-  template <typename Weight>
+  template <typename Weight, typename Index = size_t>
   class DirectedWeightedGraph {
   private:
-    using IncidenceList = std::vector<EdgeId>;
+    using IncidenceList = std::vector<Index>;
     using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
 
   public:
     DirectedWeightedGraph(size_t vertex_count);
-    EdgeId AddEdge(const Edge<Weight>& edge);
+    EdgeId AddEdge(const Edge<Weight, Index>& edge);
+    // New vertices get the ids following the existing ones
+    void AddVertices(size_t count);
 
     size_t GetVertexCount() const;
     size_t GetEdgeCount() const;
-    const Edge<Weight>& GetEdge(EdgeId edge_id) const;
+    const Edge<Weight, Index>& GetEdge(EdgeId edge_id) const;
     IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
   private:
-    std::vector<Edge<Weight>> edges_;
+    std::vector<Edge<Weight, Index>> edges_;
     std::vector<IncidenceList> incidence_lists_;
   };
 
 
-  template <typename Weight>
-  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+  template <typename Weight, typename Index>
+  DirectedWeightedGraph<Weight, Index>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
 
-  template <typename Weight>
-  EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
+  template <typename Weight, typename Index>
+  EdgeId DirectedWeightedGraph<Weight, Index>::AddEdge(const Edge<Weight, Index>& edge) {
     edges_.push_back(edge);
     const EdgeId id = edges_.size() - 1;
     incidence_lists_[edge.from].push_back(id);
     return id;
   }
 
-  template <typename Weight>
-  size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
+  template <typename Weight, typename Index>
+  void DirectedWeightedGraph<Weight, Index>::AddVertices(size_t count) {
+    incidence_lists_.resize(incidence_lists_.size() + count);
+  }
+
+  template <typename Weight, typename Index>
+  size_t DirectedWeightedGraph<Weight, Index>::GetVertexCount() const {
     return incidence_lists_.size();
   }
 
-  template <typename Weight>
-  size_t DirectedWeightedGraph<Weight>::GetEdgeCount() const {
+  template <typename Weight, typename Index>
+  size_t DirectedWeightedGraph<Weight, Index>::GetEdgeCount() const {
     return edges_.size();
   }
 
-  template <typename Weight>
-  const Edge<Weight>& DirectedWeightedGraph<Weight>::GetEdge(EdgeId edge_id) const {
+  template <typename Weight, typename Index>
+  const Edge<Weight, Index>& DirectedWeightedGraph<Weight, Index>::GetEdge(EdgeId edge_id) const {
     return edges_[edge_id];
   }
 
-  template <typename Weight>
-  typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
-  DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
+  template <typename Weight, typename Index>
+  typename DirectedWeightedGraph<Weight, Index>::IncidentEdgesRange
+  DirectedWeightedGraph<Weight, Index>::GetIncidentEdges(VertexId vertex) const {
     const auto& edges = incidence_lists_[vertex];
     return {std::begin(edges), std::end(edges)};
   }
+
+  // Frozen compressed sparse row copy of a graph: edges of a vertex are stored
+  // contiguously, targets and weights in separate arrays. Edges are addressed by
+  // their index in these arrays, GetEdgeId maps it back to the original EdgeId.
+  // It is a copy on purpose: the source graph stays the one that grows and is
+  // saved, the copy is the layout searches run over. The copy is about half the
+  // size of the source graph, so the two together take more memory than the
+  // source graph alone; what the copy buys is query speed.
+  template <typename Weight, typename Index = size_t>
+  class CompactGraph {
+  public:
+    explicit CompactGraph(const DirectedWeightedGraph<Weight, Index>& graph);
+    // Edge ids[i] is edges[i]
+    CompactGraph(size_t vertex_count, const std::vector<Edge<Weight, Index>>& edges, const std::vector<Index>& ids);
+    explicit CompactGraph(BinaryReader& input);
+
+    void Serialize(BinaryWriter& output) const;
+
+    size_t GetVertexCount() const;
+    size_t GetEdgeCount() const;
+    size_t EdgesBegin(VertexId vertex) const;
+    size_t EdgesEnd(VertexId vertex) const;
+    VertexId GetSource(size_t index) const;
+    VertexId GetTarget(size_t index) const;
+    Weight GetWeight(size_t index) const;
+    EdgeId GetEdgeId(size_t index) const;
+
+  private:
+    std::vector<Index> offsets_;
+    std::vector<Index> targets_;
+    std::vector<Weight> weights_;
+    std::vector<Index> edge_ids_;
+  };
+
+
+  template <typename Weight, typename Index>
+  CompactGraph<Weight, Index>::CompactGraph(const DirectedWeightedGraph<Weight, Index>& graph)
+      : offsets_(graph.GetVertexCount() + 1, 0)
+  {
+    const size_t edge_count = graph.GetEdgeCount();
+    targets_.reserve(edge_count);
+    weights_.reserve(edge_count);
+    edge_ids_.reserve(edge_count);
+    for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+      for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+        const auto& edge = graph.GetEdge(edge_id);
+        targets_.push_back(edge.to);
+        weights_.push_back(edge.weight);
+        edge_ids_.push_back(edge_id);
+      }
+      offsets_[vertex + 1] = targets_.size();
+    }
+  }
+
+  template <typename Weight, typename Index>
+  CompactGraph<Weight, Index>::CompactGraph(size_t vertex_count, const std::vector<Edge<Weight, Index>>& edges, const std::vector<Index>& ids)
+      : offsets_(vertex_count + 1, 0),
+        targets_(edges.size()),
+        weights_(edges.size()),
+        edge_ids_(edges.size())
+  {
+    for (const auto& edge : edges) {
+      ++offsets_[edge.from + 1];
+    }
+    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+      offsets_[vertex + 1] += offsets_[vertex];
+    }
+    std::vector<Index> positions(std::begin(offsets_), std::prev(std::end(offsets_)));
+    for (size_t i = 0; i < edges.size(); ++i) {
+      const size_t position = positions[edges[i].from]++;
+      targets_[position] = edges[i].to;
+      weights_[position] = edges[i].weight;
+      edge_ids_[position] = ids[i];
+    }
+  }
+
+  template <typename Weight, typename Index>
+  CompactGraph<Weight, Index>::CompactGraph(BinaryReader& input)
+      : offsets_(input.ReadVector<Index>()),
+        targets_(input.ReadVector<Index>()),
+        weights_(input.ReadVector<Weight>()),
+        edge_ids_(input.ReadVector<Index>())
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void CompactGraph<Weight, Index>::Serialize(BinaryWriter& output) const {
+    output.WriteVector(offsets_);
+    output.WriteVector(targets_);
+    output.WriteVector(weights_);
+    output.WriteVector(edge_ids_);
+  }
+
+  template <typename Weight, typename Index>
+  size_t CompactGraph<Weight, Index>::GetVertexCount() const {
+    return offsets_.size() - 1;
+  }
+
+  template <typename Weight, typename Index>
+  size_t CompactGraph<Weight, Index>::GetEdgeCount() const {
+    return targets_.size();
+  }
+
+  template <typename Weight, typename Index>
+  size_t CompactGraph<Weight, Index>::EdgesBegin(VertexId vertex) const {
+    return offsets_[vertex];
+  }
+
+  template <typename Weight, typename Index>
+  size_t CompactGraph<Weight, Index>::EdgesEnd(VertexId vertex) const {
+    return offsets_[vertex + 1];
+  }
+
+  template <typename Weight, typename Index>
+  VertexId CompactGraph<Weight, Index>::GetSource(size_t index) const {
+    return std::upper_bound(std::begin(offsets_), std::end(offsets_), index) - std::begin(offsets_) - 1;
+  }
+
+  template <typename Weight, typename Index>
+  VertexId CompactGraph<Weight, Index>::GetTarget(size_t index) const {
+    return targets_[index];
+  }
+
+  template <typename Weight, typename Index>
+  Weight CompactGraph<Weight, Index>::GetWeight(size_t index) const {
+    return weights_[index];
+  }
+
+  template <typename Weight, typename Index>
+  EdgeId CompactGraph<Weight, Index>::GetEdgeId(size_t index) const {
+    return edge_ids_[index];
+  }
 }
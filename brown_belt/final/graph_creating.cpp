@@ -1,5 +1,5 @@
 #include "guider.h"
-#include "profile.h"
+#include "metrics.h"
 #include <cassert>
 
 /* PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS */
@@ -10,100 +10,305 @@ bool TransportGraph::GraphExist() const {
 }
 
 optional<GetRouteInfo> TransportGraph::BuildRoute(Graph::VertexId from, Graph::VertexId to) const {
-	auto route = router_ptr->BuildRoute(from, to);
-	if (!route) {
-		return nullopt;
+	if (auto cached = route_cache_.Get({ from, to })) {
+		return move(*cached);
 	}
-	else {
-		vector<Graph::EdgeId> edges;
-		for (size_t i = 0; i < route.value().edge_count; ++i) {
-			edges.push_back(router_ptr->GetRouteEdge(route.value().id, i));
-		}
+	auto route = AssembleRoute(from, to);
+	route_cache_.Put({ from, to }, route);
+	return route;
+}
 
-		GetRouteInfo result;
-		for (const auto edge_id : edges) {
-			result.total_time += edges_[edge_id]->time;
-			result.items.push_back(edges_[edge_id]);
-		}
-		router_ptr->ReleaseRoute(route.value().id);
-		return move(result);
+vector<GetRouteInfo> TransportGraph::BuildAlternativeRoutes(Graph::VertexId from, Graph::VertexId to, size_t count) const {
+	vector<GetRouteInfo> result;
+	for (const auto& route : alternatives_->FindRoutes(*router_ptr, from, to, count)) {
+		result.push_back(RouteFromEdges(route.edges));
 	}
+	return result;
+}
+
+vector<optional<double>> TransportGraph::BuildMatrix(const vector<Graph::VertexId>& sources, const vector<Graph::VertexId>& targets) const {
+	return router_ptr->FindWeights(sources, targets);
+}
+
+CacheStats TransportGraph::RouteCacheStats() const {
+	return route_cache_.Stats();
 }
 
-Graph::VertexId TransportGraph::StopId(string_view stop) const {
-	return knots_.at(stop).in;
+void TransportGraph::ReportCacheMetrics() const {
+	if (!Metrics::Enabled()) return;
+	const CacheStats stats = route_cache_.Stats();
+	SetMetric(Counter::ROUTE_CACHE_HITS, stats.hits);
+	SetMetric(Counter::ROUTE_CACHE_MISSES, stats.misses);
+	SetMetric(Counter::ROUTE_CACHE_EVICTIONS, stats.evictions);
+	SetMetric(Counter::ROUTE_CACHE_BYTES, stats.bytes);
+}
+
+void TransportGraph::SetRouteCacheCapacity(size_t bytes) {
+	route_cache_.SetCapacity(bytes);
+}
+
+Graph::VertexId TransportGraph::InVertex(StopId stop) const {
+	return stop_vertices_[stop];
+}
+
+Graph::VertexId TransportGraph::OutVertex(StopId stop) const {
+	return stop_vertices_[stop] + 1;
+}
+
+bool TransportGraph::HasStop(StopId stop) const {
+	return GraphExist() && stop < stop_vertices_.size();
+}
+
+bool TransportGraph::HasBus(BusId bus) const {
+	return GraphExist() && bus < bus_count_;
+}
+
+void TransportGraph::Invalidate() {
+	outdated_ = true;
+}
+
+void TransportGraph::Update() {
+	if (!GraphExist() || outdated_) {
+		Create();
+	}
+	else if (stop_vertices_.size() < stops_.size() || bus_count_ < buses_.size()) {
+		Extend();
+	}
 }
 
 void TransportGraph::Create() {
-	LOG_DURATION("Graph and route creating");
+	CountMetric(Counter::GRAPH_REBUILDS);
+	{
+		MEASURE_PHASE(Phase::GRAPH_BUILD);
+		graph = DoubleGraph(0);
+		edges_.clear();
+		vertex_stops_.clear();
+		stop_vertices_.clear();
+		FillWithStops(0);
+		if (config_.bus_graph == BusGraphModel::COMPLETE) FillWithBuses(0);
+		else FillWithBusChains(0);
+		bus_count_ = buses_.size();
+		outdated_ = false;
+	}
+	CreateRouter();
+	alternatives_ = make_unique<Graph::KShortestRoutes<double>>(graph.value());
+	route_cache_.Clear();
+}
+
+// New stops and buses get vertices and edges after the existing ones, so the
+// router may keep its preprocessing and only catch up with the new edges
+void TransportGraph::Extend() {
+	CountMetric(Counter::GRAPH_EXTENSIONS);
+	const Graph::EdgeId first_new_edge = graph.value().GetEdgeCount();
 	{
-		const size_t vertex_count = stops_.size() * 2;
-		graph = DoubleGraph(vertex_count);
-		FillWithStops();
-		FillWithBuses();
+		MEASURE_PHASE(Phase::GRAPH_BUILD);
+		FillWithStops(stop_vertices_.size());
+		if (config_.bus_graph == BusGraphModel::COMPLETE) FillWithBuses(bus_count_);
+		else FillWithBusChains(bus_count_);
+		bus_count_ = buses_.size();
+	}
+	bool extended;
+	{
+		MEASURE_PHASE(Phase::ROUTER_PREPROCESSING);
+		extended = router_ptr->AddEdges(graph.value(), first_new_edge);
+	}
+	if (!extended) {
+		CountMetric(Counter::ROUTER_REBUILDS);
+		CreateRouter();
 	}
-	router_ptr = make_unique<Router>(graph.value());
+	alternatives_ = make_unique<Graph::KShortestRoutes<double>>(graph.value());
+	route_cache_.Clear();
 }
 
 
 /* PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS */
 
 
-double TransportGraph::Length(size_t from, size_t to) const {
-	return stops_.at(string(id_to_stop_[from])).distances.at(string(id_to_stop_[to]));
+// FindRoute doesn't touch the router's route cache, so routes may be assembled concurrently
+optional<GetRouteInfo> TransportGraph::AssembleRoute(Graph::VertexId from, Graph::VertexId to) const {
+	auto route = router_ptr->FindRoute(from, to);
+	if (!route) {
+		return nullopt;
+	}
+	return RouteFromEdges(route->edges);
 }
 
-void TransportGraph::FillWithStops() {
-	id_to_stop_.resize(stops_.size() * 2);
-	Graph::VertexId last_id = 0;
-	for (const auto& [stop_name, stop_info] : stops_) {
-		Graph::VertexId in_id = knots_[stop_name].in = last_id;
-		id_to_stop_[last_id++] = stop_name;
-		Graph::VertexId out_id = knots_[stop_name].out = last_id;
-		id_to_stop_[last_id++] = stop_name;
+GetRouteInfo TransportGraph::RouteFromEdges(const vector<Graph::EdgeId>& route) const {
+	GetRouteInfo result;
+	for (const auto edge_id : route) {
+		const EdgeInfo& edge = edges_[edge_id];
+		result.total_time += edge.time;
+		switch (edge.type) {
+		case EdgeType::WAIT:
+			result.items.push_back(Wait{ stop_names_.Name(edge.name_id), edge.time });
+			break;
+		case EdgeType::BUS:
+			result.items.push_back(Bus{ bus_names_.Name(edge.name_id), static_cast<int>(edge.spans), edge.time });
+			break;
+		case EdgeType::BOARD:
+			result.items.push_back(Bus{ bus_names_.Name(edge.name_id), 0, edge.time });
+			break;
+		case EdgeType::RIDE: {
+			Bus& bus = get<Bus>(result.items.back());
+			++bus.spans;
+			bus.time += edge.time;
+			break;
+		}
+		case EdgeType::ALIGHT:
+			get<Bus>(result.items.back()).time += edge.time;
+			break;
+		}
+	}
+	return result;
+}
+
+
+size_t TransportGraph::RouteBytes(const optional<GetRouteInfo>& route) {
+	return route ? route->items.capacity() * sizeof(Item) : 0;
+}
+
+double TransportGraph::Length(StopId from, StopId to) const {
+	return stops_[from].DistanceTo(to).value();
+}
+
+template <typename Weight, typename Index>
+unique_ptr<Graph::RouterBase<Weight, Index>> TransportGraph::MakeRouter(const Graph::DirectedWeightedGraph<Weight, Index>& g, BinaryReader* input) const {
+	switch (config_.router) {
+	case RouterType::FLOYD_WARSHALL:
+		if (input) return make_unique<Graph::Router<Weight, Index>>(g, *input);
+		return make_unique<Graph::Router<Weight, Index>>(g);
+	case RouterType::DIJKSTRA:
+		if (input) return make_unique<Graph::DijkstraRouter<Weight, Index>>(*input);
+		return make_unique<Graph::DijkstraRouter<Weight, Index>>(g);
+	case RouterType::A_STAR:
+		if (input) return make_unique<Graph::DijkstraRouter<Weight, Index>>(*input, StraightLineHeuristic());
+		return make_unique<Graph::DijkstraRouter<Weight, Index>>(g, StraightLineHeuristic());
+	case RouterType::CONTRACTION_HIERARCHY:
+		if (input) return make_unique<Graph::ContractionHierarchyRouter<Weight, Index>>(*input);
+		return make_unique<Graph::ContractionHierarchyRouter<Weight, Index>>(g);
+	}
+	return nullptr;
+}
+
+// The compact router is read back before its reference, as ValidatingRouter writes them
+void TransportGraph::CreateRouter(BinaryReader* input) {
+	MEASURE_PHASE(Phase::ROUTER_PREPROCESSING);
+	const DoubleGraph& g = graph.value();
+	if (!config_.compact_router) {
+		router_ptr = MakeRouter(g, input);
+		return;
+	}
+	auto compact = make_unique<CompactRouter>(g, [this, input](const auto& narrow) { return MakeRouter(narrow, input); });
+	if (config_.validation_epsilon) {
+		router_ptr = make_unique<Graph::ValidatingRouter<double>>(move(compact), MakeRouter(g, input), *config_.validation_epsilon);
+	}
+	else {
+		router_ptr = move(compact);
+	}
+}
+
+// Lower bound of the ride time: the straight line at bus velocity. It is a
+// bound only while no road is shorter than the straight line between its stops,
+// and the input doesn't promise that; otherwise there is no heuristic and A*
+// searches as plain Dijkstra.
+Graph::DijkstraRouter<double>::Heuristic TransportGraph::StraightLineHeuristic() const {
+	GeoPoints stop_points;
+	for (const StopInfo& stop : stops_) {
+		stop_points.Add(stop.coords);
+	}
+	for (StopId stop = 0; stop < stops_.size(); ++stop) {
+		for (const auto& [neighbour, distance] : stops_[stop].distances) {
+			if (distance < stop_points.Length(stop, neighbour)) {
+				return nullptr;
+			}
+		}
+	}
+	GeoPoints points;
+	for (StopId stop : vertex_stops_) {
+		points.Add(stops_[stop].coords);
+	}
+	const double velocity = config_.velocity;
+	return [points = move(points), velocity](Graph::VertexId v, Graph::VertexId target) {
+		return points.Length(v, target) / 1000 / velocity;
+	};
+}
+
+// Vertices of the stop or the bus chain being added
+Graph::VertexId TransportGraph::AddVertices(size_t count) {
+	const Graph::VertexId first = graph.value().GetVertexCount();
+	graph.value().AddVertices(count);
+	vertex_stops_.resize(first + count);
+	return first;
+}
 
-		graph.value().AddEdge(Graph::Edge<double>{in_id, out_id, config_.time});
-		edges_.push_back(make_shared<Wait>(stop_name, config_.time));
+void TransportGraph::FillWithStops(StopId first_stop) {
+	for (StopId stop = first_stop; stop < stops_.size(); ++stop) {
+		stop_vertices_.push_back(AddVertices(2));
+		vertex_stops_[InVertex(stop)] = vertex_stops_[OutVertex(stop)] = stop;
+		AddEdge({ EdgeType::WAIT, stop, config_.time }, InVertex(stop), OutVertex(stop));
 	}
 }
 
-void TransportGraph::AddEdge(
-	string_view name, Graph::VertexId from, Graph::VertexId to, double time, size_t spans) {
-	graph.value().AddEdge(Graph::Edge<double>{from, to, time});
-	edges_.push_back(make_shared<Bus>(name, static_cast<int>(spans), time));
+void TransportGraph::AddEdge(EdgeInfo info, Graph::VertexId from, Graph::VertexId to) {
+	graph.value().AddEdge(Graph::Edge<double>{from, to, info.time});
+	edges_.push_back(info);
 }
 
-void TransportGraph::FillWithBuses() {
-	for (const auto& [bus_name, bus_info] : buses_) {
-		const auto& stops = bus_info.stops;
+void TransportGraph::FillWithBuses(BusId first_bus) {
+	for (BusId bus = first_bus; bus < buses_.size(); ++bus) {
+		const auto& stops = buses_[bus].stops;
 		const size_t all_stops_count = stops.size();
-		if (bus_info.is_circled) {
+		if (buses_[bus].is_circled) {
 			for (size_t i = 0; i + 1 < all_stops_count; ++i) {
-				const Graph::VertexId from = knots_[stops[i]].out;
+				const Graph::VertexId from = OutVertex(stops[i]);
 				double total_length = 0;
 				for (size_t j = i + 1; j < all_stops_count; ++j) {
-					Graph::VertexId to = knots_[stops[j]].in;
-					total_length += Length(knots_[stops[j - 1]].in, to);
-					AddEdge(bus_name, from, to, total_length / 1000 / config_.velocity, j - i);
+					total_length += Length(stops[j - 1], stops[j]);
+					AddEdge({ EdgeType::BUS, bus, total_length / 1000 / config_.velocity, j - i }, from, InVertex(stops[j]));
 				}
 			}
 		}
 		else {
 			for (int i = 0; i < all_stops_count; ++i) {
-				const Graph::VertexId from = knots_[stops[i]].out;
+				const Graph::VertexId from = OutVertex(stops[i]);
 				double total_length = 0;
 				for (int j = i - 1; j >= 0; --j) {
-					Graph::VertexId to = knots_[stops[j]].in;
-					total_length += Length(knots_[stops[j + 1]].in, to);
-					AddEdge(bus_name, from, to, total_length / 1000 / config_.velocity, i - j);
+					total_length += Length(stops[j + 1], stops[j]);
+					AddEdge({ EdgeType::BUS, bus, total_length / 1000 / config_.velocity, static_cast<size_t>(i - j) }, from, InVertex(stops[j]));
 				}
 				total_length = 0;
 				for (int k = i + 1; k < all_stops_count; ++k) {
-					Graph::VertexId to = knots_[stops[k]].in;
-					total_length += Length(knots_[stops[k - 1]].in, to);
-					AddEdge(bus_name, from, to, total_length / 1000 / config_.velocity, k - i);
+					total_length += Length(stops[k - 1], stops[k]);
+					AddEdge({ EdgeType::BUS, bus, total_length / 1000 / config_.velocity, static_cast<size_t>(k - i) }, from, InVertex(stops[k]));
 				}
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+void TransportGraph::FillWithBusChains(BusId first_bus) {
+	for (BusId bus = first_bus; bus < buses_.size(); ++bus) {
+		const auto& stops = buses_[bus].stops;
+		AddBusChain(bus, stops, AddVertices(stops.size()));
+		if (!buses_[bus].is_circled) {
+			AddBusChain(bus, { stops.rbegin(), stops.rend() }, AddVertices(stops.size()));
+		}
+	}
+}
+
+// Vertex first_vertex + i is "on the bus at stops[i]": it is boarded from the
+// stop's out vertex, left to the stop's in vertex or ridden to the next stop.
+void TransportGraph::AddBusChain(BusId bus, const vector<StopId>& stops, Graph::VertexId first_vertex) {
+	for (size_t i = 0; i < stops.size(); ++i) {
+		const Graph::VertexId ride = first_vertex + i;
+		vertex_stops_[ride] = stops[i];
+		if (i + 1 < stops.size()) {
+			AddEdge({ EdgeType::BOARD, bus, 0 }, OutVertex(stops[i]), ride);
+			const double length = Length(stops[i], stops[i + 1]);
+			AddEdge({ EdgeType::RIDE, bus, length / 1000 / config_.velocity }, ride, ride + 1);
+		}
+		if (i > 0) {
+			AddEdge({ EdgeType::ALIGHT, bus, 0 }, ride, InVertex(stops[i]));
+		}
+	}
+}
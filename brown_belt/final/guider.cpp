@@ -1,64 +1,238 @@
 #include "guider.h"
-#include "profile.h"
+#include "metrics.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <future>
 
 const unsigned R = 6371000;
 
+namespace {
+	// Stat queries are handed out to threads in blocks: big enough to keep the
+	// counter cold, small enough to balance routes of different lengths.
+	const size_t STAT_QUERY_BLOCK = 64;
+	// Answers kept in memory at once by the parallel mode
+	const size_t STAT_QUERY_WINDOW = 1 << 14;
+
+	bool IsFound(const Json::Node& answer) {
+		return !answer.AsMap().count("error_message");
+	}
+	bool IsFound(const GetRouteInfo& answer) {
+		return answer.found;
+	}
+	bool IsFound(const GetRoutesInfo& answer) {
+		return !answer.routes.empty();
+	}
+
+	constexpr bool NeedsRoutes(QueryType type) {
+		return type == QueryType::ROUTE || type == QueryType::ROUTES || type == QueryType::MATRIX;
+	}
+
+	Phase StatQueryPhase(QueryType type) {
+		switch (type) {
+		case QueryType::GET_STOP_INFO: return Phase::STOP_QUERY;
+		case QueryType::GET_BUS_INFO: return Phase::BUS_QUERY;
+		case QueryType::ROUTE: return Phase::ROUTE_QUERY;
+		case QueryType::ROUTES: return Phase::ROUTES_QUERY;
+		case QueryType::NEAREST_STOPS: return Phase::NEAREST_STOPS_QUERY;
+		case QueryType::STOPS_IN_RADIUS: return Phase::STOPS_IN_RADIUS_QUERY;
+		default: return Phase::MATRIX_QUERY;
+		}
+	}
+}
+
 double Length(const Coordinates& lhs, const Coordinates& rhs) {
-	return R * acos(
+	// rounding may push the cosine of a zero angle above 1, acos of that is NaN
+	return R * acos(min(1.0,
 		sin(lhs.LatRad()) * sin(rhs.LatRad()) +
 		cos(lhs.LatRad()) * cos(rhs.LatRad()) *
 		cos(abs(lhs.LongRad() - rhs.LongRad()))
-	);
+	));
 }
 
 
 /* PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS---PUBLIC_METHODS */
 
-TransportGuider::TransportGuider() : TG(TransportGraph{ stops_info, buses_info, cfg }) {};
-
-
-void TransportGuider::ProcessQueries(vector<QueryPtr> queries, ostream& stream) {
-	vector<Json::Node> nodes;
-	for (const auto& query : queries) {
-		switch (query->type) {
-		case QueryType::SETTINGS:
-			SetConfig(*SetCast(*query));
-			break;
-		case QueryType::STOP:
-			ProcessStopQuery(*StopCast(*query));
-			break;
-		case QueryType::GET_STOP_INFO:
-			nodes.push_back(NodeFromStop(ProcessGetStopInfoQuery(*StopGetCast(*query))));
-			break;
-		case QueryType::BUS_STOPS:
-			ProcessBusStopsQuery(*BusStopsCast(*query));
-			break;
-		case QueryType::GET_BUS_INFO:
-			nodes.push_back(NodeFromBus(ProcessGetBusInfoQuery(*BusGetCast(*query))));
-			break;
-		case QueryType::ROUTE:
-			if (!TG.GraphExist())	TG.Create();
-			nodes.push_back(NodeFromRoute(ProcessGetRouteInfoQuery(*RouteCast(*query))));
-			break;
+optional<double> StopInfo::DistanceTo(StopId stop) const {
+	for (const auto& [to, distance] : distances) {
+		if (to == stop) return distance;
+	}
+	return nullopt;
+}
+
+
+TransportGuider::TransportGuider() : TG(stops_info, buses_info, stop_names, bus_names, cfg) {};
+
+
+void TransportGuider::ProcessQueries(vector<Query> queries, ostream& stream) {
+	Json::ArrayWriter output(stream);
+	for (auto& query : queries) {
+		ProcessQuery(query, &output.Items());
+	}
+	output.Finish();
+	TG.ReportCacheMetrics();
+}
+
+void TransportGuider::ProcessQueriesParallel(vector<Query> queries, size_t thread_count, ostream& stream) {
+	vector<Query*> stat_queries;
+	bool has_routes = false;
+	for (auto& query : queries) {
+		if (IsStatQuery(TypeOf(query))) {
+			stat_queries.push_back(&query);
+			has_routes |= NeedsRoutes(TypeOf(query));
+		}
+		else {
+			ProcessQuery(query);
+		}
+	}
+	Finalize();
+	if (has_routes) BuildRoutes();
+
+	// Every thread writes answers as text to a buffer of its own, answers of
+	// a window are written out in order before the next window is started
+	Json::ArrayWriter output(stream);
+	vector<string> answers(min(STAT_QUERY_WINDOW, stat_queries.size()));
+	for (size_t window = 0; window < stat_queries.size(); window += STAT_QUERY_WINDOW) {
+		const size_t window_end = min(window + STAT_QUERY_WINDOW, stat_queries.size());
+		atomic<size_t> next_block = window;
+		auto worker = [&] {
+			Json::OutputBuffer buffer;
+			Json::Writer writer(buffer);
+			for (size_t begin = next_block.fetch_add(STAT_QUERY_BLOCK); begin < window_end;
+				begin = next_block.fetch_add(STAT_QUERY_BLOCK)) {
+				const size_t end = min(begin + STAT_QUERY_BLOCK, window_end);
+				for (size_t i = begin; i < end; ++i) {
+					ProcessStatQuery(*stat_queries[i], writer);
+					answers[i - window] = buffer.Text();
+					buffer.Clear();
+				}
+			}
+		};
+		vector<future<void>> futures;
+		for (size_t i = 1; i < thread_count; ++i) {
+			futures.push_back(async(launch::async, worker));
+		}
+		worker();
+		for (auto& f : futures) f.get();
+
+		for (size_t i = window; i < window_end; ++i) {
+			output.Items().Raw(answers[i - window]);
 		}
 	}
-	InfoOutput(Json::Document(Json::Node(move(nodes))), stream);
+	output.Finish();
+	TG.ReportCacheMetrics();
+}
+
+template <typename StatQuery>
+void TransportGuider::AnswerStatQuery(StatQuery& query, Json::Writer& output) const {
+	// routes are written from their items, other answers are built as nodes
+	const auto answer = [&] {
+		MEASURE_PHASE(StatQueryPhase(StatQuery::TYPE));
+		if constexpr (is_same_v<StatQuery, GetStopInfoQuery>) return NodeFromStop(ProcessGetStopInfoQuery(query));
+		else if constexpr (is_same_v<StatQuery, GetBusInfoQuery>) return NodeFromBus(ProcessGetBusInfoQuery(query));
+		else if constexpr (is_same_v<StatQuery, RouteQuery>) return ProcessGetRouteInfoQuery(query);
+		else if constexpr (is_same_v<StatQuery, RoutesQuery>) return ProcessGetRoutesInfoQuery(query);
+		else if constexpr (is_same_v<StatQuery, MatrixQuery>) return NodeFromMatrix(ProcessGetMatrixInfoQuery(query));
+		else if constexpr (is_same_v<StatQuery, NearestStopsQuery>) return NodeFromNearbyStops(ProcessNearestStopsQuery(query));
+		else if constexpr (is_same_v<StatQuery, StopsInRadiusQuery>) return NodeFromNearbyStops(ProcessStopsInRadiusQuery(query));
+		else static_assert(sizeof(StatQuery) == 0, "Not a stat query");
+	}();
+	if (Metrics::Enabled() && !IsFound(answer)) {
+		CountMetric(Counter::NOT_FOUND);
+	}
+
+	MEASURE_PHASE(Phase::OUTPUT);
+	if constexpr (is_same_v<StatQuery, RouteQuery>) WriteRoute(answer, output);
+	else if constexpr (is_same_v<StatQuery, RoutesQuery>) WriteRoutes(answer, output);
+	else output.Value(answer);
+}
+
+void TransportGuider::ProcessStatQuery(Query& query, Json::Writer& output) const {
+	visit([this, &output](auto& typed) {
+		using Type = decay_t<decltype(typed)>;
+		if constexpr (IsStatQuery(Type::TYPE)) AnswerStatQuery(typed, output);
+		else throw invalid_argument("Not a stat query");
+	}, query);
+}
+
+void TransportGuider::ProcessQuery(Query& query, Json::Writer* output) {
+	visit([this, output](auto& typed) {
+		using Type = decay_t<decltype(typed)>;
+		if constexpr (IsStatQuery(Type::TYPE)) {
+			Finalize();
+			if constexpr (NeedsRoutes(Type::TYPE)) BuildRoutes();
+			if (output) AnswerStatQuery(typed, *output);
+		}
+		else if constexpr (is_same_v<Type, SettingsQuery>) SetConfig(typed);
+		else if constexpr (is_same_v<Type, StopQuery>) ProcessStopQuery(typed);
+		else if constexpr (is_same_v<Type, BusStopsQuery>) ProcessBusStopsQuery(typed);
+		else if constexpr (is_same_v<Type, SerializationQuery>) base_file = typed.file;
+	}, query);
+}
+
+void TransportGuider::BuildRoutes() {
+	TG.Update();
+}
+
+void TransportGuider::Finalize() {
+	if (finalized) return;
+	MEASURE_PHASE(Phase::FINALIZE);
+	for (StopInfo& stop : stops_info) {
+		sort(stop.buses.begin(), stop.buses.end(), [this](BusId lhs, BusId rhs) {
+			return bus_names.Name(lhs) < bus_names.Name(rhs);
+		});
+	}
+	const GeoPoints points = StopPoints();
+	for (BusInfo& bus : buses_info) {
+		// valid input, but there is no route to count or measure
+		if (bus.stops.empty()) {
+			bus.stats = {};
+			continue;
+		}
+		bus.stats.stop_count = bus.is_circled ? bus.stops.size() : 2 * bus.stops.size() - 1;
+		bus.stats.unique_stop_count = UniqueStopsCount(bus.stops);
+		const double length = points.RouteLength(bus.stops);
+		bus.stats.length = bus.is_circled ? length : 2 * length;
+		bus.stats.real_length = GetRealLength(bus.stops, bus.is_circled);
+	}
+	IndexStops();
+	finalized = true;
 }
 
 void TransportGuider::SetConfig(SettingsQuery& query) {
+	MEASURE_PHASE(Phase::BASE_APPLY);
 	cfg.time = query.w_time;
 	cfg.velocity = query.b_vel;
+	cfg.router = query.router;
+	// Floyd-Warshall is cubic in vertices, so it prefers fewer vertices to fewer edges
+	cfg.bus_graph = query.bus_graph.value_or(
+		cfg.router == RouterType::FLOYD_WARSHALL ? BusGraphModel::COMPLETE : BusGraphModel::LINEAR);
+	cfg.compact_router = query.compact_router;
+	cfg.validation_epsilon = query.validation_epsilon;
+	TG.Invalidate();
 }
 
 void TransportGuider::ProcessStopQuery(StopQuery& query) {
-	auto& this_stop = stops_info[query.stop_name];
-	this_stop.coords = query.coords;
-	for (const auto& [stop, dist] : query.distances) {
-		this_stop.distances[stop] = dist;
-		if (!stops_info[stop].distances.count(query.stop_name)) {
-			stops_info[stop].distances[query.stop_name] = dist;
+	MEASURE_PHASE(Phase::BASE_APPLY);
+	finalized = false;
+	const StopId this_stop = InternStop(query.stop_name);
+	// coordinates of a stop only matter to the graph through the A* heuristic
+	if (TG.HasStop(this_stop) && cfg.router == RouterType::A_STAR && !(stops_info[this_stop].coords == query.coords)) {
+		TG.Invalidate();
+	}
+	stops_info[this_stop].coords = query.coords;
+	for (const auto& [stop_name, dist] : query.distances) {
+		const StopId stop = InternStop(stop_name);
+		auto& distances = stops_info[this_stop].distances;
+		auto it = find_if(distances.begin(), distances.end(), [stop](const auto& item) { return item.first == stop; });
+		if (it != distances.end()) {
+			// edges of existing buses may have been weighted with the old distance
+			if (it->second != dist && TG.HasStop(this_stop) && TG.HasStop(stop)) TG.Invalidate();
+			it->second = dist;
+		}
+		else distances.push_back({ stop, dist });
+		if (!stops_info[stop].DistanceTo(this_stop)) {
+			stops_info[stop].distances.push_back({ this_stop, dist });
 		}
 	}
 }
@@ -66,32 +240,44 @@ void TransportGuider::ProcessStopQuery(StopQuery& query) {
 GetStopInfo TransportGuider::ProcessGetStopInfoQuery(GetStopInfoQuery& query) const {
 	GetStopInfo info;
 	info.stop_name = move(query.stop_name);
-	info.found = stops_info.count(info.stop_name);
+	const auto stop = stop_names.Find(info.stop_name);
+	info.found = stop.has_value();
 	info.req_id = query.req_id;
 	if (info.found) {
-		info.buses = { stops_info.at(info.stop_name).buses.begin(), stops_info.at(info.stop_name).buses.end() };
+		for (const BusId bus : stops_info[*stop].buses) {
+			info.buses.push_back(string(bus_names.Name(bus)));
+		}
 	}
 	return info;
 }
 
 void TransportGuider::ProcessBusStopsQuery(BusStopsQuery& query) {
-	for (const auto& stop : query.stops) {
-		stops_info[stop].buses.insert(query.bus_id);
+	MEASURE_PHASE(Phase::BASE_APPLY);
+	finalized = false;
+	const BusId bus = bus_names.Intern(query.bus_id);
+	if (bus == buses_info.size()) buses_info.emplace_back();
+	if (TG.HasBus(bus)) TG.Invalidate();
+	vector<StopId> stops;
+	stops.reserve(query.stops.size());
+	for (const auto& stop_name : query.stops) {
+		const StopId stop = InternStop(stop_name);
+		auto& buses = stops_info[stop].buses;
+		if (find(buses.begin(), buses.end(), bus) == buses.end()) buses.push_back(bus);
+		stops.push_back(stop);
 	}
-	buses_info[move(query.bus_id)] = BusInfo(move(query.stops), query.is_circled);
+	buses_info[bus] = BusInfo(move(stops), query.is_circled);
 }
 
 GetBusInfo TransportGuider::ProcessGetBusInfoQuery(GetBusInfoQuery& query) const {
-	if (buses_info.count(query.bus_id)) {
+	if (const auto bus = bus_names.Find(query.bus_id)) {
 		GetBusInfo info;
-		const BusInfo& bus_info = buses_info.at(query.bus_id);
+		const BusInfo& bus_info = buses_info[*bus];
 		info.bus_id = move(query.bus_id);
-		info.is_circled = buses_info.at(info.bus_id).is_circled;
-		info.all_stops_count = info.is_circled ? bus_info.stops.size()
-			: 2 * bus_info.stops.size() - 1;
-		info.unique_stops_count = UniqueStopsCount(bus_info.stops);
-		info.length = info.is_circled ? GetLength(bus_info.stops) : 2 * GetLength(bus_info.stops);
-		info.real_length = GetRealLength(bus_info.stops, info.is_circled);
+		info.is_circled = bus_info.is_circled;
+		info.all_stops_count = bus_info.stats.stop_count;
+		info.unique_stops_count = bus_info.stats.unique_stop_count;
+		info.length = bus_info.stats.length;
+		info.real_length = bus_info.stats.real_length;
 		info.req_id = query.req_id;
 		return info;
 	}
@@ -105,7 +291,9 @@ GetRouteInfo TransportGuider::ProcessGetRouteInfoQuery(RouteQuery& query) const
 	//if (query.from == query.to) return { query.req_id, 0, {}, true };
 	result.req_id = query.req_id;
 
-	auto route = TG.BuildRoute(TG.StopId(query.from), TG.StopId(query.to));
+	const auto from = stop_names.Find(query.from), to = stop_names.Find(query.to);
+	if (!from || !to) return result;
+	auto route = TG.BuildRoute(TG.InVertex(*from), TG.InVertex(*to));
 	if (route) {
 		result.found = true;
 		result.items = move(route.value().items);
@@ -114,54 +302,119 @@ GetRouteInfo TransportGuider::ProcessGetRouteInfoQuery(RouteQuery& query) const
 	return result;
 }
 
-void TransportGuider::InfoOutput(const Json::Document& doc, ostream& stream) const {
-	LOG_DURATION("Output");
-	Json::UploadDocument(doc, stream);
+GetRoutesInfo TransportGuider::ProcessGetRoutesInfoQuery(RoutesQuery& query) const {
+	GetRoutesInfo result;
+	result.req_id = query.req_id;
+	const auto from = stop_names.Find(query.from), to = stop_names.Find(query.to);
+	if (!from || !to) return result;
+	result.routes = TG.BuildAlternativeRoutes(TG.InVertex(*from), TG.InVertex(*to), query.count);
+	return result;
+}
+
+GetMatrixInfo TransportGuider::ProcessGetMatrixInfoQuery(MatrixQuery& query) const {
+	GetMatrixInfo result;
+	result.req_id = query.req_id;
+	vector<Graph::VertexId> sources, targets;
+	for (const auto& [names, vertices] : { pair(&query.from, &sources), pair(&query.to, &targets) }) {
+		for (const string& name : *names) {
+			const auto stop = stop_names.Find(name);
+			if (!stop) return result;
+			vertices->push_back(TG.InVertex(*stop));
+		}
+	}
+	result.found = true;
+	result.rows = sources.size();
+	result.columns = targets.size();
+	result.times = TG.BuildMatrix(sources, targets);
+	return result;
+}
+
+GetNearbyStopsInfo TransportGuider::ProcessNearestStopsQuery(NearestStopsQuery& query) const {
+	return NearbyStops(query.req_id, stop_index.Nearest(query.point, query.count));
+}
+
+GetNearbyStopsInfo TransportGuider::ProcessStopsInRadiusQuery(StopsInRadiusQuery& query) const {
+	return NearbyStops(query.req_id, stop_index.WithinRadius(query.point, query.radius));
 }
 
 
 /* PUBLIC_CHECK_METHODS---PUBLIC_CHECK_METHODS---PUBLIC_CHECK_METHODS---PUBLIC_CHECK_METHODS */
 
 
-const unordered_map<string, StopInfo>& TransportGuider::CheckStops() const {
+const vector<StopInfo>& TransportGuider::CheckStops() const {
 	return stops_info;
 }
 
-const unordered_map<string, BusInfo>& TransportGuider::CheckBuses() const {
+const vector<BusInfo>& TransportGuider::CheckBuses() const {
 	return buses_info;
 }
 
-double TransportGuider::RealLength(const string& from, const string& to) const {
-	return stops_info.at(from).distances.at(to);
+const StringInterner& TransportGuider::CheckStopNames() const {
+	return stop_names;
+}
+
+const StringInterner& TransportGuider::CheckBusNames() const {
+	return bus_names;
+}
+
+double TransportGuider::RealLength(StopId from, StopId to) const {
+	return stops_info[from].DistanceTo(to).value();
 }
 
 const Settings& TransportGuider::CheckSettings() const {
 	return cfg;
 }
 
+CacheStats TransportGuider::RouteCacheStats() const {
+	return TG.RouteCacheStats();
+}
+
 
 /* PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS---PRIVATE_METHODS */
 
 
-size_t TransportGuider::UniqueStopsCount(const vector<string>& stops) const {
-	unordered_set<string> u_stops;
-	for (const auto& stop : stops) u_stops.insert(stop);
-	return u_stops.size();
+StopId TransportGuider::InternStop(string_view name) {
+	const StopId stop = stop_names.Intern(name);
+	if (stop == stops_info.size()) stops_info.emplace_back();
+	return stop;
 }
 
-double TransportGuider::GetLength(const vector<string>& stops) const {
-	double length = 0;
-	if (stops.size() >= 2) {
-		for (size_t i = 0; i < stops.size() - 1; ++i) {
-			length += Length(stops_info.at(stops[i]).coords, stops_info.at(stops[i + 1]).coords);
-		}
+size_t TransportGuider::UniqueStopsCount(const vector<StopId>& stops) const {
+	vector<StopId> u_stops = stops;
+	sort(u_stops.begin(), u_stops.end());
+	return unique(u_stops.begin(), u_stops.end()) - u_stops.begin();
+}
+
+void TransportGuider::IndexStops() {
+	vector<Coordinates> coords;
+	coords.reserve(stops_info.size());
+	for (const StopInfo& stop : stops_info) {
+		coords.push_back(stop.coords);
 	}
-	return length;
+	stop_index = GeoIndex(coords);
+}
+
+GetNearbyStopsInfo TransportGuider::NearbyStops(int req_id, const vector<GeoIndex::Neighbour>& neighbours) const {
+	GetNearbyStopsInfo info;
+	info.req_id = req_id;
+	info.stops.reserve(neighbours.size());
+	for (const auto& [stop, length] : neighbours) {
+		info.stops.push_back({ stop_names.Name(stop), length });
+	}
+	return info;
+}
+
+GeoPoints TransportGuider::StopPoints() const {
+	GeoPoints points;
+	for (const StopInfo& stop : stops_info) {
+		points.Add(stop.coords);
+	}
+	return points;
 }
 
-double TransportGuider::GetRealLength(const vector<string>& stops, bool is_circled) const {
+double TransportGuider::GetRealLength(const vector<StopId>& stops, bool is_circled) const {
 	double length = 0;
-	for (size_t i = 0; i < stops.size() - 1; ++i) {
+	for (size_t i = 0; i + 1 < stops.size(); ++i) {
 		length += is_circled ? RealLength(stops[i], stops[i + 1]) :
 			(RealLength(stops[i], stops[i + 1]) + RealLength(stops[i + 1], stops[i]));
 	}
@@ -2,8 +2,17 @@
 #include "input_parsing.h"
 #include "json.h"
 #include "graph.h"
+#include "router_base.h"
 #include "router.h"
+#include "dijkstra_router.h"
+#include "ch_router.h"
+#include "k_shortest_routes.h"
+#include "narrow_router.h"
 #include "responses.h"
+#include "interner.h"
+#include "binary_io.h"
+#include "geo.h"
+#include "lru_cache.h"
 #include <unordered_map>
 #include <unordered_set>
 #include <iostream>
@@ -20,27 +29,36 @@ using namespace std;
 
 double Length(const Coordinates& from, const Coordinates& to);
 
-struct StopInfo {
-	StopInfo() = default;
-	StopInfo(Coordinates c, set<string> buses_, Distances dist)
-		: coords(c), buses(move(buses_)), distances(move(dist)) {}
+using StopId = size_t;
+using BusId = size_t;
 
+struct StopInfo {
 	Coordinates coords;
-	set<string> buses;
-	Distances distances;
+	vector<BusId> buses; // without repeats, sorted by name after TransportGuider::Finalize
+	vector<pair<StopId, double>> distances; // road distances to other stops, a few per stop
+
+	optional<double> DistanceTo(StopId stop) const;
 
 	bool operator== (const StopInfo& other) const {
 		return coords == other.coords && buses == other.buses;
 	}
 };
 
+struct BusStats {
+	size_t stop_count = 0; // with the way back for non-roundtrip buses
+	size_t unique_stop_count = 0;
+	double length = 0; // geographic
+	double real_length = 0; // by roads
+};
+
 struct BusInfo {
 	BusInfo() = default;
-	BusInfo(vector<string> stops_, bool circled)
+	BusInfo(vector<StopId> stops_, bool circled)
 		: stops(move(stops_)), is_circled(circled) {}
 
-	vector<string> stops = {};
+	vector<StopId> stops = {};
 	bool is_circled = 0;
+	BusStats stats; // filled by TransportGuider::Finalize
 
 	bool operator== (const BusInfo& other) const {
 		return make_tuple(stops, is_circled) ==
@@ -52,71 +70,183 @@ struct BusInfo {
 struct Settings {
 	double time = 0; // min
 	double velocity = 0; // km/min
+	RouterType router = RouterType::DIJKSTRA;
+	BusGraphModel bus_graph = BusGraphModel::LINEAR;
+	bool compact_router = false;
+	optional<double> validation_epsilon; // only with compact_router
+};
+
+// WAIT and BUS edges are route items by themselves. In the linear model
+// a bus item is BOARD, one RIDE per span and ALIGHT.
+enum class EdgeType {
+	WAIT,
+	BUS,
+	BOARD,
+	RIDE,
+	ALIGHT
 };
 
-struct Knot {
-	Graph::VertexId in;
-	Graph::VertexId out;
+struct EdgeInfo {
+	EdgeType type;
+	size_t name_id; // StopId for WAIT, BusId otherwise
+	double time;
+	size_t spans = 0; // BUS only
 };
 
+// Every stop has an in vertex and the out vertex following it, bus chains of
+// the linear model have a vertex per stop. Stops and buses added after the graph
+// is built get vertices after the existing ones.
 class TransportGraph {
 private:
-	using Stops = unordered_map<string, StopInfo>;
-	using Buses = unordered_map<string, BusInfo>;
+	using Stops = vector<StopInfo>;
+	using Buses = vector<BusInfo>;
 	using DoubleGraph = Graph::DirectedWeightedGraph<double>;
-	using Router = Graph::Router<double>;
+	using Router = Graph::RouterBase<double>;
+	using CompactRouter = Graph::NarrowRouter<double, float, uint32_t>;
 public:
 	TransportGraph(
-		const Stops& s, const Buses& b, const Settings& set
-	) : stops_(s), buses_(b), config_(set) {}
+		const Stops& s, const Buses& b, const StringInterner& stop_names, const StringInterner& bus_names, const Settings& set
+	) : stops_(s), buses_(b), stop_names_(stop_names), bus_names_(bus_names), config_(set),
+		route_cache_(ROUTE_CACHE_BYTES, RouteBytes) {}
 
 	bool GraphExist() const;
-	Graph::VertexId StopId(string_view stop) const;
+	Graph::VertexId InVertex(StopId stop) const;
+	Graph::VertexId OutVertex(StopId stop) const;
+	// Stops and buses the graph has been built with
+	bool HasStop(StopId stop) const;
+	bool HasBus(BusId bus) const;
+	// Existing stops or buses have changed, the next Update rebuilds everything
+	void Invalidate();
+	// Builds the graph, rebuilds it if invalidated or extends it with new stops and buses
+	void Update();
+	// Repeated routes, found or not, come from a cache of recently built ones
 	optional<GetRouteInfo> BuildRoute(Graph::VertexId from, Graph::VertexId to) const;
-	void Create();
+	// Up to count loopless routes, best first; not cached
+	vector<GetRouteInfo> BuildAlternativeRoutes(Graph::VertexId from, Graph::VertexId to, size_t count) const;
+	// Total times from every source to every target, row-major; not cached
+	vector<optional<double>> BuildMatrix(const vector<Graph::VertexId>& sources, const vector<Graph::VertexId>& targets) const;
+	CacheStats RouteCacheStats() const;
+	// Copies the route cache stats to the metrics registry if it is enabled
+	void ReportCacheMetrics() const;
+	void SetRouteCacheCapacity(size_t bytes);
+	void Serialize(BinaryWriter& output) const;
+	void Deserialize(BinaryReader& input);
 
 private:
-	double Length(size_t from, size_t to) const;
-	void FillWithStops();
-	void FillWithBuses();
-	void AddEdge(string_view name, Graph::VertexId from, Graph::VertexId to, double time, size_t spans);
+	void Create();
+	void Extend();
+	double Length(StopId from, StopId to) const;
+	Graph::VertexId AddVertices(size_t count);
+	void FillWithStops(StopId first_stop);
+	void FillWithBuses(BusId first_bus);
+	void FillWithBusChains(BusId first_bus);
+	void AddBusChain(BusId bus, const vector<StopId>& stops, Graph::VertexId first_vertex);
+	// Builds the router, or reads its preprocessing back if input is given
+	void CreateRouter(BinaryReader* input = nullptr);
+	template <typename Weight, typename Index>
+	unique_ptr<Graph::RouterBase<Weight, Index>> MakeRouter(const Graph::DirectedWeightedGraph<Weight, Index>& g, BinaryReader* input) const;
+	Graph::DijkstraRouter<double>::Heuristic StraightLineHeuristic() const;
+	void AddEdge(EdgeInfo info, Graph::VertexId from, Graph::VertexId to);
+	optional<GetRouteInfo> AssembleRoute(Graph::VertexId from, Graph::VertexId to) const;
+	GetRouteInfo RouteFromEdges(const vector<Graph::EdgeId>& route) const;
+	static size_t RouteBytes(const optional<GetRouteInfo>& route);
 private:
+	struct VertexPairHash {
+		size_t operator()(const pair<Graph::VertexId, Graph::VertexId>& vertices) const {
+			return vertices.first * 1'000'003 + vertices.second;
+		}
+	};
+	static const size_t ROUTE_CACHE_BYTES = 32 << 20;
+
 	const Stops& stops_;
 	const Buses& buses_;
+	const StringInterner& stop_names_;
+	const StringInterner& bus_names_;
 	const Settings& config_;
 
+	// Kept next to the routers' frozen copies: extensions, alternative routes
+	// and the database are built from it
 	optional<DoubleGraph> graph;
 	unique_ptr<Router> router_ptr;
+	unique_ptr<Graph::KShortestRoutes<double>> alternatives_;
+
+	vector<StopId> vertex_stops_;
+	vector<Graph::VertexId> stop_vertices_; // in vertex of each stop
+	size_t bus_count_ = 0;
+	bool outdated_ = false;
+	vector<EdgeInfo> edges_;
 
-	unordered_map<string_view, Knot> knots_;
-	vector<string_view> id_to_stop_;
-	deque<ItemPtr> edges_;
+	// sharded, so stat queries on parallel threads seldom share a lock
+	mutable ShardedLruCache<pair<Graph::VertexId, Graph::VertexId>, optional<GetRouteInfo>, VertexPairHash> route_cache_;
 };
 
 
 class TransportGuider {
 public:
 	TransportGuider();
-	void ProcessQueries(vector<QueryPtr> queries, ostream& stream = cout);
+	// Responses are written out as soon as they are ready, none are gathered
+	void ProcessQueries(vector<Query> queries, ostream& stream = cout);
+	// Applies base queries, builds the graph once, then answers stat queries
+	// on thread_count threads. Responses keep the order of the stat queries and
+	// are written out a window of queries at a time.
+	void ProcessQueriesParallel(vector<Query> queries, size_t thread_count, ostream& stream = cout);
+	// make_base: applies base queries, builds the routes and saves it all to the serialization file
+	void MakeBase(vector<Query> queries);
+	// The same with the database written to the stream instead
+	void MakeBase(vector<Query> queries, ostream& base);
+	// process_requests: maps the serialization file, loads it and answers stat queries, other queries are ignored
+	void ProcessRequests(vector<Query> queries, ostream& stream = cout);
+	// The same with the database given in memory
+	void ProcessRequests(vector<Query> queries, string_view base, ostream& stream);
+	void Serialize(ostream& output) const;
+	void Deserialize(string_view data);
+	// Stat queries are answered to the output, without one they only prepare the guider
+	void ProcessQuery(Query& query, Json::Writer* output = nullptr);
+	// Stat queries only read the guider and are safe to process concurrently
+	// once the routes are built, each thread with an output of its own.
+	void ProcessStatQuery(Query& query, Json::Writer& output) const;
+	void BuildRoutes();
+	// Precomputes bus stats, sorts stop buses and indexes stop coordinates once base
+	// queries are applied, stat queries only read them
+	void Finalize();
 	void SetConfig(SettingsQuery& query);
 	void ProcessStopQuery(StopQuery& query);
 	GetStopInfo ProcessGetStopInfoQuery(GetStopInfoQuery& query) const;
 	void ProcessBusStopsQuery(BusStopsQuery& query);
 	GetBusInfo ProcessGetBusInfoQuery(GetBusInfoQuery& query) const;
 	GetRouteInfo ProcessGetRouteInfoQuery(RouteQuery& query) const;
-	void InfoOutput(const Json::Document& doc, ostream& stream = cout) const;
-
-	const unordered_map<string, StopInfo>& CheckStops() const;
-	const unordered_map<string, BusInfo>& CheckBuses() const;
-	double RealLength(const string& from, const string& to) const;
+	GetRoutesInfo ProcessGetRoutesInfoQuery(RoutesQuery& query) const;
+	GetMatrixInfo ProcessGetMatrixInfoQuery(MatrixQuery& query) const;
+	GetNearbyStopsInfo ProcessNearestStopsQuery(NearestStopsQuery& query) const;
+	GetNearbyStopsInfo ProcessStopsInRadiusQuery(StopsInRadiusQuery& query) const;
+
+	const vector<StopInfo>& CheckStops() const;
+	const vector<BusInfo>& CheckBuses() const;
+	const StringInterner& CheckStopNames() const;
+	const StringInterner& CheckBusNames() const;
+	double RealLength(StopId from, StopId to) const;
 	const Settings& CheckSettings() const;
+	CacheStats RouteCacheStats() const;
 protected:
-	size_t UniqueStopsCount(const vector<string>& stops) const;
-	double GetLength(const vector<string>& stops) const;
-	double GetRealLength(const vector<string>& stops, bool is_circled) const;
+	// ProcessStatQuery for a query of a known type
+	template <typename StatQuery>
+	void AnswerStatQuery(StatQuery& query, Json::Writer& output) const;
+	StopId InternStop(string_view name);
+	size_t UniqueStopsCount(const vector<StopId>& stops) const;
+	GeoPoints StopPoints() const;
+	// Builds the spatial index of stop coordinates for nearby stop queries
+	void IndexStops();
+	GetNearbyStopsInfo NearbyStops(int req_id, const vector<GeoIndex::Neighbour>& neighbours) const;
+	double GetRealLength(const vector<StopId>& stops, bool is_circled) const;
 protected:
-	unordered_map<string, StopInfo> stops_info;
-	unordered_map<string, BusInfo> buses_info;
+	// Names are interned as base queries come, everything else is indexed by id
+	StringInterner stop_names;
+	StringInterner bus_names;
+	vector<StopInfo> stops_info;
+	vector<BusInfo> buses_info;
+	GeoIndex stop_index; // built by Finalize
 	Settings cfg;
+	bool finalized = false;
+	string base_file;
 	TransportGraph TG;
 };
\ No newline at end of file
@@ -1,4 +1,8 @@
 #include "input_parsing.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 
 double Coordinates::LatRad() const {
 	return latitude * 3.1415926535 / 180;
@@ -7,110 +11,268 @@ double Coordinates::LongRad() const {
 	return longitude * 3.1415926535 / 180;
 }
 
-QueryPtr ParseGetQuery(const Json::Node& query) {
-	auto map = query.AsMap();
-	if (map.at("type").AsString() == "Stop") {
-		return make_unique<GetStopInfoQuery>(
-			map.at("name").AsString(),
-			static_cast<int>(map.at("id").AsDouble())
-			);
-	}
-	else if (map.at("type").AsString() == "Bus") {
-		return make_unique<GetBusInfoQuery>(
-			map.at("name").AsString(),
-			static_cast<int>(map.at("id").AsDouble())
-			);
-	}
-	else if (map.at("type").AsString() == "Route") {
-		return make_unique<RouteQuery>(
-			map.at("from").AsString(),
-			map.at("to").AsString(),
-			static_cast<int>(map.at("id").AsDouble())
-			);
-	}
-	else throw invalid_argument("Unknown command");
+RouterType ParseRouterType(const string& name) {
+	if (name == "floyd_warshall") return RouterType::FLOYD_WARSHALL;
+	else if (name == "dijkstra") return RouterType::DIJKSTRA;
+	else if (name == "a_star") return RouterType::A_STAR;
+	else if (name == "contraction_hierarchy") return RouterType::CONTRACTION_HIERARCHY;
+	else throw invalid_argument("Unknown router " + name);
 }
 
-QueryPtr ParsePutQuery(const Json::Node& query) {
-	auto map = query.AsMap();
+BusGraphModel ParseBusGraphModel(const string& name) {
+	if (name == "complete") return BusGraphModel::COMPLETE;
+	else if (name == "linear") return BusGraphModel::LINEAR;
+	else throw invalid_argument("Unknown bus graph model " + name);
+}
 
-	if (map.count("type")) {
-		if (map.at("type").AsString() == "Stop") {
+namespace {
+	// Fields of one request, whichever way it was read: from a node or from parsing events.
+	struct RequestFields {
+		string type, name, from, to, router, bus_graph, file;
+		optional<double> latitude, longitude, id, bus_wait_time, bus_velocity, count, radius, validation_epsilon;
+		bool is_roundtrip = false, compact_router = false;
+		vector<string> stops, sources, targets;
+		Distances road_distances;
+
+		void SetString(string_view key, string_view value) {
+			if (key == "type") type = value;
+			else if (key == "name") name = value;
+			else if (key == "from") from = value;
+			else if (key == "to") to = value;
+			else if (key == "router") router = value;
+			else if (key == "bus_graph") bus_graph = value;
+			else if (key == "file") file = value;
+		}
+		void SetNumber(string_view key, double value) {
+			if (key == "latitude") latitude = value;
+			else if (key == "longitude") longitude = value;
+			else if (key == "id") id = value;
+			else if (key == "bus_wait_time") bus_wait_time = value;
+			else if (key == "bus_velocity") bus_velocity = value;
+			else if (key == "count") count = value;
+			else if (key == "radius") radius = value;
+			else if (key == "validation_epsilon") validation_epsilon = value;
+		}
+		void SetBool(string_view key, bool value) {
+			if (key == "is_roundtrip") is_roundtrip = value;
+			else if (key == "compact_router") compact_router = value;
+		}
+		// An item of a nested array or object: "stops", "from", "to" or "road_distances"
+		void AddString(string_view key, string_view value) {
+			if (key == "stops") stops.emplace_back(value);
+			else if (key == "from") sources.emplace_back(value);
+			else if (key == "to") targets.emplace_back(value);
+		}
+		void AddNumber(string_view key, string_view nested_key, double value) {
+			if (key == "road_distances") road_distances.emplace_back(nested_key, value);
+		}
 
-			Distances distances;
-			for (const auto& dist : map.at("road_distances").AsMap()) {
-				distances.insert({ dist.first, dist.second.AsDouble() });
+		void SetNode(string_view key, const Json::Node& value) {
+			if (holds_alternative<Json::String>(value)) SetString(key, value.AsString());
+			else if (holds_alternative<double>(value)) SetNumber(key, value.AsDouble());
+			else if (holds_alternative<bool>(value)) SetBool(key, value.AsBool());
+			else if (holds_alternative<Json::Array>(value)) {
+				for (const auto& item : value.AsArray()) AddString(key, item.AsString());
+			}
+			else {
+				for (const auto& [nested_key, item] : value.AsMap()) AddNumber(key, nested_key, item.AsDouble());
 			}
+		}
+	};
 
-			return make_unique<StopQuery>(
-				map.at("name").AsString(),
-				map.at("latitude").AsDouble(),
-				map.at("longitude").AsDouble(),
-				move(distances)
-				);
+	RequestFields FieldsFromNode(const Json::Node& query) {
+		RequestFields fields;
+		for (const auto& [key, value] : query.AsMap()) {
+			fields.SetNode(key, value);
+		}
+		return fields;
+	}
+
+	// Throws invalid_argument unless the count is a whole number, not negative;
+	// bigger ones than max_count are cut down to it
+	size_t ParseCount(optional<double> count, size_t max_count) {
+		const double value = count.value_or(1);
+		if (!(value >= 0) || value != floor(value)) {
+			throw invalid_argument("Count must be a non-negative whole number");
 		}
-		else if (map.at("type").AsString() == "Bus") {
+		return value > max_count ? max_count : static_cast<size_t>(value);
+	}
 
-			vector<string> stops;
-			stops.reserve(map.at("stops").AsArray().size());
-			for (const auto& stop : map.at("stops").AsArray()) {
-				stops.push_back(stop.AsString());
-			}
-			return make_unique<BusStopsQuery>(
-				map.at("name").AsString(),
-				move(stops),
-				map.at("is_roundtrip").AsBool()
-				);
+	Query MakeGetQuery(RequestFields fields) {
+		const int id = static_cast<int>(fields.id.value());
+		if (fields.type == "Stop") {
+			return GetStopInfoQuery(move(fields.name), id);
+		}
+		else if (fields.type == "Bus") {
+			return GetBusInfoQuery(move(fields.name), id);
+		}
+		else if (fields.type == "Route") {
+			return RouteQuery(move(fields.from), move(fields.to), id);
+		}
+		else if (fields.type == "Routes") {
+			return RoutesQuery(move(fields.from), move(fields.to), ParseCount(fields.count, RoutesQuery::MAX_COUNT), id);
+		}
+		else if (fields.type == "Matrix") {
+			return MatrixQuery(move(fields.sources), move(fields.targets), id);
+		}
+		else if (fields.type == "NearestStops") {
+			return NearestStopsQuery({ fields.latitude.value(), fields.longitude.value() },
+				ParseCount(fields.count, NearestStopsQuery::MAX_COUNT), id);
+		}
+		else if (fields.type == "StopsInRadius") {
+			return StopsInRadiusQuery({ fields.latitude.value(), fields.longitude.value() }, fields.radius.value(), id);
 		}
 		else throw invalid_argument("Unknown command");
 	}
-	else {
-		return make_unique<SettingsQuery>(
-			map.at("bus_wait_time").AsDouble(),
-			map.at("bus_velocity").AsDouble() / 60.0
-			);
+
+	Query MakePutQuery(RequestFields fields) {
+		if (fields.type == "Stop") {
+			return StopQuery(
+				move(fields.name),
+				fields.latitude.value(),
+				fields.longitude.value(),
+				move(fields.road_distances)
+				);
+		}
+		else if (fields.type == "Bus") {
+			return BusStopsQuery(
+				move(fields.name),
+				move(fields.stops),
+				fields.is_roundtrip
+				);
+		}
+		else if (!fields.file.empty()) {
+			return SerializationQuery(move(fields.file));
+		}
+		else if (fields.type.empty()) {
+			SettingsQuery settings(
+				fields.bus_wait_time.value(),
+				fields.bus_velocity.value() / 60.0,
+				fields.router.empty() ? RouterType::DIJKSTRA : ParseRouterType(fields.router),
+				fields.bus_graph.empty() ? nullopt : optional(ParseBusGraphModel(fields.bus_graph))
+				);
+			settings.compact_router = fields.compact_router;
+			settings.validation_epsilon = fields.validation_epsilon;
+			return settings;
+		}
+		else throw invalid_argument("Unknown command");
 	}
-}
 
-vector<QueryPtr> ReadQueries(istream& input) {
-	vector<QueryPtr> queries;
+	// Builds queries right from parsing events, no tree is kept.
+	// Requests are the objects in "routing_settings" and "serialization_settings" (depth 2)
+	// and in the "base_requests" and "stat_requests" arrays (depth 3).
+	class QueryReader : public Json::Handler {
+	public:
+		void StartArray() override {
+			++depth_;
+		}
+		void EndArray() override {
+			--depth_;
+		}
+		void StartObject() override {
+			if (++depth_ == RequestDepth()) fields_ = {};
+		}
+		void Key(string_view key) override {
+			if (depth_ == 1) section_ = SectionByKey(key);
+			else if (depth_ == RequestDepth()) key_ = key;
+			else if (depth_ == RequestDepth() + 1) nested_key_ = key;
+		}
+		void EndObject() override {
+			if (depth_-- == RequestDepth()) {
+				queries_.push_back(section_ == Section::STAT ? MakeGetQuery(move(fields_)) : MakePutQuery(move(fields_)));
+				sections_.push_back(section_);
+			}
+		}
+		void String(string_view value) override {
+			if (depth_ == RequestDepth()) fields_.SetString(key_, value);
+			else if (depth_ == RequestDepth() + 1) fields_.AddString(key_, value);
+		}
+		void Number(double value) override {
+			if (depth_ == RequestDepth()) fields_.SetNumber(key_, value);
+			else if (depth_ == RequestDepth() + 1) fields_.AddNumber(key_, nested_key_, value);
+		}
+		void Bool(bool value) override {
+			if (depth_ == RequestDepth()) fields_.SetBool(key_, value);
+		}
 
-	Json::Document doc = Json::Load(input);
-	auto settings = doc.GetRoot().AsMap().at("routing_settings");
-	auto base_requests = doc.GetRoot().AsMap().at("base_requests");
-	auto stat_requests = doc.GetRoot().AsMap().at("stat_requests");
+		// Settings first, then base requests, then stat requests. Stat requests
+		// usually come last, then only the queries before them are reordered.
+		vector<Query> Queries() && {
+			const size_t stat_begin = find(sections_.begin(), sections_.end(), Section::STAT) - sections_.begin();
+			const bool stats_last = all_of(sections_.begin() + stat_begin, sections_.end(),
+				[](Section section) { return section == Section::STAT; });
+			const size_t reordered = stats_last ? stat_begin : queries_.size();
+			if (is_sorted(sections_.begin(), sections_.begin() + reordered)) {
+				return move(queries_);
+			}
+			vector<Query> head;
+			head.reserve(reordered);
+			for (const Section section : { Section::SETTINGS, Section::BASE, Section::STAT }) {
+				for (size_t i = 0; i < reordered; ++i) {
+					if (sections_[i] == section) head.push_back(move(queries_[i]));
+				}
+			}
+			move(head.begin(), head.end(), queries_.begin());
+			return move(queries_);
+		}
 
-	queries.push_back(ParsePutQuery(settings));
+	private:
+		enum class Section : uint8_t {
+			NONE,
+			SETTINGS,
+			BASE,
+			STAT
+		};
 
-	for (const auto& req : base_requests.AsArray()) {
-		queries.push_back(ParsePutQuery(req));
-	}
-	for (const auto& req : stat_requests.AsArray()) {
-		queries.push_back(ParseGetQuery(req));
-	}
-	return queries;
-}
+		static Section SectionByKey(string_view key) {
+			if (key == "routing_settings" || key == "serialization_settings") return Section::SETTINGS;
+			else if (key == "base_requests") return Section::BASE;
+			else if (key == "stat_requests") return Section::STAT;
+			else return Section::NONE;
+		}
+
+		size_t RequestDepth() const {
+			switch (section_) {
+			case Section::SETTINGS: return 2;
+			case Section::BASE: case Section::STAT: return 3;
+			default: return 0;
+			}
+		}
 
-SettingsQuery* SetCast(Query& query) {
-	return dynamic_cast<SettingsQuery*>(&query);
+		size_t depth_ = 0;
+		Section section_ = Section::NONE;
+		string key_, nested_key_;
+		RequestFields fields_;
+		vector<Query> queries_;
+		vector<Section> sections_; // of every query
+	};
 }
 
-StopQuery* StopCast(Query& query) {
-	return dynamic_cast<StopQuery*>(&query);
+Query ParseGetQuery(const Json::Node& query) {
+	return MakeGetQuery(FieldsFromNode(query));
 }
 
-GetStopInfoQuery* StopGetCast(Query& query) {
-	return dynamic_cast<GetStopInfoQuery*>(&query);
+Query ParsePutQuery(const Json::Node& query) {
+	return MakePutQuery(FieldsFromNode(query));
 }
 
-BusStopsQuery* BusStopsCast(Query& query) {
-	return dynamic_cast<BusStopsQuery*>(&query);
+vector<Query> ReadQueries(istream& input) {
+	MEASURE_PHASE(Phase::PARSE);
+	QueryReader reader;
+	Json::Parse(input, reader);
+	return move(reader).Queries();
 }
 
-GetBusInfoQuery* BusGetCast(Query& query) {
-	return dynamic_cast<GetBusInfoQuery*>(&query);
+vector<Query> ReadQueries(string_view text) {
+	MEASURE_PHASE(Phase::PARSE);
+	QueryReader reader;
+	Json::Parse(text, reader);
+	return move(reader).Queries();
 }
 
-RouteQuery* RouteCast(Query& query) {
-	return dynamic_cast<RouteQuery*>(&query);
-}
\ No newline at end of file
+vector<Query> ReadQueries(const Json::Document& doc) {
+	MEASURE_PHASE(Phase::PARSE);
+	QueryReader reader;
+	Json::Traverse(doc.GetRoot(), reader);
+	return move(reader).Queries();
+}
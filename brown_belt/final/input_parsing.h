@@ -6,9 +6,12 @@
 #include <sstream>
 #include <stdexcept>
 #include <memory>
+#include <optional>
 #include <algorithm>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
+#include <variant>
 #include "json.h"
 using namespace std;
 
@@ -18,14 +21,12 @@ enum class QueryType {
 	GET_STOP_INFO,
 	GET_BUS_INFO,
 	SETTINGS,
-	ROUTE
-};
-
-struct Query {
-	Query() = default;
-	QueryType type;
-	int req_id = 0;
-	virtual QueryType Type() const { return type; }
+	ROUTE,
+	ROUTES,
+	MATRIX,
+	NEAREST_STOPS,
+	STOPS_IN_RADIUS,
+	SERIALIZATION
 };
 
 struct Coordinates {
@@ -41,21 +42,55 @@ struct Coordinates {
 	}
 };
 
-struct SettingsQuery : Query {
-	SettingsQuery(double t, double v) : w_time(t), b_vel(v)
+enum class RouterType {
+	FLOYD_WARSHALL,
+	DIJKSTRA,
+	A_STAR,
+	CONTRACTION_HIERARCHY
+};
+
+// COMPLETE: an edge between every two stops of a bus, O(k^2) per bus of k stops.
+// LINEAR: a chain of ride vertices per bus direction, O(k) per bus.
+enum class BusGraphModel {
+	COMPLETE,
+	LINEAR
+};
+
+RouterType ParseRouterType(const string& name);
+
+BusGraphModel ParseBusGraphModel(const string& name);
+
+struct SettingsQuery {
+	static constexpr QueryType TYPE = QueryType::SETTINGS;
+	SettingsQuery(double t, double v, RouterType r = RouterType::DIJKSTRA, optional<BusGraphModel> m = nullopt)
+		: w_time(t), b_vel(v), router(r), bus_graph(m)
 	{
-		type = QueryType::SETTINGS;
 	}
 	double w_time; //min
 	double b_vel; //km/min
+	RouterType router;
+	optional<BusGraphModel> bus_graph; // default depends on the router
+	// float weights and 32-bit ids in the router, optionally checked against the full-width one
+	bool compact_router = false;
+	optional<double> validation_epsilon;
 };
 
-using Distances = unordered_map<string, double>;
-struct StopQuery : Query {
-	StopQuery(const string& stop, double lat_, double long_, const Distances& dist)
-		: stop_name(stop), coords({ lat_, long_ }), distances(dist)
+// Where make_base writes the built database and process_requests reads it
+struct SerializationQuery {
+	static constexpr QueryType TYPE = QueryType::SERIALIZATION;
+	explicit SerializationQuery(string file_) : file(move(file_))
+	{
+	}
+	string file;
+};
+
+// in the order of the request, a stop has a few of them
+using Distances = vector<pair<string, double>>;
+struct StopQuery {
+	static constexpr QueryType TYPE = QueryType::STOP;
+	StopQuery(string stop, double lat_, double long_, Distances dist)
+		: stop_name(move(stop)), distances(move(dist)), coords({ lat_, long_ })
 	{
-		type = QueryType::STOP;
 	}
 
 	string stop_name;
@@ -63,21 +98,21 @@ struct StopQuery : Query {
 	Coordinates coords;
 };
 
-struct GetStopInfoQuery : Query {
-	GetStopInfoQuery(const string& name, int id) : stop_name(name)
+struct GetStopInfoQuery {
+	static constexpr QueryType TYPE = QueryType::GET_STOP_INFO;
+	GetStopInfoQuery(string name, int id) : req_id(id), stop_name(move(name))
 	{
-		type = QueryType::GET_STOP_INFO;
-		req_id = id;
 	}
 
+	int req_id;
 	string stop_name;
 };
 
-struct BusStopsQuery : Query {
-	BusStopsQuery(const string& id, const vector<string>& stops_, bool circled)
-		: bus_id(id), stops(stops_), is_circled(circled)
+struct BusStopsQuery {
+	static constexpr QueryType TYPE = QueryType::BUS_STOPS;
+	BusStopsQuery(string id, vector<string> stops_, bool circled)
+		: bus_id(move(id)), stops(move(stops_)), is_circled(circled)
 	{
-		type = QueryType::BUS_STOPS;
 	}
 
 	string bus_id;
@@ -85,42 +120,118 @@ struct BusStopsQuery : Query {
 	bool is_circled;
 };
 
-struct GetBusInfoQuery : Query {
-	GetBusInfoQuery(const string& id, int r_id) : bus_id(id)
+struct GetBusInfoQuery {
+	static constexpr QueryType TYPE = QueryType::GET_BUS_INFO;
+	GetBusInfoQuery(string id, int r_id) : req_id(r_id), bus_id(move(id))
 	{
-		type = QueryType::GET_BUS_INFO;
-		req_id = r_id;
 	}
 
+	int req_id;
 	string bus_id;
 };
 
-struct RouteQuery : Query {
-	RouteQuery(const string& f, const string& t, int id)
-		: from(f), to(t)
+struct RouteQuery {
+	static constexpr QueryType TYPE = QueryType::ROUTE;
+	RouteQuery(string f, string t, int id)
+		: req_id(id), from(move(f)), to(move(t))
 	{
-		type = QueryType::ROUTE;
-		req_id = id;
 	}
+	int req_id;
 	string from, to;
 };
 
-using QueryPtr = unique_ptr<Query>;
-
-QueryPtr ParsePutQuery(const Json::Node& query);
-
-QueryPtr ParseGetQuery(const Json::Node& query);
-
-vector<QueryPtr> ReadQueries(istream& input = cin);
-
-SettingsQuery* SetCast(Query& query);
+// Up to count alternative routes, best first. Yen's algorithm may grow
+// exponentially with the count, so a greater count asks for MAX_COUNT.
+struct RoutesQuery {
+	static constexpr QueryType TYPE = QueryType::ROUTES;
+	static constexpr size_t MAX_COUNT = 5;
+	RoutesQuery(string f, string t, size_t count_, int id)
+		: req_id(id), from(move(f)), to(move(t)), count(count_)
+	{
+	}
+	int req_id;
+	string from, to;
+	size_t count;
+};
 
-StopQuery* StopCast(Query& query);
+// Travel times from every source stop to every target stop, without route items
+struct MatrixQuery {
+	static constexpr QueryType TYPE = QueryType::MATRIX;
+	MatrixQuery(vector<string> f, vector<string> t, int id)
+		: req_id(id), from(move(f)), to(move(t))
+	{
+	}
+	int req_id;
+	vector<string> from, to;
+};
 
-GetStopInfoQuery* StopGetCast(Query& query);
+// Up to count stops nearest to a point, nearest first; at most MAX_COUNT
+struct NearestStopsQuery {
+	static constexpr QueryType TYPE = QueryType::NEAREST_STOPS;
+	static constexpr size_t MAX_COUNT = 100;
+	NearestStopsQuery(Coordinates p, size_t count_, int id)
+		: req_id(id), point(p), count(count_)
+	{
+	}
+	int req_id;
+	Coordinates point;
+	size_t count;
+};
 
-BusStopsQuery* BusStopsCast(Query& query);
+// Stops no farther from a point than radius meters, nearest first
+struct StopsInRadiusQuery {
+	static constexpr QueryType TYPE = QueryType::STOPS_IN_RADIUS;
+	StopsInRadiusQuery(Coordinates p, double r, int id)
+		: req_id(id), point(p), radius(r)
+	{
+	}
+	int req_id;
+	Coordinates point;
+	double radius;
+};
 
-GetBusInfoQuery* BusGetCast(Query& query);
+// Queries are stored by value, a vector of them is one allocation. Alternatives
+// go in the order of QueryType, so the type of a query is its index.
+using Query = variant<
+	BusStopsQuery,
+	StopQuery,
+	GetStopInfoQuery,
+	GetBusInfoQuery,
+	SettingsQuery,
+	RouteQuery,
+	RoutesQuery,
+	MatrixQuery,
+	NearestStopsQuery,
+	StopsInRadiusQuery,
+	SerializationQuery
+>;
+
+template <size_t... Indices>
+constexpr bool QueryTypesMatchIndices(index_sequence<Indices...>) {
+	return ((variant_alternative_t<Indices, Query>::TYPE == static_cast<QueryType>(Indices)) && ...);
+}
+static_assert(QueryTypesMatchIndices(make_index_sequence<variant_size_v<Query>>()),
+	"Query alternatives must follow QueryType");
+
+inline QueryType TypeOf(const Query& query) {
+	return static_cast<QueryType>(query.index());
+}
+
+// Stat queries only read the base and get a response
+constexpr bool IsStatQuery(QueryType type) {
+	return type == QueryType::GET_STOP_INFO || type == QueryType::GET_BUS_INFO
+		|| type == QueryType::ROUTE || type == QueryType::ROUTES || type == QueryType::MATRIX
+		|| type == QueryType::NEAREST_STOPS || type == QueryType::STOPS_IN_RADIUS;
+}
+
+Query ParsePutQuery(const Json::Node& query);
+
+Query ParseGetQuery(const Json::Node& query);
+
+vector<Query> ReadQueries(const Json::Document& doc);
+
+// Builds queries while parsing, without a Json::Node tree
+vector<Query> ReadQueries(string_view text);
+
+vector<Query> ReadQueries(istream& input = cin);
 
-RouteQuery* RouteCast(Query& query);
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include "interner.h"
+
+size_t StringInterner::Intern(string_view name) {
+	if (auto it = ids_.find(name); it != ids_.end()) {
+		return it->second;
+	}
+	const size_t id = names_.size();
+	ids_.emplace(names_.emplace_back(name), id);
+	return id;
+}
+
+optional<size_t> StringInterner::Find(string_view name) const {
+	if (auto it = ids_.find(name); it != ids_.end()) {
+		return it->second;
+	}
+	return nullopt;
+}
+
+string_view StringInterner::Name(size_t id) const {
+	return names_[id];
+}
+
+size_t StringInterner::Size() const {
+	return names_.size();
+}
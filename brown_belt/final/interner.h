@@ -0,0 +1,21 @@
+#pragma once
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+using namespace std;
+
+// Gives names dense ids in the order they first appear: 0, 1, 2...
+// Views returned by Name stay valid for the interner's lifetime.
+class StringInterner {
+public:
+	size_t Intern(string_view name);
+	optional<size_t> Find(string_view name) const;
+	string_view Name(size_t id) const;
+	size_t Size() const;
+
+private:
+	deque<string> names_;
+	unordered_map<string_view, size_t> ids_;
+};
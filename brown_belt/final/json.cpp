@@ -1,19 +1,119 @@
 #include "json.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <new>
 
 using namespace std;
 
 namespace Json {
-	Document::Document(Node root) : root(move(root)) {
+	Node::Node(vector<Node> items) : variant(Array(make_move_iterator(items.begin()), make_move_iterator(items.end()))) {
+	}
+
+	Node::Node(map<string, Node> items) {
+		pmr::vector<Dict::value_type> dict_items;
+		dict_items.reserve(items.size());
+		for (auto& [key, value] : items) {
+			dict_items.emplace_back(string_view(key), move(value));
+		}
+		emplace<Dict>(move(dict_items));
+	}
+
+	Dict::Dict(pmr::memory_resource* resource) : items_(resource) {
+	}
+
+	Dict::Dict(pmr::vector<value_type> items) : items_(move(items)) {
+		const auto by_key = [](const value_type& lhs, const value_type& rhs) { return lhs.first < rhs.first; };
+		if (items_.size() <= LINEAR_LOOKUP_MAX_SIZE) {
+			// insertion sort, stable and with no buffer of its own
+			for (auto it = items_.begin(); it != items_.end(); ++it) {
+				rotate(upper_bound(items_.begin(), it, *it, by_key), it, next(it));
+			}
+		}
+		else if (!is_sorted(items_.begin(), items_.end(), by_key)) {
+			stable_sort(items_.begin(), items_.end(), by_key);
+		}
+		items_.erase(unique(items_.begin(), items_.end(),
+			[](const value_type& lhs, const value_type& rhs) { return lhs.first == rhs.first; }), items_.end());
+	}
+
+	Dict::Dict(initializer_list<value_type> items) : Dict(pmr::vector<value_type>(items)) {
+	}
+
+	Dict::const_iterator Dict::find(string_view key) const {
+		const size_t index = LowerBound(key);
+		return index < items_.size() && items_[index].first == key ? items_.begin() + index : items_.end();
+	}
+
+	size_t Dict::count(string_view key) const {
+		return find(key) != items_.end();
+	}
+
+	const Node& Dict::at(string_view key) const {
+		const auto it = find(key);
+		if (it == items_.end()) {
+			throw out_of_range("No key " + string(key));
+		}
+		return it->second;
+	}
+
+	Node& Dict::operator[](string_view key) {
+		const size_t index = LowerBound(key);
+		if (index == items_.size() || items_[index].first != key) {
+			items_.emplace(items_.begin() + index, key, Node());
+		}
+		return items_[index].second;
+	}
+
+	pair<Dict::const_iterator, bool> Dict::emplace(string_view key, Node value) {
+		const size_t index = LowerBound(key);
+		if (index < items_.size() && items_[index].first == key) {
+			return { items_.begin() + index, false };
+		}
+		return { items_.emplace(items_.begin() + index, key, move(value)), true };
+	}
+
+	size_t Dict::LowerBound(string_view key) const {
+		if (items_.size() <= LINEAR_LOOKUP_MAX_SIZE) {
+			size_t index = 0;
+			while (index < items_.size() && string_view(items_[index].first) < key) {
+				++index;
+			}
+			return index;
+		}
+		return lower_bound(items_.begin(), items_.end(), key,
+			[](const value_type& item, string_view key) { return string_view(item.first) < key; }) - items_.begin();
+	}
+
+	bool operator==(const Dict& lhs, const Dict& rhs) {
+		return lhs.items_ == rhs.items_;
+	}
+
+	bool operator!=(const Dict& lhs, const Dict& rhs) {
+		return !(lhs == rhs);
+	}
+
+	Document::Document(Node root) : root_(new Node(move(root)), RootDeleter{ false }) {
+	}
+
+	Document::Document(unique_ptr<pmr::monotonic_buffer_resource> arena, Node* root)
+		: arena_(move(arena)), root_(root, RootDeleter{ true })
+	{
+	}
+
+	void Document::RootDeleter::operator()(Node* node) const {
+		if (!in_arena) delete node;
 	}
 
 	const Node& Document::GetRoot() const {
-		return root;
+		return *root_;
 	}
 
 	Node LoadNode(istream& input);
 
 	Node LoadArray(istream& input) {
-		vector<Node> result;
+		Array result;
 
 		for (char c; input >> c && c != ']'; ) {
 			if (c != ',') {
@@ -39,18 +139,18 @@ namespace Json {
 	Node LoadString(istream& input) {
 		string line;
 		getline(input, line, '"');
-		return Node(move(line));
+		return Node(line);
 	}
 
 	Node LoadDict(istream& input) {
-		map<string, Node> result;
+		Dict result;
 
 		for (char c; input >> c && c != '}'; ) {
 			if (c == ',') {
 				input >> c;
 			}
 
-			string key = LoadString(input).AsString();
+			String key = LoadString(input).AsString();
 			input >> c;
 			result.emplace(move(key), LoadNode(input));
 		}
@@ -94,57 +194,416 @@ namespace Json {
 
 	}
 
-	Document Load(istream& input) {
+	Document LoadStream(istream& input) {
 		return Document{ LoadNode(input) };
 	}
 
+	//BUFFERED PARSING FUNCTIONS: the parsed prefix is removed from the input
+
+	void SkipSpaces(string_view& input) {
+		size_t pos = 0;
+		while (pos < input.size() && isspace(static_cast<unsigned char>(input[pos]))) ++pos;
+		input.remove_prefix(pos);
+	}
+
+	char NextChar(string_view& input) {
+		SkipSpaces(input);
+		if (input.empty()) throw ParsingError("Unexpected end of JSON");
+		const char c = input.front();
+		input.remove_prefix(1);
+		return c;
+	}
+
+	void ParseNode(string_view& input, Handler& handler, string& scratch);
+
+	void ParseArray(string_view& input, Handler& handler, string& scratch) {
+		handler.StartArray();
+
+		SkipSpaces(input);
+		if (!input.empty() && input.front() == ']') {
+			input.remove_prefix(1);
+			handler.EndArray();
+			return;
+		}
+		for (char c = ','; c != ']'; c = NextChar(input)) {
+			if (c != ',') throw ParsingError("Expected ',' or ']' in array");
+			ParseNode(input, handler, scratch);
+		}
+
+		handler.EndArray();
+	}
+
+	double ParseNumber(string_view& input) {
+		double result;
+		const auto [end, error] = from_chars(input.data(), input.data() + input.size(), result);
+		if (error != errc()) throw ParsingError("Bad number in JSON");
+		input.remove_prefix(end - input.data());
+		return result;
+	}
+
+	char ParseEscaped(string_view& input) {
+		if (input.empty()) throw ParsingError("Unexpected end of JSON");
+		const char c = input.front();
+		input.remove_prefix(1);
+		switch (c) {
+		case 'n': return '\n';
+		case 't': return '\t';
+		case 'r': return '\r';
+		case 'b': return '\b';
+		case 'f': return '\f';
+		case '"': case '\\': case '/': return c;
+		default: throw ParsingError("Unsupported escape in JSON string");
+		}
+	}
+
+	// A string without escapes is a view of the input, otherwise it is unescaped to scratch
+	string_view ParseString(string_view& input, string& scratch) {
+		size_t pos = input.find_first_of("\"\\");
+		if (pos == string_view::npos) throw ParsingError("Unterminated JSON string");
+		if (input[pos] == '"') {
+			const string_view result = input.substr(0, pos);
+			input.remove_prefix(pos + 1);
+			return result;
+		}
+		scratch.clear();
+		while (true) {
+			scratch.append(input.substr(0, pos));
+			const char c = input[pos];
+			input.remove_prefix(pos + 1);
+			if (c == '"') return scratch;
+			scratch.push_back(ParseEscaped(input));
+			pos = input.find_first_of("\"\\");
+			if (pos == string_view::npos) throw ParsingError("Unterminated JSON string");
+		}
+	}
+
+	void ParseDict(string_view& input, Handler& handler, string& scratch) {
+		handler.StartObject();
+
+		char c = NextChar(input);
+		while (c != '}') {
+			if (c != '"') throw ParsingError("Expected a key in object");
+			handler.Key(ParseString(input, scratch));
+			if (NextChar(input) != ':') throw ParsingError("Expected ':' in object");
+			ParseNode(input, handler, scratch);
+			c = NextChar(input);
+			if (c == ',') c = NextChar(input);
+			else if (c != '}') throw ParsingError("Expected ',' or '}' in object");
+		}
+
+		handler.EndObject();
+	}
+
+	bool ParseBool(string_view& input) {
+		for (const auto& [word, value] : { pair{ string_view("true"), true }, pair{ string_view("false"), false } }) {
+			if (input.substr(0, word.size()) == word) {
+				input.remove_prefix(word.size());
+				return value;
+			}
+		}
+		throw ParsingError("Bad literal in JSON");
+	}
+
+	void ParseNode(string_view& input, Handler& handler, string& scratch) {
+		SkipSpaces(input);
+		if (input.empty()) throw ParsingError("Unexpected end of JSON");
+		const char c = input.front();
+
+		if (c == '[' || c == '{' || c == '"') {
+			input.remove_prefix(1);
+			if (c == '[') ParseArray(input, handler, scratch);
+			else if (c == '{') ParseDict(input, handler, scratch);
+			else handler.String(ParseString(input, scratch));
+		}
+		else if (isdigit(static_cast<unsigned char>(c)) || c == '-') {
+			handler.Number(ParseNumber(input));
+		}
+		else {
+			handler.Bool(ParseBool(input));
+		}
+	}
+
+	void Parse(string_view text, Handler& handler) {
+		string scratch;
+		ParseNode(text, handler, scratch);
+		SkipSpaces(text);
+		if (!text.empty()) throw ParsingError("Unexpected data after JSON");
+	}
+
+	string ReadAll(istream& input) {
+		string text;
+		char buffer[1 << 16];
+		while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+			text.append(buffer, input.gcount());
+		}
+		return text;
+	}
+
+	void Parse(istream& input, Handler& handler) {
+		Parse(string_view(ReadAll(input)), handler);
+	}
+
+	void Traverse(const Node& node, Handler& handler) {
+		if (holds_alternative<Array>(node)) {
+			handler.StartArray();
+			for (const Node& item : node.AsArray()) Traverse(item, handler);
+			handler.EndArray();
+		}
+		else if (holds_alternative<Dict>(node)) {
+			handler.StartObject();
+			for (const auto& [key, value] : node.AsMap()) {
+				handler.Key(key);
+				Traverse(value, handler);
+			}
+			handler.EndObject();
+		}
+		else if (holds_alternative<String>(node)) handler.String(node.AsString());
+		else if (holds_alternative<double>(node)) handler.Number(node.AsDouble());
+		else handler.Bool(node.AsBool());
+	}
+
+	//TREE BUILDING FUNCTIONS
+
+	// Values of the open containers wait on a scratch stack, a container takes
+	// them when it closes. So an array is allocated once with its final size,
+	// and nothing is left behind in an arena by reallocation.
+	class TreeBuilder : public Handler {
+	public:
+		explicit TreeBuilder(Allocation allocation) {
+			if (allocation == Allocation::ARENA) {
+				arena_ = make_unique<pmr::monotonic_buffer_resource>(INITIAL_ARENA_BLOCK);
+				resource_ = arena_.get();
+			}
+		}
+
+		void StartArray() override {
+			frames_.push_back({ items_.size(), keys_.size() });
+		}
+		void EndArray() override {
+			const Frame frame = frames_.back();
+			frames_.pop_back();
+			Array array(resource_);
+			array.reserve(items_.size() - frame.first_item);
+			move(items_.begin() + frame.first_item, items_.end(), back_inserter(array));
+			items_.resize(frame.first_item);
+			Add(move(array));
+		}
+		void StartObject() override {
+			frames_.push_back({ items_.size(), keys_.size() });
+		}
+		void Key(string_view key) override {
+			keys_.emplace_back(key);
+		}
+		void EndObject() override {
+			const Frame frame = frames_.back();
+			frames_.pop_back();
+			pmr::vector<Dict::value_type> dict_items(resource_);
+			dict_items.reserve(items_.size() - frame.first_item);
+			for (size_t i = frame.first_item; i < items_.size(); ++i) {
+				dict_items.emplace_back(string_view(keys_[frame.first_key + i - frame.first_item]), move(items_[i]));
+			}
+			items_.resize(frame.first_item);
+			keys_.resize(frame.first_key);
+			Add(Dict(move(dict_items)));
+		}
+		void String(string_view value) override {
+			Add(Json::String(value, resource_));
+		}
+		void Number(double value) override {
+			Add(value);
+		}
+		void Bool(bool value) override {
+			Add(value);
+		}
+
+		Document Result() && {
+			if (!arena_) {
+				return Document(move(items_.back()));
+			}
+			// the root is placed in the arena too, so the document never destroys it
+			void* place = arena_->allocate(sizeof(Node), alignof(Node));
+			Node* root = new (place) Node(move(items_.back()));
+			return Document(move(arena_), root);
+		}
+
+	private:
+		// The first arena block, later ones grow geometrically
+		static const size_t INITIAL_ARENA_BLOCK = 1 << 16;
+
+		struct Frame {
+			size_t first_item;
+			size_t first_key;
+		};
+
+		// Values of closed containers and scalars wait for their container; the root stays last
+		template <typename Value>
+		void Add(Value&& value) {
+			items_.emplace_back(forward<Value>(value));
+		}
+
+		unique_ptr<pmr::monotonic_buffer_resource> arena_;
+		pmr::memory_resource* resource_ = pmr::get_default_resource();
+		vector<Frame> frames_;
+		vector<Node> items_;
+		vector<string> keys_;
+	};
+
+	Document Load(string_view text, Allocation allocation) {
+		TreeBuilder builder(allocation);
+		Parse(text, builder);
+		return move(builder).Result();
+	}
+
+	Document Load(istream& input, Allocation allocation) {
+		return Load(string_view(ReadAll(input)), allocation);
+	}
+
 	//UPLOADING FUNCTIONS
 
-	void UploadNode(const Node& node, ostream& out);
+	void OutputBuffer::Flush() {
+		if (!out_) return;
+		out_->write(buffer_.data(), buffer_.size());
+		buffer_.clear();
+	}
+
+	void UploadNode(const Node& node, OutputBuffer& out);
 
-	void UploadArray(const Node& node, ostream& out) {
-		const vector<Node> nodes = node.AsArray();
-		out << "[";
+	void UploadArray(const Node& node, OutputBuffer& out) {
+		const Array& nodes = node.AsArray();
+		out.Write('[');
 		for (size_t i = 0; i < nodes.size(); ++i) {
-			out << endl;
+			out.Write('\n');
 			UploadNode(nodes[i], out);
-			if (i < nodes.size() - 1) out << ",";
-			else out << endl;
+			if (i < nodes.size() - 1) out.Write(',');
+			else out.Write('\n');
 		}
-		out << "]";
+		out.Write(']');
 	}
-	void UploadDict(const Node& node, ostream& out) {
-		map<string, Node> nodes = node.AsMap();
-		out << "{";
+	void UploadDict(const Node& node, OutputBuffer& out) {
+		const Dict& nodes = node.AsMap();
+		out.Write('{');
 		for (auto it = nodes.begin(); it != nodes.end(); ++it) {
-			out << endl << '"' << it->first << "\": ";
+			out.Write("\n\"");
+			out.Write(it->first);
+			out.Write("\": ");
 			UploadNode(it->second, out);
-			if (it != prev(nodes.end())) out << ",";
-			else out << endl;
+			if (next(it) != nodes.end()) out.Write(',');
+			else out.Write('\n');
 		}
-		out << "}";
+		out.Write('}');
 	}
-	void UploadString(const Node& node, ostream& out) {
-		out << "\"" << node.AsString() << "\"";
+	void UploadString(const Node& node, OutputBuffer& out) {
+		out.Write('"');
+		out.Write(node.AsString());
+		out.Write('"');
 	}
-	void UploadDouble(const Node& node, ostream& out) {
-		stringstream buf;
-		buf << fixed << node.AsDouble();
-		string result = buf.str();
-		while (result.back() == '0') result.resize(result.size() - 1);
-		if (result.back() == '.') result.resize(result.size() - 1);
-		out << result;
+	void UploadBool(const Node& node, OutputBuffer& out) {
+		out.Write(node.AsBool() ? "true" : "false");
+	}
+	// Same digits as ostream << fixed: six decimals, trailing zeros cut off
+	void UploadDouble(double value, OutputBuffer& out) {
+		char buf[400];
+		const auto [end, error] = to_chars(buf, buf + sizeof(buf), value, chars_format::fixed, 6);
+		string_view result(buf, end - buf);
+		while (result.back() == '0') result.remove_suffix(1);
+		if (result.back() == '.') result.remove_suffix(1);
+		out.Write(result);
 	}
 
-	void UploadNode(const Node& node, ostream& out) {
-		if (holds_alternative<vector<Node>>(node)) UploadArray(node, out);
-		else if (holds_alternative<map<string, Node>>(node)) UploadDict(node, out);
-		else if (holds_alternative<string>(node)) UploadString(node, out);
-		else if (holds_alternative<double>(node)) UploadDouble(node, out);
+	void UploadNode(const Node& node, OutputBuffer& out) {
+		if (holds_alternative<Array>(node)) UploadArray(node, out);
+		else if (holds_alternative<Dict>(node)) UploadDict(node, out);
+		else if (holds_alternative<String>(node)) UploadString(node, out);
+		else if (holds_alternative<double>(node)) UploadDouble(node.AsDouble(), out);
+		else if (holds_alternative<bool>(node)) UploadBool(node, out);
 	}
 
 	void UploadDocument(const Document& doc, ostream& out) {
-		UploadNode(doc.GetRoot(), out);
+		OutputBuffer buffer(out);
+		UploadNode(doc.GetRoot(), buffer);
+		buffer.Flush();
+	}
+
+	// Same characters as UploadNode: every item or key starts on a new line,
+	// the comma of an item is written with the next one
+	void Writer::StartArray() {
+		BeforeValue();
+		out_.Write('[');
+		open_.push_back({ false, 0 });
+	}
+	void Writer::EndArray() {
+		Close(']');
+	}
+	void Writer::StartObject() {
+		BeforeValue();
+		out_.Write('{');
+		open_.push_back({ true, 0 });
+	}
+	void Writer::Key(string_view key) {
+		if (open_.back().count++ > 0) out_.Write(',');
+		out_.Write("\n\"");
+		out_.Write(key);
+		out_.Write("\": ");
+	}
+	void Writer::EndObject() {
+		Close('}');
+	}
+	void Writer::String(string_view value) {
+		BeforeValue();
+		out_.Write('"');
+		out_.Write(value);
+		out_.Write('"');
+	}
+	void Writer::Number(double value) {
+		BeforeValue();
+		UploadDouble(value, out_);
+	}
+	void Writer::Bool(bool value) {
+		BeforeValue();
+		out_.Write(value ? "true" : "false");
+	}
+	void Writer::Value(const Node& node) {
+		BeforeValue();
+		UploadNode(node, out_);
+	}
+	void Writer::Raw(string_view json) {
+		BeforeValue();
+		out_.Write(json);
+	}
+
+	// The key of an object value has been written already
+	void Writer::BeforeValue() {
+		if (open_.empty() || open_.back().is_object) return;
+		if (open_.back().count++ > 0) out_.Write(',');
+		out_.Write('\n');
+	}
+	void Writer::Close(char bracket) {
+		if (open_.back().count > 0) out_.Write('\n');
+		out_.Write(bracket);
+		open_.pop_back();
+	}
+
+	ArrayWriter::ArrayWriter(ostream& out) : buffer_(out), writer_(buffer_) {
+		writer_.StartArray();
+	}
+
+	ArrayWriter::~ArrayWriter() {
+		buffer_.Flush();
+	}
+
+	void ArrayWriter::Write(const Node& node) {
+		writer_.Value(node);
+	}
+
+	Writer& ArrayWriter::Items() {
+		return writer_;
+	}
+
+	void ArrayWriter::Finish() {
+		if (finished_) return;
+		writer_.EndArray();
+		buffer_.Flush();
+		finished_ = true;
 	}
 
 }
@@ -2,29 +2,89 @@
 
 #include <iostream>
 #include <iomanip>
+#include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 namespace Json {
   class Node;
 
-  class Node : public std::variant<std::vector<Node>,
-                            std::map<std::string, Node>,
+  // Containers of a node take their memory from a memory resource: the default
+  // one unless the node was built in the arena of a loaded document.
+  using Array = std::pmr::vector<Node>;
+  using String = std::pmr::string;
+
+  // An object: its keys and values side by side in one vector sorted by key,
+  // iterated as pairs like a map. Objects mostly have a handful of keys, a key
+  // among them is found by a linear scan, among more of them by binary search.
+  class Dict {
+  public:
+    using value_type = std::pair<String, Node>;
+    using const_iterator = std::pmr::vector<value_type>::const_iterator;
+
+    Dict() = default;
+    explicit Dict(std::pmr::memory_resource* resource);
+    // Items come in any order; of repeated keys the first one stays
+    explicit Dict(std::pmr::vector<value_type> items);
+    Dict(std::initializer_list<value_type> items);
+
+    const_iterator begin() const {
+      return items_.begin();
+    }
+    const_iterator end() const {
+      return items_.end();
+    }
+    size_t size() const {
+      return items_.size();
+    }
+    bool empty() const {
+      return items_.empty();
+    }
+
+    const_iterator find(std::string_view key) const;
+    size_t count(std::string_view key) const;
+    // Throws std::out_of_range for a missing key
+    const Node& at(std::string_view key) const;
+    Node& operator[](std::string_view key);
+    std::pair<const_iterator, bool> emplace(std::string_view key, Node value);
+
+    friend bool operator==(const Dict& lhs, const Dict& rhs);
+    friend bool operator!=(const Dict& lhs, const Dict& rhs);
+
+  private:
+    static const size_t LINEAR_LOOKUP_MAX_SIZE = 8;
+
+    size_t LowerBound(std::string_view key) const;
+
+    std::pmr::vector<value_type> items_;
+  };
+
+  class Node : public std::variant<Array,
+                            Dict,
                             double,
                             bool,
-                            std::string>
+                            String>
   {
   public:
     using variant::variant;
+    // Nodes built from standard containers take the default resource
+    Node(const std::string& value) : variant(String(value)) {}
+    Node(const char* value) : variant(String(value)) {}
+    Node(std::vector<Node> items);
+    Node(std::map<std::string, Node> items);
 
     const auto& AsArray() const {
-      return std::get<std::vector<Node>>(*this);
+      return std::get<Array>(*this);
     }
     const auto& AsMap() const {
-      return std::get<std::map<std::string, Node>>(*this);
+      return std::get<Dict>(*this);
     }
     double AsDouble() const {
       return std::get<double>(*this);
@@ -33,7 +93,7 @@ namespace Json {
       return std::get<bool>(*this);
     }
     const auto& AsString() const {
-      return std::get<std::string>(*this);
+      return std::get<String>(*this);
     }
   };
 
@@ -44,11 +104,151 @@ namespace Json {
     const Node& GetRoot() const;
 
   private:
-    Node root;
+    friend class TreeBuilder;
+
+    // Skips the destructor of a root built in the arena: all its memory goes
+    // with the arena, so the tree is never walked
+    struct RootDeleter {
+      bool in_arena = false;
+      void operator()(Node* node) const;
+    };
+
+    Document(std::unique_ptr<std::pmr::monotonic_buffer_resource> arena, Node* root);
+
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_;
+    std::unique_ptr<Node, RootDeleter> root_;
+  };
+
+  class ParsingError : public std::runtime_error {
+  public:
+    using runtime_error::runtime_error;
   };
 
-  Document Load(std::istream& input);
+  // Events of a parse, in document order. String views are valid only
+  // during the call: they point into the parsed text or a scratch buffer.
+  class Handler {
+  public:
+    virtual ~Handler() = default;
+
+    virtual void StartArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void StartObject() = 0;
+    virtual void Key(std::string_view key) = 0;
+    virtual void EndObject() = 0;
+    virtual void String(std::string_view value) = 0;
+    virtual void Number(double value) = 0;
+    virtual void Bool(bool value) = 0;
+  };
+
+  // Parses a fully buffered document without building nodes: no per-character
+  // stream calls, numbers are read with from_chars. Throws ParsingError on malformed input.
+  void Parse(std::string_view text, Handler& handler);
+  // Buffers the whole stream and parses it as above.
+  void Parse(std::istream& input, Handler& handler);
+  // Reports an already built tree as parsing events.
+  void Traverse(const Node& node, Handler& handler);
+
+  // Where a loaded tree lives: every array, object, key and string in a heap
+  // allocation of its own, or all of them in a few big blocks of an arena that
+  // the document owns and frees at once
+  enum class Allocation {
+    HEAP,
+    ARENA
+  };
+
+  // Builds the tree with Parse.
+  Document Load(std::string_view text, Allocation allocation = Allocation::ARENA);
+  Document Load(std::istream& input, Allocation allocation = Allocation::ARENA);
+  // The original character-by-character stream parser, kept as a reference.
+  Document LoadStream(std::istream& input);
 
   void UploadDocument(const Document& doc, std::ostream& out);
 
+  // Output is gathered in a buffer and written to the stream in big chunks.
+  // Without a stream it is kept until taken with Text and Clear.
+  class OutputBuffer {
+  public:
+    OutputBuffer() = default;
+    explicit OutputBuffer(std::ostream& out) : out_(&out) {
+      buffer_.reserve(CHUNK_SIZE + CHUNK_SIZE / 4);
+    }
+
+    void Write(std::string_view text) {
+      buffer_.append(text);
+      if (out_ && buffer_.size() >= CHUNK_SIZE) Flush();
+    }
+    void Write(char c) {
+      buffer_.push_back(c);
+    }
+    void Flush();
+    std::string_view Text() const {
+      return buffer_;
+    }
+    void Clear() {
+      buffer_.clear();
+    }
+
+  private:
+    static const size_t CHUNK_SIZE = 1 << 16;
+
+    std::ostream* out_ = nullptr;
+    std::string buffer_;
+  };
+
+  // Writes values event by event in the layout of UploadDocument, so a value
+  // doesn't have to be built as nodes first. Keys go out in the order they are
+  // given, an uploaded object has them sorted. Values at the top level follow
+  // one another with nothing in between.
+  class Writer : public Handler {
+  public:
+    explicit Writer(OutputBuffer& out) : out_(out) {}
+
+    void StartArray() override;
+    void EndArray() override;
+    void StartObject() override;
+    void Key(std::string_view key) override;
+    void EndObject() override;
+    void String(std::string_view value) override;
+    void Number(double value) override;
+    void Bool(bool value) override;
+    // A whole node as the next value
+    void Value(const Node& node);
+    // The next value, already written in this layout
+    void Raw(std::string_view json);
+
+  private:
+    struct Container {
+      bool is_object;
+      size_t count; // items or keys so far
+    };
+
+    void BeforeValue();
+    void Close(char bracket);
+
+    OutputBuffer& out_;
+    std::vector<Container> open_;
+  };
+
+  // Writes an array item by item in the layout of UploadDocument, so the items
+  // never have to be gathered in one tree. Output goes to the stream in chunks
+  // of a bounded size. Finish writes the closing bracket; a writer destroyed
+  // before that only flushes the items written so far.
+  class ArrayWriter {
+  public:
+    explicit ArrayWriter(std::ostream& out);
+    ArrayWriter(const ArrayWriter&) = delete;
+    ArrayWriter& operator=(const ArrayWriter&) = delete;
+    ~ArrayWriter();
+
+    void Write(const Node& node);
+    // Takes the next items event by event, each of them a whole value
+    Writer& Items();
+    void Finish();
+
+  private:
+    OutputBuffer buffer_;
+    Writer writer_;
+    bool finished_ = false;
+  };
+
 }
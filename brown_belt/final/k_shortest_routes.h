@@ -0,0 +1,287 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Up to count loopless routes in order of weight by Yen's algorithm. The best
+  // route comes from a router. Every next one is the lightest of the candidates,
+  // found by spur searches from each vertex of the last route: its beginning up
+  // to the vertex is kept, vertices of the beginning are banned and so are the
+  // edges by which routes with the same beginning leave the vertex.
+  // A query runs one Dijkstra from the target on the reversed graph; its exact
+  // weights to the target make spur searches A* that go straight to the target
+  // unless a ban is in the way. All searches of a query share one pooled state.
+  template <typename Weight, typename Index = size_t>
+  class KShortestRoutes {
+  private:
+    using Graph = DirectedWeightedGraph<Weight, Index>;
+
+  public:
+    using Route = typename RouterBase<Weight, Index>::Route;
+
+    explicit KShortestRoutes(const Graph& graph);
+
+    std::vector<Route> FindRoutes(const RouterBase<Weight, Index>& router, VertexId from, VertexId to, size_t count) const;
+
+  private:
+    struct QueueItem {
+      Weight priority;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return priority > other.priority;
+      }
+    };
+    using Queue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+
+    static constexpr Index NO_EDGE = std::numeric_limits<Index>::max();
+
+    // Values are valid only where their stamp is the current one, so nothing is
+    // cleared between queries and searches
+    struct SearchState {
+      // weights to the target of the current query
+      std::vector<Weight> to_target;
+      std::vector<uint32_t> target_stamps;
+      uint32_t query_stamp = 0;
+
+      // the current spur search
+      std::vector<Weight> weights;
+      std::vector<Index> prev_edges;
+      std::vector<uint32_t> stamps;
+      std::vector<uint32_t> banned_vertices;
+      std::vector<uint32_t> banned_edges;
+      uint32_t current_stamp = 0;
+
+      explicit SearchState(size_t vertex_count);
+      void NewQuery();
+      void NewSearch(size_t edge_count);
+      bool ReachesTarget(VertexId vertex) const;
+      bool Reached(VertexId vertex) const;
+      void Reach(VertexId vertex, Weight weight, Index prev_edge);
+    };
+
+    void SearchTarget(SearchState& state, VertexId to) const;
+    std::optional<Route> FindSpur(SearchState& state, VertexId from, VertexId to) const;
+
+    const Graph& graph_;
+    const CompactGraph<Weight, Index> reversed_;
+    SearchStatePool<SearchState> states_;
+  };
+
+
+  namespace Detail {
+    template <typename Weight, typename Index>
+    CompactGraph<Weight, Index> Reversed(const DirectedWeightedGraph<Weight, Index>& graph) {
+      std::vector<Edge<Weight, Index>> edges;
+      std::vector<Index> ids;
+      edges.reserve(graph.GetEdgeCount());
+      ids.reserve(graph.GetEdgeCount());
+      for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+        const auto& edge = graph.GetEdge(edge_id);
+        edges.push_back({edge.to, edge.from, edge.weight});
+        ids.push_back(edge_id);
+      }
+      return CompactGraph<Weight, Index>(graph.GetVertexCount(), edges, ids);
+    }
+  }
+
+  template <typename Weight, typename Index>
+  KShortestRoutes<Weight, Index>::KShortestRoutes(const Graph& graph)
+      : graph_(graph),
+        reversed_(Detail::Reversed(graph)),
+        states_(graph.GetVertexCount())
+  {
+  }
+
+  template <typename Weight, typename Index>
+  KShortestRoutes<Weight, Index>::SearchState::SearchState(size_t vertex_count)
+      : to_target(vertex_count),
+        target_stamps(vertex_count, 0),
+        weights(vertex_count),
+        prev_edges(vertex_count),
+        stamps(vertex_count, 0),
+        banned_vertices(vertex_count, 0)
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void KShortestRoutes<Weight, Index>::SearchState::NewQuery() {
+    if (++query_stamp == 0) {
+      std::fill(std::begin(target_stamps), std::end(target_stamps), 0);
+      query_stamp = 1;
+    }
+  }
+
+  template <typename Weight, typename Index>
+  void KShortestRoutes<Weight, Index>::SearchState::NewSearch(size_t edge_count) {
+    banned_edges.resize(edge_count, 0);
+    if (++current_stamp == 0) {
+      std::fill(std::begin(stamps), std::end(stamps), 0);
+      std::fill(std::begin(banned_vertices), std::end(banned_vertices), 0);
+      std::fill(std::begin(banned_edges), std::end(banned_edges), 0);
+      current_stamp = 1;
+    }
+  }
+
+  template <typename Weight, typename Index>
+  bool KShortestRoutes<Weight, Index>::SearchState::ReachesTarget(VertexId vertex) const {
+    return target_stamps[vertex] == query_stamp;
+  }
+
+  template <typename Weight, typename Index>
+  bool KShortestRoutes<Weight, Index>::SearchState::Reached(VertexId vertex) const {
+    return stamps[vertex] == current_stamp;
+  }
+
+  template <typename Weight, typename Index>
+  void KShortestRoutes<Weight, Index>::SearchState::Reach(VertexId vertex, Weight weight, Index prev_edge) {
+    stamps[vertex] = current_stamp;
+    weights[vertex] = weight;
+    prev_edges[vertex] = prev_edge;
+  }
+
+  template <typename Weight, typename Index>
+  std::vector<typename KShortestRoutes<Weight, Index>::Route>
+  KShortestRoutes<Weight, Index>::FindRoutes(const RouterBase<Weight, Index>& router, VertexId from, VertexId to, size_t count) const {
+    std::vector<Route> routes;
+    if (count == 0) {
+      return routes;
+    }
+    auto best = router.FindRoute(from, to);
+    if (!best) {
+      return routes;
+    }
+    routes.push_back(std::move(*best));
+    if (count == 1) {
+      return routes;
+    }
+
+    const auto state = states_.Acquire();
+    state->NewQuery();
+    SearchTarget(*state, to);
+
+    // ordered by weight, then by edges to break ties the same way every time;
+    // a route is told apart by its edges alone, as its weight summed from
+    // another spur vertex may round differently
+    std::set<std::pair<Weight, std::vector<EdgeId>>> candidates;
+    std::set<std::vector<EdgeId>> seen{routes.front().edges};
+    while (routes.size() < count) {
+      const std::vector<EdgeId> last = routes.back().edges;
+      VertexId spur_vertex = from;
+      Weight root_weight = 0;
+      for (size_t i = 0; i < last.size(); ++i) {
+        state->NewSearch(graph_.GetEdgeCount());
+        for (const Route& route : routes) {
+          if (route.edges.size() > i && std::equal(std::begin(last), std::begin(last) + i, std::begin(route.edges))) {
+            state->banned_edges[route.edges[i]] = state->current_stamp;
+          }
+        }
+        state->banned_vertices[from] = state->current_stamp;
+        for (size_t j = 0; j + 1 < i; ++j) {
+          state->banned_vertices[graph_.GetEdge(last[j]).to] = state->current_stamp;
+        }
+        state->banned_vertices[spur_vertex] = 0;
+
+        if (auto spur = FindSpur(*state, spur_vertex, to)) {
+          std::vector<EdgeId> edges(std::begin(last), std::begin(last) + i);
+          edges.insert(std::end(edges), std::begin(spur->edges), std::end(spur->edges));
+          if (seen.insert(edges).second) {
+            candidates.emplace(root_weight + spur->weight, std::move(edges));
+          }
+        }
+        const auto& edge = graph_.GetEdge(last[i]);
+        root_weight += edge.weight;
+        spur_vertex = edge.to;
+      }
+      if (candidates.empty()) {
+        break;
+      }
+      auto candidate = candidates.extract(std::begin(candidates));
+      routes.push_back(Route{candidate.value().first, std::move(candidate.value().second)});
+    }
+    return routes;
+  }
+
+  template <typename Weight, typename Index>
+  void KShortestRoutes<Weight, Index>::SearchTarget(SearchState& state, VertexId to) const {
+    Queue queue;
+    state.to_target[to] = 0;
+    state.target_stamps[to] = state.query_stamp;
+    queue.push({0, to});
+    while (!queue.empty()) {
+      const auto [weight, vertex] = queue.top();
+      queue.pop();
+      if (weight > state.to_target[vertex]) {
+        continue;  // outdated queue item
+      }
+      for (size_t edge = reversed_.EdgesBegin(vertex); edge < reversed_.EdgesEnd(vertex); ++edge) {
+        const VertexId source = reversed_.GetTarget(edge);
+        const Weight candidate_weight = weight + reversed_.GetWeight(edge);
+        if (!state.ReachesTarget(source) || candidate_weight < state.to_target[source]) {
+          state.to_target[source] = candidate_weight;
+          state.target_stamps[source] = state.query_stamp;
+          queue.push({candidate_weight, source});
+        }
+      }
+    }
+  }
+
+  template <typename Weight, typename Index>
+  std::optional<typename KShortestRoutes<Weight, Index>::Route>
+  KShortestRoutes<Weight, Index>::FindSpur(SearchState& state, VertexId from, VertexId to) const {
+    Queue queue;
+    state.Reach(from, 0, NO_EDGE);
+    queue.push({state.to_target[from], from});
+
+    while (!queue.empty()) {
+      const auto [priority, vertex] = queue.top();
+      queue.pop();
+      if (vertex == to) {
+        break;
+      }
+      const Weight weight = state.weights[vertex];
+      if (priority > weight + state.to_target[vertex]) {
+        continue;  // outdated queue item
+      }
+      for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+        const auto& edge = graph_.GetEdge(edge_id);
+        // bans never make the target closer, so a vertex that can't reach it now never will
+        if (state.banned_edges[edge_id] == state.current_stamp || state.banned_vertices[edge.to] == state.current_stamp
+            || !state.ReachesTarget(edge.to)) {
+          continue;
+        }
+        assert(edge.weight >= 0);
+        const Weight candidate_weight = weight + edge.weight;
+        if (!state.Reached(edge.to) || candidate_weight < state.weights[edge.to]) {
+          state.Reach(edge.to, candidate_weight, edge_id);
+          queue.push({candidate_weight + state.to_target[edge.to], edge.to});
+        }
+      }
+    }
+
+    if (!state.Reached(to)) {
+      return std::nullopt;
+    }
+    std::vector<EdgeId> edges;
+    for (Index edge_id = state.prev_edges[to]; edge_id != NO_EDGE; edge_id = state.prev_edges[graph_.GetEdge(edge_id).from]) {
+      edges.push_back(edge_id);
+    }
+    std::reverse(std::begin(edges), std::end(edges));
+    return Route{state.weights[to], std::move(edges)};
+  }
+
+}
@@ -0,0 +1,207 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using namespace std;
+
+struct CacheStats {
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t evictions = 0;
+	size_t entries = 0;
+	size_t bytes = 0;
+	size_t capacity = 0; // bytes
+};
+
+// Keeps the most recently used values while their total size fits the capacity
+// in bytes. Sizer tells how many bytes a value owns, the bookkeeping of an entry
+// is added to it. Every method locks, so concurrent queries may share a cache.
+// Zero capacity turns the cache off.
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class LruCache {
+public:
+	using Sizer = function<size_t(const Value&)>;
+
+	LruCache(size_t capacity, Sizer sizer) : capacity_(capacity), sizer_(move(sizer)) {}
+
+	optional<Value> Get(const Key& key);
+	void Put(const Key& key, Value value);
+	void Clear();
+	void SetCapacity(size_t capacity);
+	CacheStats Stats() const;
+
+private:
+	struct Entry {
+		Key key;
+		Value value;
+		size_t bytes;
+	};
+	using Entries = list<Entry>;
+
+	// a list node, a hash table node and its bucket
+	static constexpr size_t ENTRY_OVERHEAD = sizeof(Entry) + 2 * sizeof(void*)
+		+ sizeof(pair<const Key, typename Entries::iterator>) + 2 * sizeof(void*);
+
+	void Evict();
+
+	mutable mutex mutex_;
+	size_t capacity_;
+	Sizer sizer_;
+	Entries entries_; // most recently used first
+	unordered_map<Key, typename Entries::iterator, Hash> index_;
+	size_t bytes_ = 0;
+	size_t hits_ = 0;
+	size_t misses_ = 0;
+	size_t evictions_ = 0;
+};
+
+// LruCache split by key hash into shards with a lock and an equal part of the
+// capacity each, so concurrent queries for different keys seldom wait on one
+// another. Recency is kept per shard: the entry evicted is the least recently
+// used one of its shard.
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class ShardedLruCache {
+public:
+	using Shard = LruCache<Key, Value, Hash>;
+	using Sizer = typename Shard::Sizer;
+
+	static const size_t DEFAULT_SHARD_COUNT = 16;
+
+	ShardedLruCache(size_t capacity, Sizer sizer, size_t shard_count = DEFAULT_SHARD_COUNT);
+
+	optional<Value> Get(const Key& key) {
+		return ShardOf(key).Get(key);
+	}
+	void Put(const Key& key, Value value) {
+		ShardOf(key).Put(key, move(value));
+	}
+	void Clear();
+	void SetCapacity(size_t capacity);
+	// Sums over the shards
+	CacheStats Stats() const;
+
+private:
+	Shard& ShardOf(const Key& key) const;
+	static size_t ShardCapacity(size_t capacity, size_t shard, size_t shard_count);
+
+	Hash hash_;
+	vector<unique_ptr<Shard>> shards_;
+};
+
+
+template <typename Key, typename Value, typename Hash>
+optional<Value> LruCache<Key, Value, Hash>::Get(const Key& key) {
+	lock_guard<mutex> guard(mutex_);
+	const auto it = index_.find(key);
+	if (it == index_.end()) {
+		++misses_;
+		return nullopt;
+	}
+	++hits_;
+	entries_.splice(entries_.begin(), entries_, it->second);
+	return it->second->value;
+}
+
+template <typename Key, typename Value, typename Hash>
+void LruCache<Key, Value, Hash>::Put(const Key& key, Value value) {
+	const size_t bytes = ENTRY_OVERHEAD + sizer_(value);
+	lock_guard<mutex> guard(mutex_);
+	if (bytes > capacity_) return;
+	if (const auto it = index_.find(key); it != index_.end()) {
+		// another thread has computed the same value meanwhile
+		entries_.splice(entries_.begin(), entries_, it->second);
+		return;
+	}
+	entries_.push_front({ key, move(value), bytes });
+	index_[key] = entries_.begin();
+	bytes_ += bytes;
+	Evict();
+}
+
+template <typename Key, typename Value, typename Hash>
+void LruCache<Key, Value, Hash>::Clear() {
+	lock_guard<mutex> guard(mutex_);
+	entries_.clear();
+	index_.clear();
+	bytes_ = 0;
+}
+
+template <typename Key, typename Value, typename Hash>
+void LruCache<Key, Value, Hash>::SetCapacity(size_t capacity) {
+	lock_guard<mutex> guard(mutex_);
+	capacity_ = capacity;
+	Evict();
+}
+
+template <typename Key, typename Value, typename Hash>
+CacheStats LruCache<Key, Value, Hash>::Stats() const {
+	lock_guard<mutex> guard(mutex_);
+	return { hits_, misses_, evictions_, entries_.size(), bytes_, capacity_ };
+}
+
+template <typename Key, typename Value, typename Hash>
+void LruCache<Key, Value, Hash>::Evict() {
+	while (bytes_ > capacity_) {
+		const Entry& last = entries_.back();
+		bytes_ -= last.bytes;
+		index_.erase(last.key);
+		entries_.pop_back();
+		++evictions_;
+	}
+}
+
+
+template <typename Key, typename Value, typename Hash>
+ShardedLruCache<Key, Value, Hash>::ShardedLruCache(size_t capacity, Sizer sizer, size_t shard_count) {
+	for (size_t shard = 0; shard < shard_count; ++shard) {
+		shards_.push_back(make_unique<Shard>(ShardCapacity(capacity, shard, shard_count), sizer));
+	}
+}
+
+template <typename Key, typename Value, typename Hash>
+void ShardedLruCache<Key, Value, Hash>::Clear() {
+	for (auto& shard : shards_) {
+		shard->Clear();
+	}
+}
+
+template <typename Key, typename Value, typename Hash>
+void ShardedLruCache<Key, Value, Hash>::SetCapacity(size_t capacity) {
+	for (size_t shard = 0; shard < shards_.size(); ++shard) {
+		shards_[shard]->SetCapacity(ShardCapacity(capacity, shard, shards_.size()));
+	}
+}
+
+template <typename Key, typename Value, typename Hash>
+CacheStats ShardedLruCache<Key, Value, Hash>::Stats() const {
+	CacheStats total;
+	for (const auto& shard : shards_) {
+		const CacheStats stats = shard->Stats();
+		total.hits += stats.hits;
+		total.misses += stats.misses;
+		total.evictions += stats.evictions;
+		total.entries += stats.entries;
+		total.bytes += stats.bytes;
+		total.capacity += stats.capacity;
+	}
+	return total;
+}
+
+template <typename Key, typename Value, typename Hash>
+typename ShardedLruCache<Key, Value, Hash>::Shard& ShardedLruCache<Key, Value, Hash>::ShardOf(const Key& key) const {
+	// the hash is mixed, otherwise keys of a shard would crowd some buckets of its table
+	const uint64_t mixed = static_cast<uint64_t>(hash_(key)) * 0x9E3779B97F4A7C15ull;
+	return *shards_[(mixed >> 32) % shards_.size()];
+}
+
+template <typename Key, typename Value, typename Hash>
+size_t ShardedLruCache<Key, Value, Hash>::ShardCapacity(size_t capacity, size_t shard, size_t shard_count) {
+	return capacity / shard_count + (shard < capacity % shard_count ? 1 : 0);
+}
@@ -0,0 +1,149 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+
+namespace {
+	const char* PHASE_NAMES[] = {
+		"parse", "base_apply", "finalize", "graph_build", "router_preprocessing",
+		"stop_query", "bus_query", "route_query", "routes_query", "matrix_query",
+		"nearest_stops_query", "stops_in_radius_query", "output", "base_save", "base_load"
+	};
+	static_assert(size(PHASE_NAMES) == static_cast<size_t>(Phase::COUNT));
+
+	const char* COUNTER_NAMES[] = {
+		"not_found", "graph_rebuilds", "graph_extensions", "router_rebuilds",
+		"route_cache_hits", "route_cache_misses", "route_cache_evictions", "route_cache_bytes"
+	};
+	static_assert(size(COUNTER_NAMES) == static_cast<size_t>(Counter::COUNT));
+}
+
+/* LATENCY_HISTOGRAM---LATENCY_HISTOGRAM---LATENCY_HISTOGRAM---LATENCY_HISTOGRAM---LATENCY_HISTOGRAM */
+
+
+void LatencyHistogram::Record(uint64_t nanoseconds) {
+	buckets_[BucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+	count_.fetch_add(1, memory_order_relaxed);
+	total_.fetch_add(nanoseconds, memory_order_relaxed);
+	uint64_t max = max_.load(memory_order_relaxed);
+	while (nanoseconds > max && !max_.compare_exchange_weak(max, nanoseconds, memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::Reset() {
+	for (auto& bucket : buckets_) {
+		bucket.store(0, memory_order_relaxed);
+	}
+	count_ = 0;
+	total_ = 0;
+	max_ = 0;
+}
+
+uint64_t LatencyHistogram::Count() const {
+	return count_.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Total() const {
+	return total_.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Max() const {
+	return max_.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Percentile(double quantile) const {
+	const uint64_t count = Count();
+	if (count == 0) return 0;
+	const uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(quantile * count)));
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+		seen += buckets_[bucket].load(memory_order_relaxed);
+		if (seen >= rank) return min(BucketUpperBound(bucket), Max());
+	}
+	return Max();
+}
+
+// The 3 bits after the leading one pick the sub-bucket of its power of two
+size_t LatencyHistogram::BucketOf(uint64_t nanoseconds) {
+	if (nanoseconds < LINEAR) return nanoseconds;
+	size_t exponent = 4;
+	while (nanoseconds >> (exponent + 1)) ++exponent;
+	const size_t sub_bucket = (nanoseconds >> (exponent - 3)) & (SUB_BUCKETS - 1);
+	return LINEAR + (exponent - 4) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(size_t bucket) {
+	if (bucket < LINEAR) return bucket;
+	const size_t exponent = 4 + (bucket - LINEAR) / SUB_BUCKETS;
+	const uint64_t sub_bucket = (bucket - LINEAR) % SUB_BUCKETS;
+	const uint64_t width = uint64_t(1) << (exponent - 3);
+	return (SUB_BUCKETS + sub_bucket) * width + (width - 1);
+}
+
+
+/* METRICS---METRICS---METRICS---METRICS---METRICS---METRICS---METRICS---METRICS---METRICS---METRICS */
+
+
+atomic<bool> Metrics::enabled_ = false;
+
+Metrics& Metrics::Instance() {
+	static Metrics metrics;
+	return metrics;
+}
+
+void Metrics::Record(Phase phase, uint64_t nanoseconds) {
+	phases_[static_cast<size_t>(phase)].Record(nanoseconds);
+}
+
+void Metrics::Add(Counter counter, uint64_t value) {
+	counters_[static_cast<size_t>(counter)].fetch_add(value, memory_order_relaxed);
+}
+
+const LatencyHistogram& Metrics::Histogram(Phase phase) const {
+	return phases_[static_cast<size_t>(phase)];
+}
+
+void Metrics::Set(Counter counter, uint64_t value) {
+	counters_[static_cast<size_t>(counter)].store(value, memory_order_relaxed);
+}
+
+uint64_t Metrics::Value(Counter counter) const {
+	return counters_[static_cast<size_t>(counter)].load(memory_order_relaxed);
+}
+
+void Metrics::Reset() {
+	for (auto& histogram : phases_) {
+		histogram.Reset();
+	}
+	for (auto& counter : counters_) {
+		counter.store(0, memory_order_relaxed);
+	}
+}
+
+Json::Node Metrics::ToJson() const {
+	using Json::Node;
+	map<string, Node> phases;
+	for (size_t phase = 0; phase < phases_.size(); ++phase) {
+		const LatencyHistogram& histogram = phases_[phase];
+		phases[PHASE_NAMES[phase]] = Node(map<string, Node>{
+			{ "count", Node(static_cast<double>(histogram.Count())) },
+			{ "total_ns", Node(static_cast<double>(histogram.Total())) },
+			{ "p50_ns", Node(static_cast<double>(histogram.Percentile(0.5))) },
+			{ "p99_ns", Node(static_cast<double>(histogram.Percentile(0.99))) },
+			{ "max_ns", Node(static_cast<double>(histogram.Max())) },
+		});
+	}
+	map<string, Node> counters;
+	for (size_t counter = 0; counter < counters_.size(); ++counter) {
+		counters[COUNTER_NAMES[counter]] = Node(static_cast<double>(Value(static_cast<Counter>(counter))));
+	}
+	return Node(map<string, Node>{
+		{ "phases", Node(move(phases)) },
+		{ "counters", Node(move(counters)) },
+	});
+}
+
+void Metrics::Dump(ostream& output) const {
+	Json::UploadDocument(Json::Document(ToJson()), output);
+	output << endl;
+}
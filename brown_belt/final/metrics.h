@@ -0,0 +1,142 @@
+#pragma once
+#include "json.h"
+#include "profile.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+using namespace std;
+
+// Phases of the transport pipeline; stat queries are measured by their type
+enum class Phase {
+	PARSE,
+	BASE_APPLY,
+	FINALIZE,
+	GRAPH_BUILD,
+	ROUTER_PREPROCESSING,
+	STOP_QUERY,
+	BUS_QUERY,
+	ROUTE_QUERY,
+	ROUTES_QUERY,
+	MATRIX_QUERY,
+	NEAREST_STOPS_QUERY,
+	STOPS_IN_RADIUS_QUERY,
+	OUTPUT,
+	BASE_SAVE,
+	BASE_LOAD,
+	COUNT
+};
+
+enum class Counter {
+	NOT_FOUND,      // stat answers with an error message
+	GRAPH_REBUILDS,
+	GRAPH_EXTENSIONS,
+	ROUTER_REBUILDS, // the router couldn't take new edges
+	// taken from the route cache when a run of queries ends, not summed up
+	ROUTE_CACHE_HITS,
+	ROUTE_CACHE_MISSES,
+	ROUTE_CACHE_EVICTIONS,
+	ROUTE_CACHE_BYTES,
+	COUNT
+};
+
+// Latencies in nanoseconds in log-linear buckets: exact below 16 ns, then
+// 8 buckets per power of two, so a percentile is off by 12.5% at most.
+// Recording is lock-free and may run concurrently.
+class LatencyHistogram {
+public:
+	void Record(uint64_t nanoseconds);
+	void Reset();
+
+	uint64_t Count() const;
+	uint64_t Total() const;
+	uint64_t Max() const;
+	// Upper bound of the bucket holding the quantile, 0 if empty
+	uint64_t Percentile(double quantile) const;
+
+private:
+	static constexpr size_t LINEAR = 16;
+	static constexpr size_t SUB_BUCKETS = 8;
+	static constexpr size_t BUCKET_COUNT = LINEAR + (64 - 4) * SUB_BUCKETS;
+
+	static size_t BucketOf(uint64_t nanoseconds);
+	static uint64_t BucketUpperBound(size_t bucket);
+
+	array<atomic<uint64_t>, BUCKET_COUNT> buckets_{};
+	atomic<uint64_t> count_ = 0;
+	atomic<uint64_t> total_ = 0;
+	atomic<uint64_t> max_ = 0;
+};
+
+// Process-wide registry of phase latencies and counters. Off by default:
+// then a measurement is one relaxed load and never reads the clock.
+class Metrics {
+public:
+	static Metrics& Instance();
+
+	static bool Enabled() {
+		return enabled_.load(memory_order_relaxed);
+	}
+	static void Enable(bool enabled = true) {
+		enabled_.store(enabled, memory_order_relaxed);
+	}
+
+	void Record(Phase phase, uint64_t nanoseconds);
+	void Add(Counter counter, uint64_t value = 1);
+	void Set(Counter counter, uint64_t value);
+	const LatencyHistogram& Histogram(Phase phase) const;
+	uint64_t Value(Counter counter) const;
+	// Must not run concurrently with recording
+	void Reset();
+
+	// {"phases": {name: {count, total_ns, p50_ns, p99_ns, max_ns}}, "counters": {name: value}}
+	Json::Node ToJson() const;
+	void Dump(ostream& output) const;
+
+private:
+	Metrics() = default;
+
+	static atomic<bool> enabled_;
+	array<LatencyHistogram, static_cast<size_t>(Phase::COUNT)> phases_;
+	array<atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> counters_{};
+};
+
+// Records the lifetime of the scope as a sample of the phase if metrics are enabled
+class PhaseTimer {
+public:
+	explicit PhaseTimer(Phase phase) : phase_(phase) {
+		if (Metrics::Enabled()) {
+			start_ = chrono::steady_clock::now();
+		}
+	}
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+	~PhaseTimer() {
+		if (start_) {
+			const auto elapsed = chrono::steady_clock::now() - *start_;
+			Metrics::Instance().Record(phase_, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+		}
+	}
+
+private:
+	Phase phase_;
+	optional<chrono::steady_clock::time_point> start_;
+};
+
+inline void CountMetric(Counter counter, uint64_t value = 1) {
+	if (Metrics::Enabled()) {
+		Metrics::Instance().Add(counter, value);
+	}
+}
+
+inline void SetMetric(Counter counter, uint64_t value) {
+	if (Metrics::Enabled()) {
+		Metrics::Instance().Set(counter, value);
+	}
+}
+
+#define MEASURE_PHASE(phase) \
+  PhaseTimer UNIQ_ID(__LINE__){phase};
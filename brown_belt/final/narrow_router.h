@@ -0,0 +1,217 @@
+#pragma once
+
+#include "graph.h"
+#include "router_base.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Routes over a copy of the graph with narrower weights and indices, e.g.
+  // float and uint32_t: the inner router's tables shrink with them. A route
+  // keeps the edges the inner router has found and gets its weight summed over
+  // the original graph, so rounding may only swap nearly equal routes.
+  // FindWeights returns the inner weights as they are.
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  class NarrowRouter : public RouterBase<Weight> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+    using NarrowGraph = DirectedWeightedGraph<NarrowWeight, NarrowIndex>;
+    using InnerRouter = RouterBase<NarrowWeight, NarrowIndex>;
+
+  public:
+    using Route = typename RouterBase<Weight>::Route;
+    // Builds the inner router over the narrow graph or reads it back
+    using InnerFactory = std::function<std::unique_ptr<InnerRouter>(const NarrowGraph& graph)>;
+
+    // Throws std::length_error if ids of the graph don't fit in NarrowIndex
+    NarrowRouter(const Graph& graph, const InnerFactory& make_router);
+
+    std::optional<Route> FindRoute(VertexId from, VertexId to) const override;
+    void Serialize(BinaryWriter& output) const override;
+    bool AddEdges(const Graph& graph, EdgeId first_new_edge) override;
+    std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                   const std::vector<VertexId>& targets) const override;
+
+  private:
+    // Routers keep the largest values of their index type for "no edge" marks
+    static constexpr size_t MAX_IDS = std::numeric_limits<NarrowIndex>::max() - 1;
+
+    static bool Fits(const Graph& graph);
+    void AddNarrowEdges(const Graph& graph, EdgeId first_edge);
+
+    const Graph& graph_;
+    NarrowGraph narrow_graph_;
+    std::unique_ptr<InnerRouter> router_;
+  };
+
+
+  class RouteValidationError : public std::runtime_error {
+  public:
+    using runtime_error::runtime_error;
+  };
+
+  // Answers as the router does, checking every answer against a reference
+  // router over the same graph: either both find a route or neither does, and
+  // weights differ by at most epsilon, relative to weights above 1.
+  // Throws RouteValidationError otherwise.
+  template <typename Weight, typename Index = size_t>
+  class ValidatingRouter : public RouterBase<Weight, Index> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight, Index>;
+    using Base = RouterBase<Weight, Index>;
+
+  public:
+    using Route = typename Base::Route;
+
+    ValidatingRouter(std::unique_ptr<Base> router, std::unique_ptr<Base> reference, Weight epsilon);
+
+    std::optional<Route> FindRoute(VertexId from, VertexId to) const override;
+    // The router's data, then the reference's
+    void Serialize(BinaryWriter& output) const override;
+    bool AddEdges(const Graph& graph, EdgeId first_new_edge) override;
+    std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                   const std::vector<VertexId>& targets) const override;
+
+  private:
+    void Check(VertexId from, VertexId to, std::optional<Weight> weight, std::optional<Weight> expected) const;
+
+    std::unique_ptr<Base> router_;
+    std::unique_ptr<Base> reference_;
+    Weight epsilon_;
+  };
+
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  NarrowRouter<Weight, NarrowWeight, NarrowIndex>::NarrowRouter(const Graph& graph, const InnerFactory& make_router)
+      : graph_(graph),
+        narrow_graph_(graph.GetVertexCount())
+  {
+    if (!Fits(graph)) {
+      throw std::length_error("Graph of " + std::to_string(graph.GetEdgeCount()) + " edges doesn't fit in narrow indices");
+    }
+    AddNarrowEdges(graph, 0);
+    router_ = make_router(narrow_graph_);
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  bool NarrowRouter<Weight, NarrowWeight, NarrowIndex>::Fits(const Graph& graph) {
+    return graph.GetVertexCount() <= MAX_IDS && graph.GetEdgeCount() <= MAX_IDS;
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  void NarrowRouter<Weight, NarrowWeight, NarrowIndex>::AddNarrowEdges(const Graph& graph, EdgeId first_edge) {
+    for (EdgeId edge_id = first_edge; edge_id < graph.GetEdgeCount(); ++edge_id) {
+      const auto& edge = graph.GetEdge(edge_id);
+      narrow_graph_.AddEdge({
+          static_cast<NarrowIndex>(edge.from),
+          static_cast<NarrowIndex>(edge.to),
+          static_cast<NarrowWeight>(edge.weight)
+      });
+    }
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  std::optional<typename NarrowRouter<Weight, NarrowWeight, NarrowIndex>::Route>
+  NarrowRouter<Weight, NarrowWeight, NarrowIndex>::FindRoute(VertexId from, VertexId to) const {
+    auto route = router_->FindRoute(from, to);
+    if (!route) {
+      return std::nullopt;
+    }
+    Weight weight = 0;
+    for (const EdgeId edge_id : route->edges) {
+      weight += graph_.GetEdge(edge_id).weight;
+    }
+    return Route{weight, std::move(route->edges)};
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  void NarrowRouter<Weight, NarrowWeight, NarrowIndex>::Serialize(BinaryWriter& output) const {
+    router_->Serialize(output);
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  bool NarrowRouter<Weight, NarrowWeight, NarrowIndex>::AddEdges(const Graph& graph, EdgeId first_new_edge) {
+    if (!Fits(graph)) {
+      return false;
+    }
+    narrow_graph_.AddVertices(graph.GetVertexCount() - narrow_graph_.GetVertexCount());
+    AddNarrowEdges(graph, first_new_edge);
+    return router_->AddEdges(narrow_graph_, first_new_edge);
+  }
+
+  template <typename Weight, typename NarrowWeight, typename NarrowIndex>
+  std::vector<std::optional<Weight>>
+  NarrowRouter<Weight, NarrowWeight, NarrowIndex>::FindWeights(const std::vector<VertexId>& sources,
+                                                               const std::vector<VertexId>& targets) const {
+    std::vector<std::optional<Weight>> weights;
+    weights.reserve(sources.size() * targets.size());
+    for (const auto& weight : router_->FindWeights(sources, targets)) {
+      weights.push_back(weight ? std::optional<Weight>(*weight) : std::nullopt);
+    }
+    return weights;
+  }
+
+  template <typename Weight, typename Index>
+  ValidatingRouter<Weight, Index>::ValidatingRouter(std::unique_ptr<Base> router, std::unique_ptr<Base> reference, Weight epsilon)
+      : router_(std::move(router)),
+        reference_(std::move(reference)),
+        epsilon_(epsilon)
+  {
+  }
+
+  template <typename Weight, typename Index>
+  void ValidatingRouter<Weight, Index>::Check(VertexId from, VertexId to,
+                                              std::optional<Weight> weight, std::optional<Weight> expected) const {
+    if (weight.has_value() != expected.has_value()) {
+      throw RouteValidationError("Route " + std::to_string(from) + " -> " + std::to_string(to)
+                                 + (weight ? " found" : " not found") + " against the reference");
+    }
+    if (weight && std::abs(*weight - *expected) > epsilon_ * std::max(Weight(1), std::abs(*expected))) {
+      throw RouteValidationError("Route " + std::to_string(from) + " -> " + std::to_string(to) + " weighs "
+                                 + std::to_string(*weight) + " against " + std::to_string(*expected) + " of the reference");
+    }
+  }
+
+  template <typename Weight, typename Index>
+  std::optional<typename ValidatingRouter<Weight, Index>::Route> ValidatingRouter<Weight, Index>::FindRoute(VertexId from, VertexId to) const {
+    auto route = router_->FindRoute(from, to);
+    const auto expected = reference_->FindRoute(from, to);
+    Check(from, to, route ? std::optional<Weight>(route->weight) : std::nullopt,
+          expected ? std::optional<Weight>(expected->weight) : std::nullopt);
+    return route;
+  }
+
+  template <typename Weight, typename Index>
+  void ValidatingRouter<Weight, Index>::Serialize(BinaryWriter& output) const {
+    router_->Serialize(output);
+    reference_->Serialize(output);
+  }
+
+  template <typename Weight, typename Index>
+  bool ValidatingRouter<Weight, Index>::AddEdges(const Graph& graph, EdgeId first_new_edge) {
+    const bool added = router_->AddEdges(graph, first_new_edge);
+    return reference_->AddEdges(graph, first_new_edge) && added;
+  }
+
+  template <typename Weight, typename Index>
+  std::vector<std::optional<Weight>> ValidatingRouter<Weight, Index>::FindWeights(const std::vector<VertexId>& sources,
+                                                                                 const std::vector<VertexId>& targets) const {
+    auto weights = router_->FindWeights(sources, targets);
+    const auto expected = reference_->FindWeights(sources, targets);
+    for (size_t i = 0; i < weights.size(); ++i) {
+      Check(sources[i / targets.size()], targets[i % targets.size()], weights[i], expected[i]);
+    }
+    return weights;
+  }
+
+}
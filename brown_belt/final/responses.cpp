@@ -2,14 +2,14 @@
 
 Json::Node NodeFromStop(GetStopInfo info) {
 	using Json::Node;
-	map<string, Node> result;
+	Json::Dict result;
 	result["request_id"] = Node(static_cast<double>(info.req_id));
 
 	if (!info.found) {
 		result["error_message"] = Node(string("not found"));
 	}
 	else {
-		vector<Node> buses;
+		Json::Array buses;
 		for (string& bus : info.buses) {
 			buses.push_back(Node(move(bus)));
 		}
@@ -20,7 +20,7 @@ Json::Node NodeFromStop(GetStopInfo info) {
 
 Json::Node NodeFromBus(GetBusInfo info) {
 	using Json::Node;
-	map<string, Node> result;
+	Json::Dict result;
 
 	result["request_id"] = Node(static_cast<double>(info.req_id));
 	if (info.all_stops_count == 0) {
@@ -35,38 +35,127 @@ Json::Node NodeFromBus(GetBusInfo info) {
 	return Json::Node(move(result));
 }
 
-Json::Node NodeFromItem(ItemPtr item) {
-	using Json::Node;
-	map<string, Node> result;
-	result["type"] = Node(item->type);
-	result["time"] = Node(item->time);
-	if (item->type == "Wait") {
-		result["stop_name"] = Node(string(static_cast<Wait*>(item.get())->name));
+namespace {
+	void WriteItem(const Item& item, Json::Writer& output) {
+		output.StartObject();
+		if (const Wait* wait = get_if<Wait>(&item)) {
+			output.Key("stop_name");
+			output.String(wait->name);
+			output.Key("time");
+			output.Number(wait->time);
+			output.Key("type");
+			output.String("Wait");
+		}
+		else {
+			const Bus& bus = get<Bus>(item);
+			output.Key("bus");
+			output.String(bus.bus);
+			output.Key("span_count");
+			output.Number(bus.spans);
+			output.Key("time");
+			output.Number(bus.time);
+			output.Key("type");
+			output.String("Bus");
+		}
+		output.EndObject();
+	}
+
+	void WriteItems(const vector<Item>& items, Json::Writer& output) {
+		output.StartArray();
+		for (const Item& item : items) {
+			WriteItem(item, output);
+		}
+		output.EndArray();
+	}
+
+	void WriteNotFound(int req_id, Json::Writer& output) {
+		output.Key("error_message");
+		output.String("not found");
+		output.Key("request_id");
+		output.Number(req_id);
 	}
-	else if (item->type == "Bus") {
-		result["bus"] = Node(string(static_cast<Bus*>(item.get())->bus));
-		result["span_count"] = Node(static_cast<double>(static_cast<Bus*>(item.get())->spans));
+}
+
+// Keys are written in the order of an uploaded object, so the answer reads
+// the same as a node would
+void WriteRoute(const GetRouteInfo& info, Json::Writer& output) {
+	output.StartObject();
+	if (info.found) {
+		output.Key("items");
+		WriteItems(info.items, output);
+		output.Key("request_id");
+		output.Number(info.req_id);
+		output.Key("total_time");
+		output.Number(info.total_time);
 	}
-	else throw invalid_argument("Unknown item type");
-	return result;
+	else {
+		WriteNotFound(info.req_id, output);
+	}
+	output.EndObject();
 }
 
-Json::Node NodeFromRoute(GetRouteInfo info) {
+void WriteRoutes(const GetRoutesInfo& info, Json::Writer& output) {
+	output.StartObject();
+	if (!info.routes.empty()) {
+		output.Key("request_id");
+		output.Number(info.req_id);
+		output.Key("routes");
+		output.StartArray();
+		for (const GetRouteInfo& route : info.routes) {
+			output.StartObject();
+			output.Key("items");
+			WriteItems(route.items, output);
+			output.Key("total_time");
+			output.Number(route.total_time);
+			output.EndObject();
+		}
+		output.EndArray();
+	}
+	else {
+		WriteNotFound(info.req_id, output);
+	}
+	output.EndObject();
+}
+
+// One row of times per source, -1 for an unreachable target
+Json::Node NodeFromMatrix(GetMatrixInfo info) {
 	using Json::Node;
-	map<string, Node> result;
+	Json::Dict result;
 
 	result["request_id"] = Node(static_cast<double>(info.req_id));
 	if (info.found) {
-		result["total_time"] = Node(info.total_time);
-
-		vector<Node> items;
-		for (auto& item : info.items) {
-			items.push_back(NodeFromItem(move(item)));
+		Json::Array rows;
+		rows.reserve(info.rows);
+		for (size_t i = 0; i < info.rows; ++i) {
+			Json::Array row;
+			row.reserve(info.columns);
+			for (size_t j = 0; j < info.columns; ++j) {
+				row.push_back(Node(info.times[i * info.columns + j].value_or(-1.0)));
+			}
+			rows.push_back(Node(move(row)));
 		}
-		result["items"] = Node(move(items));
+		result["times"] = Node(move(rows));
 	}
 	else {
 		result["error_message"] = Node(string("not found"));
 	}
 	return Node(move(result));
 }
+
+// Stops are never "not found", there may just be none of them
+Json::Node NodeFromNearbyStops(GetNearbyStopsInfo info) {
+	using Json::Node;
+	Json::Dict result;
+
+	result["request_id"] = Node(static_cast<double>(info.req_id));
+	Json::Array stops;
+	stops.reserve(info.stops.size());
+	for (const auto& [name, length] : info.stops) {
+		stops.push_back(Node(Json::Dict{
+			{ "name", Node(string(name)) },
+			{ "distance", Node(length) },
+		}));
+	}
+	result["stops"] = Node(move(stops));
+	return Node(move(result));
+}
@@ -5,7 +5,9 @@
 #include <vector>
 #include <tuple>
 #include <utility>
-#include <memory>
+#include <string_view>
+#include <variant>
+#include <optional>
 using namespace std;
 
 struct GetStopInfo {
@@ -46,41 +48,49 @@ struct GetBusInfo {
 };
 
 
-struct Item {
-	string type;
-	double time;
-};
-
-struct Wait : Item {
-	Wait(string_view name_, double time_) {
-		type = "Wait";
-		name = move(name_);
-		time = time_;
-	}
+// Route items are plain values, names point into the guider's interners
+struct Wait {
 	string_view name;
+	double time = 0;
 };
 
-using ItemPtr = shared_ptr<Item>;
-
-struct Bus : Item {
-	Bus(string_view bus_, int spans_, double time_) {
-		type = "Bus";
-		bus = move(bus_);
-		spans = spans_;
-		time = time_;
-	}
+struct Bus {
 	string_view bus;
-	int spans;
+	int spans = 0;
+	double time = 0;
 };
 
+using Item = variant<Wait, Bus>;
+
 struct GetRouteInfo {
 	int req_id = 0;
 	double total_time = 0;
-	vector<ItemPtr> items;
+	vector<Item> items;
+	bool found = false;
+};
+
+struct GetRoutesInfo {
+	int req_id = 0;
+	vector<GetRouteInfo> routes; // best first, none if not found
+};
+
+struct GetMatrixInfo {
+	int req_id = 0;
+	size_t rows = 0, columns = 0;
+	vector<optional<double>> times; // row-major, nullopt if unreachable
 	bool found = false;
 };
 
+// Stops near a point, nearest first, with their great-circle lengths to it in meters
+struct GetNearbyStopsInfo {
+	int req_id = 0;
+	vector<pair<string_view, double>> stops;
+};
+
 Json::Node NodeFromStop(GetStopInfo info);
 Json::Node NodeFromBus(GetBusInfo info);
-Json::Node NodeFromItem(ItemPtr item);
-Json::Node NodeFromRoute(GetRouteInfo info);
\ No newline at end of file
+// Route items go straight to the output, they are never built as nodes
+void WriteRoute(const GetRouteInfo& info, Json::Writer& output);
+void WriteRoutes(const GetRoutesInfo& info, Json::Writer& output);
+Json::Node NodeFromMatrix(GetMatrixInfo info);
+Json::Node NodeFromNearbyStops(GetNearbyStopsInfo info);
\ No newline at end of file
@@ -1,61 +1,66 @@
 #pragma once
 
 #include "graph.h"
+#include "router_base.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <limits>
 #include <optional>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
-  template <typename Weight>
-  class Router {
+  // All-pairs Floyd-Warshall: O(V^3) construction and O(V^2) memory, O(route) queries.
+  // A new edge is added in O(V^2) by relaxing all routes through it.
+  template <typename Weight, typename Index = size_t>
+  class Router : public RouterBase<Weight, Index> {
   private:
-    using Graph = DirectedWeightedGraph<Weight>;
+    using Graph = DirectedWeightedGraph<Weight, Index>;
 
   public:
     Router(const Graph& graph);
+    Router(const Graph& graph, BinaryReader& input);
 
-    using RouteId = uint64_t;
+    using Route = typename RouterBase<Weight, Index>::Route;
 
-    struct RouteInfo {
-      RouteId id;
-      Weight weight;
-      size_t edge_count;
-    };
-
-    std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
-    EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
-    void ReleaseRoute(RouteId route_id);
+    std::optional<Route> FindRoute(VertexId from, VertexId to) const override;
+    void Serialize(BinaryWriter& output) const override;
+    bool AddEdges(const Graph& graph, EdgeId first_new_edge) override;
+    std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                   const std::vector<VertexId>& targets) const override;
 
   private:
     const Graph& graph_;
 
+    // Unreached routes and routes without edges are told by prev_edge, not wrapped
+    // in optionals: a cell is two words of Weight and Index with no padding flags.
+    static constexpr Index UNREACHED = std::numeric_limits<Index>::max();
+    static constexpr Index NO_EDGE = UNREACHED - 1;
+
     struct RouteInternalData {
-      Weight weight;
-      std::optional<EdgeId> prev_edge;
-    };
-    using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
+      Weight weight = 0;
+      Index prev_edge = UNREACHED;
 
-    using ExpandedRoute = std::vector<EdgeId>;
-    mutable RouteId next_route_id_ = 0;
-    mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
+      bool Reached() const {
+        return prev_edge != UNREACHED;
+      }
+    };
+    using RoutesInternalData = std::vector<std::vector<RouteInternalData>>;
 
     void InitializeRoutesInternalData(const Graph& graph) {
       const size_t vertex_count = graph.GetVertexCount();
       for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
-        routes_internal_data_[vertex][vertex] = RouteInternalData{0, std::nullopt};
+        routes_internal_data_[vertex][vertex] = RouteInternalData{0, NO_EDGE};
         for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
           const auto& edge = graph.GetEdge(edge_id);
           assert(edge.weight >= 0);
           auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-          if (!route_internal_data || route_internal_data->weight > edge.weight) {
-            route_internal_data = RouteInternalData{edge.weight, edge_id};
+          if (!route_internal_data.Reached() || route_internal_data.weight > edge.weight) {
+            route_internal_data = RouteInternalData{edge.weight, static_cast<Index>(edge_id)};
           }
         }
       }
@@ -65,10 +70,10 @@ namespace Graph {
                     const RouteInternalData& route_from, const RouteInternalData& route_to) {
       auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
       const Weight candidate_weight = route_from.weight + route_to.weight;
-      if (!route_relaxing || candidate_weight < route_relaxing->weight) {
+      if (!route_relaxing.Reached() || candidate_weight < route_relaxing.weight) {
         route_relaxing = {
             candidate_weight,
-            route_to.prev_edge
+            route_to.prev_edge != NO_EDGE
                 ? route_to.prev_edge
                 : route_from.prev_edge
         };
@@ -77,10 +82,32 @@ namespace Graph {
 
     void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
       for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
-        if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
+        if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]; route_from.Reached()) {
+          for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
+            if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]; route_to.Reached()) {
+              RelaxRoute(vertex_from, vertex_to, route_from, route_to);
+            }
+          }
+        }
+      }
+    }
+
+    void RelaxRoutesThroughEdge(EdgeId edge_id) {
+      const auto& edge = graph_.GetEdge(edge_id);
+      assert(edge.weight >= 0);
+      const auto& route_direct = routes_internal_data_[edge.from][edge.to];
+      if (route_direct.Reached() && route_direct.weight <= edge.weight) {
+        return;
+      }
+      const size_t vertex_count = routes_internal_data_.size();
+      // routes from edge.to don't get shorter through the edge, as weights aren't negative
+      const auto routes_from_target = routes_internal_data_[edge.to];
+      for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
+        if (const auto& route_from = routes_internal_data_[vertex_from][edge.from]; route_from.Reached()) {
+          const RouteInternalData route_through{route_from.weight + edge.weight, static_cast<Index>(edge_id)};
           for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
-            if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
-              RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
+            if (const auto& route_to = routes_from_target[vertex_to]; route_to.Reached()) {
+              RelaxRoute(vertex_from, vertex_to, route_through, route_to);
             }
           }
         }
@@ -91,10 +118,10 @@ namespace Graph {
   };
 
 
-  template <typename Weight>
-  Router<Weight>::Router(const Graph& graph)
+  template <typename Weight, typename Index>
+  Router<Weight, Index>::Router(const Graph& graph)
       : graph_(graph),
-        routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+        routes_internal_data_(graph.GetVertexCount(), std::vector<RouteInternalData>(graph.GetVertexCount()))
   {
     InitializeRoutesInternalData(graph);
 
@@ -104,35 +131,69 @@ namespace Graph {
     }
   }
 
-  template <typename Weight>
-  std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
-    const auto& route_internal_data = routes_internal_data_[from][to];
-    if (!route_internal_data) {
-      return std::nullopt;
+  template <typename Weight, typename Index>
+  Router<Weight, Index>::Router(const Graph& graph, BinaryReader& input)
+      : graph_(graph)
+  {
+    routes_internal_data_.reserve(graph.GetVertexCount());
+    for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+      routes_internal_data_.push_back(input.ReadVector<RouteInternalData>());
     }
-    const Weight weight = route_internal_data->weight;
-    std::vector<EdgeId> edges;
-    for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
-         edge_id;
-         edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
-      edges.push_back(*edge_id);
+  }
+
+  template <typename Weight, typename Index>
+  void Router<Weight, Index>::Serialize(BinaryWriter& output) const {
+    for (const auto& routes_from : routes_internal_data_) {
+      output.WriteVector(routes_from);
     }
-    std::reverse(std::begin(edges), std::end(edges));
+  }
 
-    const RouteId route_id = next_route_id_++;
-    const size_t route_edge_count = edges.size();
-    expanded_routes_cache_[route_id] = std::move(edges);
-    return RouteInfo{route_id, weight, route_edge_count};
+  template <typename Weight, typename Index>
+  bool Router<Weight, Index>::AddEdges(const Graph& graph, EdgeId first_new_edge) {
+    const size_t vertex_count = graph.GetVertexCount();
+    for (auto& routes_from : routes_internal_data_) {
+      routes_from.resize(vertex_count);
+    }
+    for (VertexId vertex = routes_internal_data_.size(); vertex < vertex_count; ++vertex) {
+      routes_internal_data_.emplace_back(vertex_count);
+      routes_internal_data_[vertex][vertex] = RouteInternalData{0, NO_EDGE};
+    }
+    for (EdgeId edge_id = first_new_edge; edge_id < graph.GetEdgeCount(); ++edge_id) {
+      RelaxRoutesThroughEdge(edge_id);
+    }
+    return true;
   }
 
-  template <typename Weight>
-  EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
-    return expanded_routes_cache_.at(route_id)[edge_idx];
+  template <typename Weight, typename Index>
+  std::vector<std::optional<Weight>> Router<Weight, Index>::FindWeights(const std::vector<VertexId>& sources,
+                                                                        const std::vector<VertexId>& targets) const {
+    std::vector<std::optional<Weight>> weights;
+    weights.reserve(sources.size() * targets.size());
+    for (const VertexId from : sources) {
+      for (const VertexId to : targets) {
+        const auto& route_internal_data = routes_internal_data_[from][to];
+        weights.push_back(route_internal_data.Reached() ? std::optional<Weight>(route_internal_data.weight) : std::nullopt);
+      }
+    }
+    return weights;
   }
 
-  template <typename Weight>
-  void Router<Weight>::ReleaseRoute(RouteId route_id) {
-    expanded_routes_cache_.erase(route_id);
+  template <typename Weight, typename Index>
+  std::optional<typename Router<Weight, Index>::Route> Router<Weight, Index>::FindRoute(VertexId from, VertexId to) const {
+    const auto& route_internal_data = routes_internal_data_[from][to];
+    if (!route_internal_data.Reached()) {
+      return std::nullopt;
+    }
+    const Weight weight = route_internal_data.weight;
+    std::vector<EdgeId> edges;
+    for (Index edge_id = route_internal_data.prev_edge;
+         edge_id != NO_EDGE;
+         edge_id = routes_internal_data_[from][graph_.GetEdge(edge_id).from].prev_edge) {
+      edges.push_back(edge_id);
+    }
+    std::reverse(std::begin(edges), std::end(edges));
+
+    return Route{weight, std::move(edges)};
   }
 
 }
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "binary_io.h"
+#include "graph.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Common interface of all routers: an implementation only has to find the route.
+  // FindRoute may be called concurrently once the router is built.
+  // BuildRoute keeps expanded routes here until ReleaseRoute and is single-threaded.
+  template <typename Weight, typename Index = size_t>
+  class RouterBase {
+  public:
+    using RouteId = uint64_t;
+
+    struct RouteInfo {
+      RouteId id;
+      Weight weight;
+      size_t edge_count;
+    };
+
+    struct Route {
+      Weight weight;
+      std::vector<EdgeId> edges;
+    };
+
+    virtual ~RouterBase() = default;
+
+    virtual std::optional<Route> FindRoute(VertexId from, VertexId to) const = 0;
+    // Writes the preprocessed data; each router has a constructor reading it back.
+    virtual void Serialize(BinaryWriter& output) const = 0;
+    // Catches up with the graph after vertices and edges first_new_edge... were
+    // appended to it. Returns false if the router can't, then it has to be rebuilt.
+    // Must not run concurrently with queries.
+    virtual bool AddEdges(const DirectedWeightedGraph<Weight, Index>& /*graph*/, EdgeId /*first_new_edge*/) {
+      return false;
+    }
+    // Weights of the best routes from every source to every target without the
+    // routes themselves: row i holds sources[i], the cell of targets[j] is at
+    // i * targets.size() + j. Asks FindRoute for every pair unless overridden.
+    virtual std::vector<std::optional<Weight>> FindWeights(const std::vector<VertexId>& sources,
+                                                           const std::vector<VertexId>& targets) const;
+
+    std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
+    EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
+    void ReleaseRoute(RouteId route_id);
+
+  private:
+    using ExpandedRoute = std::vector<EdgeId>;
+    mutable RouteId next_route_id_ = 0;
+    mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
+  };
+
+
+  // Search states for concurrent queries. A query leases a state and gives it
+  // back when the lease is destroyed, so there are as many states as parallel
+  // queries have ever run at once. State is constructed from the vertex count.
+  template <typename State>
+  class SearchStatePool {
+  public:
+    class Lease {
+    public:
+      Lease(const SearchStatePool& pool, std::unique_ptr<State> state)
+          : pool_(pool), state_(std::move(state)) {}
+      Lease(const Lease&) = delete;
+      Lease& operator=(const Lease&) = delete;
+      ~Lease() {
+        pool_.Release(std::move(state_));
+      }
+
+      State& operator*() const {
+        return *state_;
+      }
+      State* operator->() const {
+        return state_.get();
+      }
+
+    private:
+      const SearchStatePool& pool_;
+      std::unique_ptr<State> state_;
+    };
+
+    explicit SearchStatePool(size_t vertex_count) : vertex_count_(vertex_count) {}
+
+    Lease Acquire() const;
+    // Drops the free states, must not run concurrently with queries
+    void Resize(size_t vertex_count);
+
+  private:
+    void Release(std::unique_ptr<State> state) const;
+
+    size_t vertex_count_;
+    mutable std::mutex mutex_;
+    mutable std::vector<std::unique_ptr<State>> free_states_;
+  };
+
+
+  template <typename Weight, typename Index>
+  std::optional<typename RouterBase<Weight, Index>::RouteInfo> RouterBase<Weight, Index>::BuildRoute(VertexId from, VertexId to) const {
+    auto route = FindRoute(from, to);
+    if (!route) {
+      return std::nullopt;
+    }
+    const RouteId route_id = next_route_id_++;
+    const size_t route_edge_count = route->edges.size();
+    expanded_routes_cache_[route_id] = std::move(route->edges);
+    return RouteInfo{route_id, route->weight, route_edge_count};
+  }
+
+  template <typename Weight, typename Index>
+  std::vector<std::optional<Weight>> RouterBase<Weight, Index>::FindWeights(const std::vector<VertexId>& sources,
+                                                                            const std::vector<VertexId>& targets) const {
+    std::vector<std::optional<Weight>> weights;
+    weights.reserve(sources.size() * targets.size());
+    for (const VertexId from : sources) {
+      for (const VertexId to : targets) {
+        const auto route = FindRoute(from, to);
+        weights.push_back(route ? std::optional<Weight>(route->weight) : std::nullopt);
+      }
+    }
+    return weights;
+  }
+
+  template <typename Weight, typename Index>
+  EdgeId RouterBase<Weight, Index>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+    return expanded_routes_cache_.at(route_id)[edge_idx];
+  }
+
+  template <typename Weight, typename Index>
+  void RouterBase<Weight, Index>::ReleaseRoute(RouteId route_id) {
+    expanded_routes_cache_.erase(route_id);
+  }
+
+  template <typename State>
+  typename SearchStatePool<State>::Lease SearchStatePool<State>::Acquire() const {
+    std::unique_ptr<State> state;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (!free_states_.empty()) {
+        state = std::move(free_states_.back());
+        free_states_.pop_back();
+      }
+    }
+    if (!state) {
+      state = std::make_unique<State>(vertex_count_);
+    }
+    return Lease(*this, std::move(state));
+  }
+
+  template <typename State>
+  void SearchStatePool<State>::Resize(size_t vertex_count) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    vertex_count_ = vertex_count;
+    free_states_.clear();
+  }
+
+  template <typename State>
+  void SearchStatePool<State>::Release(std::unique_ptr<State> state) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_states_.push_back(std::move(state));
+  }
+
+}
@@ -0,0 +1,175 @@
+#include "guider.h"
+#include "metrics.h"
+#include <fstream>
+
+// Database file: magic, version, settings, stop and bus names, stops, buses,
+// then the graph with its edge descriptions and the router preprocessing.
+// Bump the version whenever the layout of anything written here changes.
+namespace {
+	const uint32_t BASE_MAGIC = 0x42444754; // "TGDB"
+	const uint32_t BASE_VERSION = 4;
+
+	void SerializeNames(const StringInterner& names, BinaryWriter& output) {
+		output.Write<uint64_t>(names.Size());
+		for (size_t id = 0; id < names.Size(); ++id) {
+			output.WriteString(names.Name(id));
+		}
+	}
+
+	void DeserializeNames(StringInterner& names, BinaryReader& input) {
+		const size_t count = input.Read<uint64_t>();
+		for (size_t id = 0; id < count; ++id) {
+			names.Intern(input.ReadString());
+		}
+	}
+}
+
+
+/* TRANSPORT_GUIDER---TRANSPORT_GUIDER---TRANSPORT_GUIDER---TRANSPORT_GUIDER---TRANSPORT_GUIDER */
+
+
+void TransportGuider::MakeBase(vector<Query> queries) {
+	for (auto& query : queries) {
+		if (holds_alternative<SerializationQuery>(query)) {
+			ProcessQuery(query);
+		}
+	}
+	ofstream output(base_file, ios::binary);
+	MakeBase(move(queries), output);
+}
+
+void TransportGuider::MakeBase(vector<Query> queries, ostream& base) {
+	for (auto& query : queries) {
+		if (!IsStatQuery(TypeOf(query))) {
+			ProcessQuery(query);
+		}
+	}
+	Finalize();
+	BuildRoutes();
+	MEASURE_PHASE(Phase::BASE_SAVE);
+	Serialize(base);
+}
+
+void TransportGuider::ProcessRequests(vector<Query> queries, ostream& stream) {
+	for (auto& query : queries) {
+		if (holds_alternative<SerializationQuery>(query)) {
+			ProcessQuery(query);
+		}
+	}
+	const MappedFile base(base_file);
+	ProcessRequests(move(queries), base.Data(), stream);
+}
+
+// Settings and base queries come with the database, the ones given here are
+// ignored: applying them would throw away the graph and router just loaded
+void TransportGuider::ProcessRequests(vector<Query> queries, string_view base, ostream& stream) {
+	queries.erase(remove_if(queries.begin(), queries.end(),
+		[](const Query& query) { return !IsStatQuery(TypeOf(query)); }), queries.end());
+	{
+		MEASURE_PHASE(Phase::BASE_LOAD);
+		Deserialize(base);
+	}
+	ProcessQueries(move(queries), stream);
+}
+
+// Expects a finalized guider
+void TransportGuider::Serialize(ostream& output) const {
+	BinaryWriter writer(output);
+	writer.Write(BASE_MAGIC);
+	writer.Write(BASE_VERSION);
+	writer.Write(cfg);
+	SerializeNames(stop_names, writer);
+	SerializeNames(bus_names, writer);
+	for (const StopInfo& stop : stops_info) {
+		writer.Write(stop.coords);
+		writer.WriteVector(stop.buses);
+		vector<StopId> neighbours;
+		vector<double> distances;
+		for (const auto& [neighbour, distance] : stop.distances) {
+			neighbours.push_back(neighbour);
+			distances.push_back(distance);
+		}
+		writer.WriteVector(neighbours);
+		writer.WriteVector(distances);
+	}
+	for (const BusInfo& bus : buses_info) {
+		writer.WriteVector(bus.stops);
+		writer.Write(bus.is_circled);
+		writer.Write(bus.stats);
+	}
+	TG.Serialize(writer);
+}
+
+void TransportGuider::Deserialize(string_view data) {
+	BinaryReader reader(data);
+	if (reader.Read<uint32_t>() != BASE_MAGIC) {
+		throw BinaryFormatError("Not a transport database");
+	}
+	if (const uint32_t version = reader.Read<uint32_t>(); version != BASE_VERSION) {
+		throw BinaryFormatError("Unsupported transport database version " + to_string(version));
+	}
+	cfg = reader.Read<Settings>();
+	DeserializeNames(stop_names, reader);
+	DeserializeNames(bus_names, reader);
+	stops_info.resize(stop_names.Size());
+	for (StopInfo& stop : stops_info) {
+		stop.coords = reader.Read<Coordinates>();
+		stop.buses = reader.ReadVector<BusId>();
+		const auto neighbours = reader.ReadVector<StopId>();
+		const auto distances = reader.ReadVector<double>();
+		for (size_t i = 0; i < neighbours.size(); ++i) {
+			stop.distances.push_back({ neighbours[i], distances[i] });
+		}
+	}
+	buses_info.resize(bus_names.Size());
+	for (BusInfo& bus : buses_info) {
+		bus.stops = reader.ReadVector<StopId>();
+		bus.is_circled = reader.Read<bool>();
+		bus.stats = reader.Read<BusStats>();
+	}
+	IndexStops();
+	finalized = true;
+	TG.Deserialize(reader);
+}
+
+
+/* TRANSPORT_GRAPH---TRANSPORT_GRAPH---TRANSPORT_GRAPH---TRANSPORT_GRAPH---TRANSPORT_GRAPH */
+
+
+void TransportGraph::Serialize(BinaryWriter& output) const {
+	output.Write(GraphExist());
+	if (!GraphExist()) {
+		return;
+	}
+	const DoubleGraph& g = graph.value();
+	vector<Graph::Edge<double>> edges;
+	edges.reserve(g.GetEdgeCount());
+	for (Graph::EdgeId edge_id = 0; edge_id < g.GetEdgeCount(); ++edge_id) {
+		edges.push_back(g.GetEdge(edge_id));
+	}
+	output.Write<uint64_t>(g.GetVertexCount());
+	output.WriteVector(edges);
+	output.WriteVector(edges_);
+	output.WriteVector(vertex_stops_);
+	output.WriteVector(stop_vertices_);
+	output.Write<uint64_t>(bus_count_);
+	router_ptr->Serialize(output);
+}
+
+void TransportGraph::Deserialize(BinaryReader& input) {
+	if (!input.Read<bool>()) {
+		return;
+	}
+	graph = DoubleGraph(input.Read<uint64_t>());
+	for (const auto& edge : input.ReadVector<Graph::Edge<double>>()) {
+		graph.value().AddEdge(edge);
+	}
+	edges_ = input.ReadVector<EdgeInfo>();
+	vertex_stops_ = input.ReadVector<StopId>();
+	stop_vertices_ = input.ReadVector<Graph::VertexId>();
+	bus_count_ = input.Read<uint64_t>();
+	outdated_ = false;
+	CreateRouter(&input);
+	alternatives_ = make_unique<Graph::KShortestRoutes<double>>(graph.value());
+	route_cache_.Clear();
+}
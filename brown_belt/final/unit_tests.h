@@ -4,16 +4,800 @@
 #include "guider.h"
 #include "graph.h"
 #include "router.h"
+#include "dijkstra_router.h"
+#include "ch_router.h"
+#include "narrow_router.h"
 #include "profile.h"
+#include "metrics.h"
 #include <fstream>
+#include <future>
+#include <numeric>
+#include <random>
+#include <set>
 using namespace std;
 
+Graph::DirectedWeightedGraph<double> RandomGraph(size_t vertex_count, size_t edge_count, unsigned seed) {
+	mt19937 gen(seed);
+	uniform_int_distribution<size_t> vertex(0, vertex_count - 1);
+	uniform_int_distribution<int> weight(0, 100);
+	Graph::DirectedWeightedGraph<double> graph(vertex_count);
+	for (size_t i = 0; i < edge_count; ++i) {
+		graph.AddEdge({ vertex(gen), vertex(gen), static_cast<double>(weight(gen)) });
+	}
+	return graph;
+}
+
+template <typename Router>
+double RouteWeightByEdges(const Graph::DirectedWeightedGraph<double>& graph, Router& router,
+	Graph::VertexId from, Graph::VertexId to, typename Router::RouteInfo info) {
+	double weight = 0;
+	Graph::VertexId current = from;
+	for (size_t i = 0; i < info.edge_count; ++i) {
+		const auto& edge = graph.GetEdge(router.GetRouteEdge(info.id, i));
+		ASSERT_EQUAL(edge.from, current);
+		current = edge.to;
+		weight += edge.weight;
+	}
+	ASSERT_EQUAL(current, to);
+	router.ReleaseRoute(info.id);
+	return weight;
+}
+
+template <typename Router>
+void CheckRouterAgainstFloyd(const Graph::DirectedWeightedGraph<double>& graph, Router& router) {
+	Graph::Router<double> floyd(graph);
+	for (Graph::VertexId from = 0; from < graph.GetVertexCount(); ++from) {
+		for (Graph::VertexId to = 0; to < graph.GetVertexCount(); ++to) {
+			const auto expected = floyd.BuildRoute(from, to);
+			const auto route = router.BuildRoute(from, to);
+			ASSERT_EQUAL(expected.has_value(), route.has_value());
+			if (route) {
+				ASSERT_EQUAL(route->weight, expected->weight);
+				ASSERT_EQUAL(RouteWeightByEdges(graph, router, from, to, *route), route->weight);
+				floyd.ReleaseRoute(expected->id);
+			}
+		}
+	}
+
+	// a repeated target and a target that is also a source
+	vector<Graph::VertexId> sources, targets = { 0, 0 };
+	for (Graph::VertexId vertex = 0; vertex < graph.GetVertexCount(); vertex += 3) {
+		sources.push_back(vertex);
+		targets.push_back(graph.GetVertexCount() - 1 - vertex);
+	}
+	const auto weights = router.FindWeights(sources, targets);
+	const auto expected = floyd.FindWeights(sources, targets);
+	ASSERT_EQUAL(weights.size(), sources.size() * targets.size());
+	ASSERT(weights == expected);
+}
+
+void TestDijkstraRouter() {
+	const auto graph = RandomGraph(60, 240, 42);
+	Graph::DijkstraRouter<double> dijkstra(graph);
+	CheckRouterAgainstFloyd(graph, dijkstra);
+}
+
+void TestContractionHierarchyRouter() {
+	for (unsigned seed : {1, 2, 3}) {
+		const auto graph = RandomGraph(80, 80 * seed * 2, seed);
+		Graph::ContractionHierarchyRouter<double> ch(graph);
+		CheckRouterAgainstFloyd(graph, ch);
+	}
+}
+
+void TestGeoPoints() {
+	mt19937 gen(7);
+	uniform_real_distribution<double> latitude(-80, 80), longitude(-180, 180);
+	vector<Coordinates> coords(100);
+	for (Coordinates& point : coords) {
+		point = { latitude(gen), longitude(gen) };
+	}
+	coords.push_back(coords.back());
+	vector<size_t> route(coords.size());
+	for (size_t i = 0; i < route.size(); ++i) {
+		route[i] = i;
+	}
+	const GeoPoints points(coords);
+	vector<double> lengths;
+	points.SegmentLengths(route, lengths);
+	ASSERT_EQUAL(lengths.size(), coords.size() - 1);
+	for (size_t i = 0; i + 1 < coords.size(); ++i) {
+		const double expected = Length(coords[i], coords[i + 1]);
+		ASSERT(abs(lengths[i] - expected) <= 1e-6 * max(1.0, expected));
+		ASSERT(abs(points.Length(i, i + 1) - expected) <= 1e-6 * max(1.0, expected));
+	}
+	ASSERT_EQUAL(lengths.back(), 0.0);
+	ASSERT_EQUAL(points.RouteLength({ 0 }), 0.0);
+}
+
+void TestGeoIndex() {
+	mt19937 gen(11);
+	uniform_real_distribution<double> latitude(55.5, 56.0), longitude(37.3, 37.9);
+	vector<Coordinates> coords(3000);
+	for (Coordinates& point : coords) {
+		point = { latitude(gen), longitude(gen) };
+	}
+	coords.push_back(coords[5]);
+	const GeoIndex index(coords);
+	ASSERT_EQUAL(index.Size(), coords.size());
+	for (int query = 0; query < 50; ++query) {
+		const Coordinates point = query == 0 ? coords[5] : Coordinates{ latitude(gen), longitude(gen) };
+		vector<pair<double, size_t>> expected;
+		for (size_t id = 0; id < coords.size(); ++id) {
+			expected.push_back({ Length(point, coords[id]), id });
+		}
+		sort(expected.begin(), expected.end());
+
+		const auto nearest = index.Nearest(point, 10);
+		ASSERT_EQUAL(nearest.size(), 10u);
+		for (size_t i = 0; i < nearest.size(); ++i) {
+			ASSERT(abs(nearest[i].length - expected[i].first) < 1e-3);
+		}
+		const double radius = 1000;
+		const auto within = index.WithinRadius(point, radius);
+		const size_t expected_count = lower_bound(expected.begin(), expected.end(), pair(radius, size_t(0))) - expected.begin();
+		ASSERT_EQUAL(within.size(), expected_count);
+		for (size_t i = 0; i < within.size(); ++i) {
+			ASSERT(within[i].length <= radius);
+			ASSERT(abs(within[i].length - expected[i].first) < 1e-3);
+		}
+	}
+	// a repeated point: the lower id comes first
+	const auto same = index.Nearest(coords[5], 2);
+	ASSERT_EQUAL(same[0].id, 5u);
+	ASSERT_EQUAL(same[1].id, coords.size() - 1);
+	ASSERT_EQUAL(same[1].length, 0.0);
+	ASSERT(index.Nearest(coords[0], 0).empty());
+	ASSERT_EQUAL(index.Nearest(coords[0], coords.size() + 5).size(), coords.size());
+	ASSERT(GeoIndex().Nearest(coords[0], 3).empty());
+}
+
+void TestLruCache() {
+	LruCache<int, string> cache(0, [](const string& value) { return value.size(); });
+	cache.Put(1, "one");
+	ASSERT(!cache.Get(1));
+
+	cache.SetCapacity(1000);
+	cache.Put(1, "one");
+	cache.Put(2, "two");
+	ASSERT_EQUAL(*cache.Get(1), "one");
+	const size_t bytes = cache.Stats().bytes;
+	// the entry of 2 is the least recently used one and goes first
+	cache.SetCapacity(bytes - 1);
+	ASSERT(!cache.Get(2));
+	ASSERT_EQUAL(*cache.Get(1), "one");
+
+	const CacheStats stats = cache.Stats();
+	ASSERT_EQUAL(stats.hits, 2u);
+	ASSERT_EQUAL(stats.misses, 2u);
+	ASSERT_EQUAL(stats.evictions, 1u);
+	ASSERT_EQUAL(stats.entries, 1u);
+	ASSERT_EQUAL(stats.bytes, bytes / 2);
+}
+
+// Skewed lookups from several threads, a miss puts the value: counters add up,
+// and splitting the lock is no slower than a single one
+void TestShardedLruCacheParallel() {
+	const size_t thread_count = 4, lookups = 20000, key_count = 512;
+	auto run = [&](auto& cache) {
+		vector<future<void>> futures;
+		for (size_t thread = 0; thread < thread_count; ++thread) {
+			futures.push_back(async(launch::async, [&cache, thread] {
+				mt19937 gen(static_cast<unsigned>(thread));
+				for (size_t i = 0; i < lookups; ++i) {
+					// the product of two uniform keys is mostly small: a few keys are hot
+					const int key = static_cast<int>((gen() % key_count) * (gen() % key_count) / key_count);
+					if (!cache.Get(key)) {
+						cache.Put(key, to_string(key));
+					}
+				}
+			}));
+		}
+		for (auto& f : futures) f.get();
+	};
+	auto sizer = [](const string& value) { return value.size(); };
+
+	ShardedLruCache<int, string> sharded(1 << 20, sizer);
+	run(sharded);
+	const CacheStats stats = sharded.Stats();
+	ASSERT_EQUAL(stats.hits + stats.misses, thread_count * lookups);
+	ASSERT(stats.entries <= key_count);
+	// every thread misses a key at most once, later it finds its own value
+	ASSERT(stats.misses >= stats.entries);
+	ASSERT(stats.misses <= stats.entries * thread_count);
+	ASSERT_EQUAL(stats.evictions, 0u);
+	ASSERT_EQUAL(stats.capacity, size_t(1 << 20));
+
+	// the same keys in one shard take the same bytes: no entry is counted twice
+	LruCache<int, string> single(1 << 20, sizer);
+	run(single);
+	ASSERT_EQUAL(single.Stats().entries, stats.entries);
+	ASSERT_EQUAL(single.Stats().bytes, stats.bytes);
+
+	// a small capacity evicts in every shard, the total stays within it
+	ShardedLruCache<int, string> small(4000, sizer);
+	run(small);
+	const CacheStats small_stats = small.Stats();
+	ASSERT(small_stats.evictions > 0);
+	ASSERT(small_stats.bytes <= 4000);
+	ASSERT_EQUAL(small_stats.hits + small_stats.misses, thread_count * lookups);
+	small.Clear();
+	ASSERT_EQUAL(small.Stats().entries, 0u);
+	ASSERT_EQUAL(small.Stats().bytes, 0u);
+}
+
+void TestRoutersAddEdges() {
+	const auto full = RandomGraph(60, 300, 5);
+	Graph::DirectedWeightedGraph<double> graph(40);
+	auto add_edges = [&](size_t vertex_count, size_t edge_count) {
+		graph.AddVertices(vertex_count - graph.GetVertexCount());
+		for (Graph::EdgeId edge_id = graph.GetEdgeCount(); edge_id < full.GetEdgeCount(); ++edge_id) {
+			const auto& edge = full.GetEdge(edge_id);
+			if (graph.GetEdgeCount() == edge_count) break;
+			graph.AddEdge({ edge.from % vertex_count, edge.to % vertex_count, edge.weight });
+		}
+	};
+	add_edges(40, 150);
+	Graph::Router<double> floyd(graph);
+	Graph::DijkstraRouter<double> dijkstra(graph);
+	// the first step stays in the overlay, the second one is merged
+	for (const auto& [vertex_count, edge_count] : { pair{ 50, 170 }, pair{ 60, 300 } }) {
+		const Graph::EdgeId first_new_edge = graph.GetEdgeCount();
+		add_edges(vertex_count, edge_count);
+		ASSERT(floyd.AddEdges(graph, first_new_edge));
+		ASSERT(dijkstra.AddEdges(graph, first_new_edge));
+		CheckRouterAgainstFloyd(graph, floyd);
+		CheckRouterAgainstFloyd(graph, dijkstra);
+	}
+}
+
+void TestNarrowRouters() {
+	ASSERT_EQUAL(sizeof(Graph::Edge<float, uint32_t>) * 2, sizeof(Graph::Edge<double>));
+	// weights that float can't hold exactly
+	const auto integral = RandomGraph(60, 240, 7);
+	Graph::DirectedWeightedGraph<double> graph(60), shifted(60);
+	for (Graph::EdgeId edge_id = 0; edge_id < integral.GetEdgeCount(); ++edge_id) {
+		const auto& edge = integral.GetEdge(edge_id);
+		graph.AddEdge({ edge.from, edge.to, edge.weight / 7 });
+		shifted.AddEdge({ edge.from, edge.to, edge.weight / 7 + 1 });
+	}
+
+	using NarrowGraph = Graph::DirectedWeightedGraph<float, uint32_t>;
+	using NarrowRouter = Graph::NarrowRouter<double, float, uint32_t>;
+	vector<unique_ptr<Graph::RouterBase<double>>> routers;
+	routers.push_back(make_unique<NarrowRouter>(graph, [](const NarrowGraph& g) { return make_unique<Graph::Router<float, uint32_t>>(g); }));
+	routers.push_back(make_unique<NarrowRouter>(graph, [](const NarrowGraph& g) { return make_unique<Graph::DijkstraRouter<float, uint32_t>>(g); }));
+	routers.push_back(make_unique<NarrowRouter>(graph, [](const NarrowGraph& g) {
+		return make_unique<Graph::ContractionHierarchyRouter<float, uint32_t>>(g);
+	}));
+	vector<Graph::VertexId> vertices(graph.GetVertexCount());
+	iota(vertices.begin(), vertices.end(), 0);
+	for (auto& router : routers) {
+		Graph::ValidatingRouter<double> validating(move(router), make_unique<Graph::Router<double>>(graph), 1e-5);
+		for (Graph::VertexId from = 0; from < graph.GetVertexCount(); ++from) {
+			for (Graph::VertexId to = 0; to < graph.GetVertexCount(); ++to) {
+				validating.FindRoute(from, to);
+			}
+		}
+		validating.FindWeights(vertices, vertices);
+	}
+
+	Graph::ValidatingRouter<double> wrong(
+		make_unique<Graph::DijkstraRouter<double>>(graph), make_unique<Graph::DijkstraRouter<double>>(shifted), 1e-5);
+	bool thrown = false;
+	try {
+		wrong.FindWeights(vertices, vertices);
+	}
+	catch (const Graph::RouteValidationError&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void SimplePathWeights(const Graph::DirectedWeightedGraph<double>& graph, Graph::VertexId vertex, Graph::VertexId to,
+	double weight, vector<bool>& visited, vector<double>& weights) {
+	if (vertex == to) {
+		weights.push_back(weight);
+		return;
+	}
+	visited[vertex] = true;
+	for (const Graph::EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+		const auto& edge = graph.GetEdge(edge_id);
+		if (!visited[edge.to]) SimplePathWeights(graph, edge.to, to, weight + edge.weight, visited, weights);
+	}
+	visited[vertex] = false;
+}
+
+void TestKShortestRoutes() {
+	const size_t count = 5;
+	for (unsigned seed : {1, 2, 3}) {
+		const auto graph = RandomGraph(9, 30, seed);
+		Graph::ContractionHierarchyRouter<double> router(graph);
+		Graph::KShortestRoutes<double> alternatives(graph);
+		for (Graph::VertexId from = 0; from < graph.GetVertexCount(); ++from) {
+			for (Graph::VertexId to = 0; to < graph.GetVertexCount(); ++to) {
+				vector<double> expected;
+				vector<bool> visited(graph.GetVertexCount());
+				SimplePathWeights(graph, from, to, 0, visited, expected);
+				sort(expected.begin(), expected.end());
+				expected.resize(min(expected.size(), count));
+
+				const auto routes = alternatives.FindRoutes(router, from, to, count);
+				ASSERT_EQUAL(routes.size(), expected.size());
+				set<vector<Graph::EdgeId>> distinct;
+				for (size_t i = 0; i < routes.size(); ++i) {
+					ASSERT_EQUAL(routes[i].weight, expected[i]);
+					Graph::VertexId current = from;
+					for (const Graph::EdgeId edge_id : routes[i].edges) {
+						ASSERT_EQUAL(graph.GetEdge(edge_id).from, current);
+						current = graph.GetEdge(edge_id).to;
+					}
+					ASSERT_EQUAL(current, to);
+					distinct.insert(routes[i].edges);
+				}
+				ASSERT_EQUAL(distinct.size(), routes.size());
+			}
+		}
+	}
+
+	// decimal weights round differently depending on where a sum starts,
+	// still no route may come twice and weights never go down beyond rounding
+	for (unsigned seed : {4, 5, 6}) {
+		const auto integral = RandomGraph(12, 60, seed);
+		Graph::DirectedWeightedGraph<double> graph(integral.GetVertexCount());
+		for (Graph::EdgeId edge_id = 0; edge_id < integral.GetEdgeCount(); ++edge_id) {
+			auto edge = integral.GetEdge(edge_id);
+			edge.weight = edge.weight / 10 + 0.1;
+			graph.AddEdge(edge);
+		}
+		Graph::DijkstraRouter<double> router(graph);
+		Graph::KShortestRoutes<double> alternatives(graph);
+		for (Graph::VertexId from = 0; from < graph.GetVertexCount(); ++from) {
+			for (Graph::VertexId to = 0; to < graph.GetVertexCount(); ++to) {
+				const auto routes = alternatives.FindRoutes(router, from, to, 30);
+				set<vector<Graph::EdgeId>> distinct;
+				for (size_t i = 0; i < routes.size(); ++i) {
+					ASSERT(distinct.insert(routes[i].edges).second);
+					ASSERT(i == 0 || routes[i - 1].weight <= routes[i].weight + 1e-9);
+				}
+			}
+		}
+	}
+
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30},
+		"base_requests": [{"type": "Bus", "name": "1", "stops": ["A", "B", "C"], "is_roundtrip": false},
+			{"type": "Bus", "name": "2", "stops": ["A", "C"], "is_roundtrip": false},
+			{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500, "C": 5000}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {"C": 2100}},
+			{"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.22, "road_distances": {}}],
+		"stat_requests": [{"type": "Routes", "from": "A", "to": "C", "count": 3, "id": 1},
+			{"type": "Routes", "from": "A", "to": "X", "count": 3, "id": 2}]})";
+	ostringstream output;
+	TransportGuider guider;
+	guider.ProcessQueries(ReadQueries(string_view(text)), output);
+	const auto answers = Json::Load(string_view(output.str())).GetRoot().AsArray();
+	const auto& routes = answers[0].AsMap().at("routes").AsArray();
+	// getting off bus 1 at B and on it again would ride through B twice
+	ASSERT_EQUAL(routes.size(), 2u);
+	ASSERT_EQUAL(routes[0].AsMap().at("total_time").AsDouble(), 9.2);
+	ASSERT_EQUAL(routes[1].AsMap().at("total_time").AsDouble(), 12.0);
+	ASSERT_EQUAL(routes[1].AsMap().at("items").AsArray().size(), 2u);
+	ASSERT_EQUAL(answers[1].AsMap().at("error_message").AsString(), string_view("not found"));
+}
+
+void TestMatrixQuery() {
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router": "contraction_hierarchy"},
+		"base_requests": [{"type": "Bus", "name": "1", "stops": ["A", "B", "C"], "is_roundtrip": false},
+			{"type": "Bus", "name": "2", "stops": ["A", "D"], "is_roundtrip": true},
+			{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500, "C": 5000, "D": 1000}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {"C": 2100}},
+			{"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.22, "road_distances": {}},
+			{"type": "Stop", "name": "D", "latitude": 55.59, "longitude": 37.19, "road_distances": {}}],
+		"stat_requests": [{"type": "Matrix", "from": ["A", "C", "D"], "to": ["C", "D"], "id": 1},
+			{"type": "Route", "from": "C", "to": "A", "id": 2},
+			{"type": "Matrix", "from": ["A"], "to": ["X"], "id": 3}]})";
+	ostringstream output;
+	TransportGuider guider;
+	guider.ProcessQueries(ReadQueries(string_view(text)), output);
+	const auto answers = Json::Load(string_view(output.str())).GetRoot().AsArray();
+	const auto& rows = answers[0].AsMap().at("times").AsArray();
+	ASSERT_EQUAL(rows.size(), 3u);
+	ASSERT_EQUAL(rows[0].AsArray()[0].AsDouble(), 9.2);
+	ASSERT_EQUAL(rows[0].AsArray()[1].AsDouble(), 4.0);
+	ASSERT_EQUAL(rows[1].AsArray()[0].AsDouble(), 0.0);
+	ASSERT_EQUAL(rows[1].AsArray()[1].AsDouble(), 9.2 + 4.0);
+	// bus 2 only goes from A to D
+	ASSERT_EQUAL(rows[2].AsArray()[0].AsDouble(), -1.0);
+	ASSERT_EQUAL(rows[2].AsArray()[1].AsDouble(), 0.0);
+	ASSERT_EQUAL(answers[1].AsMap().at("total_time").AsDouble(), 9.2);
+	ASSERT_EQUAL(answers[2].AsMap().at("error_message").AsString(), string_view("not found"));
+}
+
+void TestNearbyStopsQueries() {
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30},
+		"base_requests": [{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.20, "road_distances": {}},
+			{"type": "Stop", "name": "C", "latitude": 55.70, "longitude": 37.20, "road_distances": {}}],
+		"stat_requests": [{"type": "NearestStops", "latitude": 55.611, "longitude": 37.20, "count": 2, "id": 1},
+			{"type": "StopsInRadius", "latitude": 55.60, "longitude": 37.20, "radius": 2000, "id": 2},
+			{"type": "StopsInRadius", "latitude": 0, "longitude": 0, "radius": 2000, "id": 3}]})";
+	ostringstream output;
+	TransportGuider guider;
+	guider.ProcessQueries(ReadQueries(string_view(text)), output);
+	const auto answers = Json::Load(string_view(output.str())).GetRoot().AsArray();
+	const auto& nearest = answers[0].AsMap().at("stops").AsArray();
+	ASSERT_EQUAL(nearest.size(), 2u);
+	ASSERT_EQUAL(nearest[0].AsMap().at("name").AsString(), string_view("B"));
+	ASSERT_EQUAL(nearest[1].AsMap().at("name").AsString(), string_view("A"));
+	ASSERT(abs(nearest[1].AsMap().at("distance").AsDouble() - Length({ 55.611, 37.20 }, { 55.60, 37.20 })) < 1e-3);
+	const auto& within = answers[1].AsMap().at("stops").AsArray();
+	ASSERT_EQUAL(within.size(), 2u);
+	ASSERT_EQUAL(within[0].AsMap().at("name").AsString(), string_view("A"));
+	ASSERT_EQUAL(within[0].AsMap().at("distance").AsDouble(), 0.0);
+	ASSERT(answers[2].AsMap().at("stops").AsArray().empty());
+}
+
+void TestMetrics() {
+	LatencyHistogram histogram;
+	for (uint64_t nanoseconds = 1; nanoseconds <= 1000; ++nanoseconds) {
+		histogram.Record(nanoseconds);
+	}
+	ASSERT_EQUAL(histogram.Count(), 1000u);
+	ASSERT_EQUAL(histogram.Total(), 500500u);
+	ASSERT_EQUAL(histogram.Max(), 1000u);
+	// a bucket is at most an eighth of its power of two wide
+	ASSERT(histogram.Percentile(0.5) >= 500 && histogram.Percentile(0.5) <= 500 * 9 / 8);
+	ASSERT(histogram.Percentile(0.99) >= 990 && histogram.Percentile(0.99) <= 1000);
+	ASSERT_EQUAL(histogram.Percentile(1), 1000u);
+	ASSERT_EQUAL(LatencyHistogram().Percentile(0.5), 0u);
+
+	Metrics& metrics = Metrics::Instance();
+	metrics.Reset();
+	{
+		MEASURE_PHASE(Phase::OUTPUT);
+		CountMetric(Counter::NOT_FOUND);
+	}
+	ASSERT_EQUAL(metrics.Histogram(Phase::OUTPUT).Count(), 0u);
+	ASSERT_EQUAL(metrics.Value(Counter::NOT_FOUND), 0u);
+
+	Metrics::Enable();
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30},
+		"base_requests": [{"type": "Bus", "name": "1", "stops": ["A", "B"], "is_roundtrip": false},
+			{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {}}],
+		"stat_requests": [{"type": "Route", "from": "A", "to": "B", "id": 1},
+			{"type": "Route", "from": "A", "to": "X", "id": 2},
+			{"type": "Bus", "name": "1", "id": 3},
+			{"type": "Route", "from": "A", "to": "B", "id": 4}]})";
+	ostringstream output;
+	TransportGuider guider;
+	guider.ProcessQueries(ReadQueries(string_view(text)), output);
+	Metrics::Enable(false);
+
+	ASSERT_EQUAL(metrics.Histogram(Phase::PARSE).Count(), 1u);
+	ASSERT_EQUAL(metrics.Histogram(Phase::BASE_APPLY).Count(), 4u);
+	ASSERT_EQUAL(metrics.Histogram(Phase::ROUTE_QUERY).Count(), 3u);
+	ASSERT_EQUAL(metrics.Histogram(Phase::BUS_QUERY).Count(), 1u);
+	ASSERT_EQUAL(metrics.Histogram(Phase::ROUTER_PREPROCESSING).Count(), 1u);
+	ASSERT_EQUAL(metrics.Value(Counter::NOT_FOUND), 1u);
+	ASSERT_EQUAL(metrics.Value(Counter::GRAPH_REBUILDS), 1u);
+	// the unknown stop never reaches the cache, the repeated route is a hit
+	const CacheStats cache = guider.RouteCacheStats();
+	ASSERT_EQUAL(cache.hits, 1u);
+	ASSERT_EQUAL(cache.misses, 1u);
+	ASSERT_EQUAL(metrics.Value(Counter::ROUTE_CACHE_HITS), cache.hits);
+	ASSERT_EQUAL(metrics.Value(Counter::ROUTE_CACHE_MISSES), cache.misses);
+	ASSERT_EQUAL(metrics.Value(Counter::ROUTE_CACHE_EVICTIONS), 0u);
+	ASSERT_EQUAL(metrics.Value(Counter::ROUTE_CACHE_BYTES), cache.bytes);
+	ASSERT(cache.bytes > 0);
+	const Json::Node json = metrics.ToJson();
+	const auto& route = json.AsMap().at("phases").AsMap().at("route_query").AsMap();
+	ASSERT_EQUAL(route.at("count").AsDouble(), 3.0);
+	ASSERT_EQUAL(json.AsMap().at("counters").AsMap().at("route_cache_hits").AsDouble(), 1.0);
+	ASSERT(route.at("max_ns").AsDouble() >= route.at("p50_ns").AsDouble());
+	metrics.Reset();
+}
+
+void TestJsonLoad() {
+	const string text = R"({"base_requests": [{"type": "Stop", "name": "A \"B\"", "latitude": 55.611087,
+		"longitude": -37.20829, "road_distances": {}}, {"is_roundtrip": true, "stops": [], "big": 1e3}],
+		"empty": [], "flag": false})";
+	const Json::Document doc = Json::Load(string_view(text));
+	const auto& root = doc.GetRoot().AsMap();
+	const auto& requests = root.at("base_requests").AsArray();
+	ASSERT_EQUAL(requests.size(), 2u);
+	ASSERT_EQUAL(requests[0].AsMap().at("name").AsString(), string_view("A \"B\""));
+	ASSERT_EQUAL(requests[0].AsMap().at("latitude").AsDouble(), 55.611087);
+	ASSERT_EQUAL(requests[0].AsMap().at("longitude").AsDouble(), -37.20829);
+	ASSERT(requests[0].AsMap().at("road_distances").AsMap().empty());
+	ASSERT(requests[1].AsMap().at("is_roundtrip").AsBool());
+	ASSERT_EQUAL(requests[1].AsMap().at("big").AsDouble(), 1000.0);
+	ASSERT(root.at("empty").AsArray().empty());
+	ASSERT(!root.at("flag").AsBool());
+
+	// both parsers agree on the format they share
+	const string plain = R"({"a": [1, -2.5, "x y", {"b": true}], "c": {}})";
+	istringstream input(plain);
+	ASSERT(Json::LoadStream(input).GetRoot() == Json::Load(string_view(plain)).GetRoot());
+	// and so do both allocation modes
+	ASSERT(Json::Load(string_view(text), Json::Allocation::HEAP).GetRoot() == doc.GetRoot());
+
+	// an array written item by item comes out as the whole of it would
+	for (const auto& items : { Json::Array{}, Json::Load(string_view(plain)).GetRoot().AsMap().at("a").AsArray() }) {
+		ostringstream whole, streamed;
+		Json::UploadDocument(Json::Document(Json::Node(items)), whole);
+		Json::ArrayWriter writer(streamed);
+		for (const auto& item : items) {
+			writer.Write(item);
+		}
+		writer.Finish();
+		ASSERT_EQUAL(streamed.str(), whole.str());
+	}
+	// and so does a document written event by event, empty containers included
+	{
+		ostringstream whole;
+		Json::UploadDocument(doc, whole);
+		Json::OutputBuffer buffer;
+		Json::Writer writer(buffer);
+		Json::Traverse(doc.GetRoot(), writer);
+		ASSERT_EQUAL(string(buffer.Text()), whole.str());
+
+		ostringstream items;
+		Json::ArrayWriter array(items);
+		Json::Traverse(doc.GetRoot(), array.Items());
+		array.Write(root.at("empty"));
+		array.Finish();
+		ostringstream both;
+		Json::UploadDocument(Json::Document(Json::Node(Json::Array{ doc.GetRoot(), root.at("empty") })), both);
+		ASSERT_EQUAL(items.str(), both.str());
+	}
+
+	bool thrown = false;
+	try {
+		Json::Load(string_view(R"({"a": [1, 2})"));
+	}
+	catch (const Json::ParsingError&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void TestJsonDict() {
+	// keys of a small object and of one past the linear lookup come out sorted,
+	// of a repeated key the first value stays
+	for (const string& text : { string(R"({"type": "Stop", "name": "A", "type": "Bus", "latitude": 1})"),
+		string(R"({"k9": 9, "k3": 3, "k7": 7, "k1": 1, "k5": 5, "k0": 0, "k8": 8, "k2": 2, "k6": 6, "k4": 4, "k3": 33})") }) {
+		const Json::Document doc = Json::Load(string_view(text));
+		const Json::Dict& dict = doc.GetRoot().AsMap();
+		ASSERT(is_sorted(dict.begin(), dict.end(), [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; }));
+		for (const auto& [key, value] : dict) {
+			ASSERT(&dict.at(key) == &value);
+		}
+		ASSERT_EQUAL(dict.count("missing"), 0u);
+		ASSERT(dict.find("") == dict.end());
+	}
+	const Json::Dict small = Json::Load(string_view(R"({"type": "Stop", "type": "Bus"})")).GetRoot().AsMap();
+	ASSERT_EQUAL(small.size(), 1u);
+	ASSERT_EQUAL(small.at("type").AsString(), string_view("Stop"));
+
+	Json::Dict dict;
+	for (int i = 20; i > 0; --i) {
+		dict["key" + to_string(i)] = Json::Node(static_cast<double>(i));
+	}
+	ASSERT(!dict.emplace("key7", Json::Node(0.0)).second);
+	ASSERT_EQUAL(dict.size(), 20u);
+	ASSERT_EQUAL(dict.at("key7").AsDouble(), 7.0);
+	ASSERT_EQUAL(dict.begin()->first, string_view("key1"));
+}
+
+void TestReadQueriesFromEvents() {
+	const string text = R"({"stat_requests": [{"type": "Route", "from": "A", "to": "B", "id": 3}],
+		"render_settings": {"layers": [{"type": "Stop"}]},
+		"base_requests": [{"type": "Bus", "name": "1", "stops": ["A", "B"], "is_roundtrip": false},
+			{"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.2, "road_distances": {"B": 100}}],
+		"routing_settings": {"bus_wait_time": 6, "bus_velocity": 30, "router": "a_star"}})";
+	const vector<Query> queries = ReadQueries(string_view(text));
+	ASSERT_EQUAL(queries.size(), 4u);
+	ASSERT(TypeOf(queries[0]) == QueryType::SETTINGS);
+	ASSERT_EQUAL(get<SettingsQuery>(queries[0]).b_vel, 0.5);
+	ASSERT(get<SettingsQuery>(queries[0]).router == RouterType::A_STAR);
+	ASSERT_EQUAL(get<BusStopsQuery>(queries[1]).stops, vector<string>({ "A", "B" }));
+	ASSERT(!get<BusStopsQuery>(queries[1]).is_circled);
+	ASSERT(get<StopQuery>(queries[2]).distances == Distances({ { "B", 100.0 } }));
+	ASSERT(TypeOf(queries[3]) == QueryType::ROUTE);
+	ASSERT_EQUAL(get<RouteQuery>(queries[3]).to, string("B"));
+	ASSERT_EQUAL(get<RouteQuery>(queries[3]).req_id, 3);
+
+	const vector<Query> from_tree = ReadQueries(Json::Load(string_view(text)));
+	ASSERT_EQUAL(from_tree.size(), queries.size());
+	ASSERT_EQUAL(get<StopQuery>(from_tree[2]).coords.latitude, 55.6);
+
+	// counts come from clients: too big ones are cut down, broken ones rejected
+	auto counted = [](const string& type, const string& count) {
+		return ReadQueries(string_view(R"({"stat_requests": [{"type": ")" + type
+			+ R"(", "from": "A", "to": "B", "latitude": 55.6, "longitude": 37.2, "count": )" + count + R"(, "id": 1}]})"));
+	};
+	ASSERT_EQUAL(get<RoutesQuery>(counted("Routes", "3")[0]).count, 3u);
+	ASSERT_EQUAL(get<RoutesQuery>(counted("Routes", "1e30")[0]).count, RoutesQuery::MAX_COUNT);
+	ASSERT_EQUAL(get<NearestStopsQuery>(counted("NearestStops", "0")[0]).count, 0u);
+	ASSERT_EQUAL(get<NearestStopsQuery>(counted("NearestStops", "100000")[0]).count, NearestStopsQuery::MAX_COUNT);
+	for (const string type : { "Routes", "NearestStops" }) {
+		for (const string count : { "-1", "2.5" }) {
+			bool thrown = false;
+			try {
+				counted(type, count);
+			}
+			catch (const invalid_argument&) {
+				thrown = true;
+			}
+			ASSERT(thrown);
+		}
+	}
+}
+
+// Roads of bus 1 are far shorter than the straight lines between its stops,
+// and its middle stop is far from the target: a straight-line bound would
+// overestimate there and let the slow bus 2 reach the target first
+void TestAStarWithShortRoads() {
+	const string base = R"("base_requests": [{"type": "Bus", "name": "1", "stops": ["S", "X", "T"], "is_roundtrip": true},
+			{"type": "Bus", "name": "2", "stops": ["S", "T"], "is_roundtrip": true},
+			{"type": "Stop", "name": "S", "latitude": 55.600, "longitude": 37.20, "road_distances": {"X": 100, "T": 5000}},
+			{"type": "Stop", "name": "X", "latitude": 55.700, "longitude": 37.20, "road_distances": {"T": 100}},
+			{"type": "Stop", "name": "T", "latitude": 55.605, "longitude": 37.20, "road_distances": {}}],
+		"stat_requests": [{"type": "Route", "from": "S", "to": "T", "id": 1}]})";
+	for (const string router : { "dijkstra", "a_star" }) {
+		const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router": ")" + router + R"("}, )" + base;
+		ostringstream output;
+		TransportGuider().ProcessQueries(ReadQueries(string_view(text)), output);
+		const Json::Document answers = Json::Load(string_view(output.str()));
+		ASSERT_EQUAL(answers.GetRoot().AsArray()[0].AsMap().at("total_time").AsDouble(), 2.4);
+	}
+}
+
+void TestBusWithoutStops() {
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30},
+		"base_requests": [{"type": "Bus", "name": "empty", "stops": [], "is_roundtrip": false},
+			{"type": "Bus", "name": "ring", "stops": [], "is_roundtrip": true},
+			{"type": "Bus", "name": "1", "stops": ["A", "B"], "is_roundtrip": false},
+			{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {}}],
+		"stat_requests": [{"type": "Bus", "name": "empty", "id": 1}, {"type": "Bus", "name": "ring", "id": 2},
+			{"type": "Bus", "name": "1", "id": 3}, {"type": "Route", "from": "A", "to": "B", "id": 4}]})";
+	TransportGuider guider;
+	vector<Query> queries = ReadQueries(string_view(text));
+	for (auto& query : queries) {
+		if (!IsStatQuery(TypeOf(query))) guider.ProcessQuery(query);
+	}
+	guider.Finalize();
+	for (const BusId bus : { 0, 1 }) {
+		const BusStats& stats = guider.CheckBuses()[bus].stats;
+		ASSERT_EQUAL(stats.stop_count, 0u);
+		ASSERT_EQUAL(stats.unique_stop_count, 0u);
+		ASSERT_EQUAL(stats.length, 0.0);
+		ASSERT_EQUAL(stats.real_length, 0.0);
+	}
+
+	// a bus without stops has no stats to show, other answers are not affected
+	ostringstream output;
+	TransportGuider().ProcessQueries(ReadQueries(string_view(text)), output);
+	const Json::Document answers = Json::Load(string_view(output.str()));
+	const auto& nodes = answers.GetRoot().AsArray();
+	ASSERT_EQUAL(nodes.size(), 4u);
+	ASSERT(nodes[0].AsMap().count("error_message"));
+	ASSERT(nodes[1].AsMap().count("error_message"));
+	ASSERT_EQUAL(nodes[2].AsMap().at("stop_count").AsDouble(), 3.0);
+	ASSERT_EQUAL(nodes[2].AsMap().at("route_length").AsDouble(), 3000.0);
+	ASSERT_EQUAL(nodes[3].AsMap().at("total_time").AsDouble(), 5.0);
+}
+
+void TestBaseSerialization() {
+	const string text = R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router": "contraction_hierarchy"},
+		"base_requests": [{"type": "Bus", "name": "14", "stops": ["A", "B", "C"], "is_roundtrip": false},
+			{"type": "Bus", "name": "7", "stops": ["C", "D", "C"], "is_roundtrip": true},
+			{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {"C": 2100}},
+			{"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.22, "road_distances": {"D": 900}},
+			{"type": "Stop", "name": "D", "latitude": 55.63, "longitude": 37.23, "road_distances": {}}],
+		"stat_requests": [{"type": "Route", "from": "A", "to": "D", "id": 1}, {"type": "Route", "from": "D", "to": "A", "id": 2},
+			{"type": "Bus", "name": "14", "id": 3}, {"type": "Stop", "name": "C", "id": 4}]})";
+	ostringstream expected;
+	TransportGuider guider;
+	guider.ProcessQueries(ReadQueries(string_view(text)), expected);
+
+	ostringstream base;
+	guider.Serialize(base);
+	TransportGuider loaded;
+	loaded.Deserialize(base.str());
+	vector<Query> stat_queries;
+	for (auto& query : ReadQueries(string_view(text))) {
+		if (!holds_alternative<StopQuery>(query) && !holds_alternative<BusStopsQuery>(query) && !holds_alternative<SettingsQuery>(query)) {
+			stat_queries.push_back(move(query));
+		}
+	}
+	ostringstream answers;
+	loaded.ProcessQueries(move(stat_queries), answers);
+	ASSERT_EQUAL(answers.str(), expected.str());
+
+	// process_requests gets the settings and base requests again and ignores them,
+	// the loaded graph is not rebuilt
+	ostringstream made_base;
+	TransportGuider().MakeBase(ReadQueries(string_view(text)), made_base);
+	Metrics& metrics = Metrics::Instance();
+	metrics.Reset();
+	Metrics::Enable();
+	ostringstream requests_answers;
+	TransportGuider().ProcessRequests(ReadQueries(string_view(text)), made_base.str(), requests_answers);
+	Metrics::Enable(false);
+	ASSERT_EQUAL(requests_answers.str(), expected.str());
+	ASSERT_EQUAL(metrics.Value(Counter::GRAPH_REBUILDS), 0u);
+	ASSERT_EQUAL(metrics.Histogram(Phase::BASE_LOAD).Count(), 1u);
+	metrics.Reset();
+
+	bool thrown = false;
+	try {
+		TransportGuider().Deserialize(base.str().substr(0, 100));
+	}
+	catch (const BinaryFormatError&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void TestIncrementalGraph() {
+	const vector<string> phases = {
+		R"({"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.20, "road_distances": {"B": 1500}},
+			{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {"C": 2100}},
+			{"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.22, "road_distances": {}},
+			{"type": "Bus", "name": "1", "stops": ["A", "B", "C"], "is_roundtrip": false})",
+		R"({"type": "Stop", "name": "D", "latitude": 55.63, "longitude": 37.23, "road_distances": {"C": 900, "E": 700}},
+			{"type": "Stop", "name": "E", "latitude": 55.64, "longitude": 37.24, "road_distances": {"A": 6000}},
+			{"type": "Bus", "name": "2", "stops": ["C", "D", "E"], "is_roundtrip": false},
+			{"type": "Bus", "name": "3", "stops": ["E", "A", "E"], "is_roundtrip": true})",
+		R"({"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.21, "road_distances": {"C": 300}})",
+		R"({"type": "Bus", "name": "3", "stops": ["A", "B"], "is_roundtrip": false})",
+	};
+	const string stat_requests = R"([{"type": "Route", "from": "A", "to": "E", "id": 1},
+		{"type": "Route", "from": "E", "to": "A", "id": 2}, {"type": "Route", "from": "C", "to": "A", "id": 3}])";
+
+	for (const string router : { "floyd_warshall", "dijkstra", "a_star", "contraction_hierarchy" }) {
+		for (const string model : { "complete", "linear" }) {
+			const string settings = R"("routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router": ")"
+				+ router + R"(", "bus_graph": ")" + model + R"("})";
+			TransportGuider incremental;
+			string base_requests;
+			for (size_t phase = 0; phase < phases.size(); ++phase) {
+				const string phase_settings = phase == 0 ? settings + ", " : "";
+				ostringstream answers;
+				incremental.ProcessQueries(ReadQueries(string_view("{" + phase_settings + R"("base_requests": [)"
+					+ phases[phase] + R"(], "stat_requests": )" + stat_requests + "}")), answers);
+
+				base_requests += (phase == 0 ? "" : ", ") + phases[phase];
+				ostringstream expected;
+				TransportGuider().ProcessQueries(ReadQueries(string_view("{" + settings + R"(, "base_requests": [)"
+					+ base_requests + R"(], "stat_requests": )" + stat_requests + "}")), expected);
+
+				const auto answer_nodes = Json::Load(string_view(answers.str())).GetRoot().AsArray();
+				const auto expected_nodes = Json::Load(string_view(expected.str())).GetRoot().AsArray();
+				ASSERT_EQUAL(answer_nodes.size(), expected_nodes.size());
+				for (size_t i = 0; i < answer_nodes.size(); ++i) {
+					const auto& answer = answer_nodes[i].AsMap();
+					const auto& expected_answer = expected_nodes[i].AsMap();
+					ASSERT_EQUAL(answer.count("total_time"), expected_answer.count("total_time"));
+					if (answer.count("total_time")) {
+						ASSERT(abs(answer.at("total_time").AsDouble() - expected_answer.at("total_time").AsDouble()) < 1e-9);
+					}
+				}
+			}
+		}
+	}
+}
+
 void Test1() {
 	ifstream input("final\\input4.json");
 	ofstream out("final\\log.txt");
 	LOG_DURATION("Final test");
 	if (input.is_open()) {
-		vector<QueryPtr> queries;
+		vector<Query> queries;
 		{
 			LOG_DURATION("READING");
 			queries = ReadQueries(input);
@@ -25,5 +809,24 @@ void Test1() {
 
 void TestAll() {
 	TestRunner tr;
+	RUN_TEST(tr, TestJsonLoad);
+	RUN_TEST(tr, TestJsonDict);
+	RUN_TEST(tr, TestGeoPoints);
+	RUN_TEST(tr, TestGeoIndex);
+	RUN_TEST(tr, TestLruCache);
+	RUN_TEST(tr, TestShardedLruCacheParallel);
+	RUN_TEST(tr, TestMetrics);
+	RUN_TEST(tr, TestReadQueriesFromEvents);
+	RUN_TEST(tr, TestDijkstraRouter);
+	RUN_TEST(tr, TestContractionHierarchyRouter);
+	RUN_TEST(tr, TestRoutersAddEdges);
+	RUN_TEST(tr, TestNarrowRouters);
+	RUN_TEST(tr, TestKShortestRoutes);
+	RUN_TEST(tr, TestMatrixQuery);
+	RUN_TEST(tr, TestNearbyStopsQueries);
+	RUN_TEST(tr, TestAStarWithShortRoads);
+	RUN_TEST(tr, TestBusWithoutStops);
+	RUN_TEST(tr, TestBaseSerialization);
+	RUN_TEST(tr, TestIncrementalGraph);
 	RUN_TEST(tr, Test1);
 }
\ No newline at end of file